@@ -18,9 +18,44 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 typedef float ctensor_data_t;
 
+/*
+ *  CPU affinity policies for worker threads.
+*/
+enum {
+    // Let the OS schedule threads (default).
+    CT_AFFINITY_NONE = 0,
+    // Fill all CPUs of a NUMA node before moving on to the next.
+    CT_AFFINITY_COMPACT,
+    // Spread threads round-robin over NUMA nodes.
+    CT_AFFINITY_SCATTER,
+};
+
+/*
+ *  Huge page policies for large tensors.
+*/
+enum {
+    // Regular pages, from malloc (default).
+    CT_HUGE_PAGES_NONE = 0,
+    // Transparent huge pages, madvise(MADV_HUGEPAGE).
+    CT_HUGE_PAGES_THP,
+    // Reserved huge pages, MAP_HUGETLB (then THP if none are left).
+    CT_HUGE_PAGES_HUGETLB,
+};
+
+/*
+ *  How an ensemble combines its members' outputs.
+*/
+enum {
+    // Average of the members' outputs.
+    CT_ENSEMBLE_MEAN = 0,
+    // Fraction of members whose largest output is each one.
+    CT_ENSEMBLE_VOTE,
+};
+
 typedef struct {
     size_t          size;
     ctensor_data_t  *data;
@@ -58,6 +93,13 @@ typedef struct _layer_s {
      *  that the layer needs without forcing this to be a
      *  single Tensor/variable. */
     void                *internal;
+    /*  Non-zero if 'internal' is only ever read by the
+     *  layer's callbacks (e.g. fixed parameters), so that
+     *  thread replicas of the model can share it.
+     *
+     *  Otherwise the model isn't replicated (Hogwild!,
+     *  local SGD) at all. */
+    int                 shared_internal;
     /*  Gradient of each 'in' element,
      *  with respect to the loss function.
      *  Gradient which will be backpropagated to
@@ -78,6 +120,31 @@ typedef struct _layer_s {
      *  will be interpreted as this layer not having
      *  any "trainable" variables. */
     CTensor_s           *internal_grad;
+    /*  Trainable parameters of the layer, exported as a
+     *  single tensor laid out exactly like 'internal_grad'.
+     *
+     *  The Model Abstraction API only reads/writes it as
+     *  a whole (e.g. to snapshot and restore the best
+     *  parameters seen during training); it's still the
+     *  layer's responsability to allocate and deallocate it.
+     *
+     *  Shall be NULL if 'internal_grad' is NULL. */
+    CTensor_s           *internal_params;
+    /*  Shape of the 2-D kernel stored at the start of
+     *  'internal_params' (rows x columns, row-major), for
+     *  optimizers that keep per-matrix statistics.
+     *
+     *  Both 0 if the layer has no such kernel. */
+    size_t              kernel_rows;
+    size_t              kernel_cols;
+    /*  Layers whose outputs feed this one, in DAG models
+     *  (see ctensor_add_node); 'in' is then the first one's
+     *  output, and 'in_grad' holds the gradient of each
+     *  input, back to back.
+     *
+     *  NULL for layers fed by 'prev' alone. */
+    struct _layer_s     **inputs;
+    size_t              ninputs;
 } CTensor_Layer_s;
 
 struct _loss_s;
@@ -101,6 +168,28 @@ typedef struct _loss_s {
     CTensor_s           *in_grad;
 } CTensor_Loss_s;
 
+/*
+ *  Layout of one layer's block inside the model's flat
+ *  gradient vector, so that optimizers can work layer-wise.
+*/
+typedef struct {
+    // Offset of the block within the gradient vector.
+    size_t              offset;
+    // Number of elements of the block.
+    size_t              size;
+    // The layer's parameters ('internal_params').
+    CTensor_s           *params;
+    // Index of the layer's parameter matching the block's
+    // first element, non-zero when the block only covers
+    // the tail of the layer (sharded optimizer state).
+    size_t              first;
+    // Shape of the layer's kernel, stored at the start
+    // of the block (both 0 if none, or if the block only
+    // covers part of the layer).
+    size_t              rows;
+    size_t              cols;
+} CTensor_Segment_s;
+
 struct _optimizer_s;
 
 typedef void (*CTensor_Optimize_cb)(struct _optimizer_s *, CTensor_s *, ctensor_data_t);
@@ -108,9 +197,124 @@ typedef void (*CTensor_Optimize_cb)(struct _optimizer_s *, CTensor_s *, ctensor_
 typedef struct _optimizer_s {
     CTensor_Optimize_cb opt;
     CTensor_Layer_cb    del;
+    // Init callback the optimizer was set up with, to set
+    // up copies of it (e.g. for model replicas).
+    CTensor_Layer_cb    init;
     void                *internal;
+    /*  Per-layer layout of the gradient vector handed to
+     *  'opt', filled by the Model Abstraction API before
+     *  training (in the same order as the gradient vector).
+     *
+     *  NULL if unknown, layer-wise optimizers shall then
+     *  treat the whole gradient vector as a single block. */
+    CTensor_Segment_s   *segments;
+    size_t              nsegments;
+    // Hyperparameters, for optimizers that make use of them.
+    ctensor_data_t      momentum;
+    ctensor_data_t      weight_decay;
+    // Trust coefficient of layer-wise (LARS) updates.
+    ctensor_data_t      eta;
 } CTensor_Optimizer_s;
 
+struct _scheduler_s;
+
+typedef ctensor_data_t (*CTensor_Schedule_cb)(struct _scheduler_s *, size_t, size_t, ctensor_data_t);
+
+typedef struct _scheduler_s {
+    // Returns the learning rate to use at the given
+    // optimization step, out of the total number of steps,
+    // from the model's (peak) learning rate.
+    CTensor_Schedule_cb lr;
+    // Linear warmup from 0 up to the learning rate,
+    // over the first 'warmup_steps' steps.
+    size_t              warmup_steps;
+    // Total number of optimization steps, used by the
+    // annealing schedules. If 0, each training run
+    // derives it from its epochs and batches (this
+    // is left as 0).
+    size_t              total_steps;
+    // Step decay: multiply by 'gamma' every 'step_size' steps.
+    size_t              step_size;
+    ctensor_data_t      gamma;
+    // Final learning rate for cosine annealing and one-cycle.
+    ctensor_data_t      min_lr;
+    // One-cycle: fraction of steps spent rising from
+    // lr / 'div_factor' up to lr.
+    ctensor_data_t      pct_start;
+    ctensor_data_t      div_factor;
+} CTensor_Scheduler_s;
+
+struct _compressor_s;
+
+typedef size_t (*CTensor_Encode_cb)(struct _compressor_s *, ctensor_data_t *, size_t, void *);
+typedef int (*CTensor_Decode_cb)(struct _compressor_s *, const void *, size_t, ctensor_data_t *, size_t);
+
+/*
+ *  Gradient compressor, cuts the number of bytes a
+ *  communicator puts on the wire.
+*/
+typedef struct _compressor_s {
+    // Encode n elements into 'dst', returning the number of
+    // bytes written (an upper bound if 'dst' is NULL).
+    CTensor_Encode_cb   encode;
+    // Decode 'bytes' bytes, adding the elements to 'dst' (of
+    // n elements). Returns -1, adding nothing, if the bytes
+    // aren't a valid encoding for 'dst'.
+    CTensor_Decode_cb   decode;
+    // Cleanup (shall be cast from a void (*)(CTensor_Compressor_s *)).
+    CTensor_Layer_cb    del;
+    // Drop any state kept between transfers (e.g. residuals),
+    // called as training starts. May be NULL (same cast as 'del').
+    CTensor_Layer_cb    reset;
+    // Bytes per element of elementwise compressors (e.g. fp16),
+    // applied to every gradient transfer. 0 for sparse
+    // compressors, which encode each worker's whole tensor once.
+    size_t              elem_size;
+    // Fraction of the elements sent by sparse compressors.
+    ctensor_data_t      ratio;
+    void                *internal;
+} CTensor_Compressor_s;
+
+struct _comm_s;
+
+typedef void (*CTensor_Comm_cb)(struct _comm_s *, CTensor_s *);
+
+/*
+ *  Communicator for data-parallel training, each worker
+ *  (process) trains on its own shard of the data, and the
+ *  gradients are averaged across all workers before every
+ *  optimization step.
+ *
+ *  All workers must start from the same parameters (e.g.
+ *  by initializing them with the same seed).
+*/
+typedef struct _comm_s {
+    // Average the tensor across all workers, in place.
+    CTensor_Comm_cb     allreduce;
+    /*  Sharded collectives, the tensor is split into
+     *  world_size shards, worker r owning elements
+     *  [n * r / world_size, n * (r + 1) / world_size).
+     *
+     *  reduce_scatter averages only this worker's shard
+     *  (the rest of the tensor is left undefined), and
+     *  allgather copies every worker's shard to all, never
+     *  compressed. */
+    CTensor_Comm_cb     reduce_scatter;
+    CTensor_Comm_cb     allgather;
+    // Cleanup (shall be cast from a void (*)(CTensor_Comm_s *)).
+    CTensor_Layer_cb    del;
+    // This worker's index, and the number of workers.
+    int                 rank;
+    int                 world_size;
+    // Non-zero once a collective has failed (e.g. a peer
+    // went away), all later collectives are no-ops, and
+    // ctensor_train stops.
+    int                 error;
+    // Gradient compression, NULL to send full fp32 values.
+    CTensor_Compressor_s *compressor;
+    void                *internal;
+} CTensor_Comm_s;
+
 struct _model_s;
 
 typedef struct _model_s {
@@ -120,16 +324,97 @@ typedef struct _model_s {
     CTensor_Layer_s     *startl;
     // Last added layer, output layer.
     CTensor_Layer_s     *lastl;
+    // Execution plan of DAG models (see ctensor_add_node),
+    // NULL for Sequential ones.
+    struct _ct_graph_s  *graph;
     // Loss layer, not added to linked list,
     // as it will only be used during backprop.
     // lossl->prev = lastl;
     CTensor_Loss_s      *lossl;
     CTensor_Optimizer_s *optimizer;
+    // Learning rate schedule (NULL for a constant
+    // learning rate).
+    CTensor_Scheduler_s *scheduler;
+    // Data-parallel communicator (NULL when training on a
+    // single process). It's owned by the user.
+    CTensor_Comm_s      *comm;
+    // Overlap gradient communication with backprop, in
+    // buckets of at least 'bucket_size' elements (layers
+    // are never split). 0 communicates after backprop.
+    size_t              bucket_size;
+    /*  Shard the optimizer across workers (ZeRO-style),
+     *  each worker only keeps the optimizer state of, and
+     *  computes the update for its 1/world_size of the
+     *  parameters. Gradients are reduce-scattered, and the
+     *  updates all-gathered.
+     *
+     *  Layer-wise optimizers (LAMB, LARS) then compute their
+     *  ratios over each worker's part of a layer, and
+     *  Adafactor doesn't factor layers split across workers.
+     *  Communication isn't overlapped ('bucket_size' is
+     *  ignored). */
+    int                 shard_optimizer;
+    /*  Pipeline parallelism, split the layers into 'stages'
+     *  stages of consecutive layers (balanced by number of
+     *  parameters), each run by its own thread, with the
+     *  batch's examples flowing through them (1F1B schedule).
+     *
+     *  Parameters are only updated between batches, results
+     *  match sequential training. 0 or 1 disables it, and
+     *  'bucket_size' is ignored when pipelined. */
+    size_t              stages;
+    /*  Hogwild! training, 'hogwild' threads (run on the
+     *  thread pool, see ctensor_set_threads) each train a
+     *  replica of the model on their own batches, adding
+     *  plain SGD updates into the shared parameters without
+     *  any locking nor synchronization between them.
+     *
+     *  Meant for sparse inputs, where updates rarely collide.
+     *  The optimizer, 'accum_steps' and 'comm' are ignored,
+     *  and the tensors handed by the batch callback shall
+     *  stay valid for the whole epoch. 0 or 1 disables it. */
+    size_t              hogwild;
+    /*  Local SGD, 'local_sgd' threads each train a replica of
+     *  the model (parameters and optimizer state included) on
+     *  their own batches, for 'local_steps' steps (8 by
+     *  default), after which the replicas are averaged.
+     *
+     *  With 'elastic' non-zero, replicas are instead pulled
+     *  towards a center variable (and it towards them) by
+     *  'elastic' times their difference, elastic averaging,
+     *  which needs 'elastic' below 1 / local_sgd.
+     *
+     *  Replicas are synchronized at the end of every epoch.
+     *  'accum_steps' and 'comm' are ignored, and the tensors
+     *  handed by the batch callback shall stay valid for a
+     *  whole round. 0 or 1 disables it. */
+    size_t              local_sgd;
+    size_t              local_steps;
+    ctensor_data_t      elastic;
     size_t              epochs;
     size_t              batch_size;
     size_t              batches;
+    // Gradient accumulation, number of batches (micro-batches)
+    // whose gradients are accumulated before each optimization
+    // step. The effective batch size is accum_steps * batch_size.
+    size_t              accum_steps;
     // Hyperparameters.
     ctensor_data_t      learning_rate;
+    /*  Early stopping.
+     *
+     *  The validation loss is evaluated every 'val_interval'
+     *  epochs (0 disables validation), training stops once
+     *  it hasn't improved by at least 'min_delta' for
+     *  'patience' consecutive evaluations (0 never stops
+     *  early). The best-seen parameters are restored
+     *  once training ends. */
+    size_t              val_interval;
+    size_t              patience;
+    ctensor_data_t      min_delta;
+    // Filled by ctensor_train: best validation loss seen,
+    // and the number of epochs that were actually run.
+    ctensor_data_t      best_vloss;
+    size_t              stop_epoch;
 } CTensor_Model_s;
 
 /*
@@ -151,6 +436,69 @@ typedef struct _model_s {
 */
 typedef void (*CTensor_Batch_cb)(CTensor_s **, CTensor_s **, int);
 
+/*
+ *  A dataset, all inputs and all expected outputs stored
+ *  contiguously (as batches are).
+*/
+typedef struct {
+    // Inputs (samples x in_size) and expected outputs
+    // (samples x out_size).
+    CTensor_s           x;
+    CTensor_s           y;
+    size_t              samples;
+    size_t              in_size;
+    size_t              out_size;
+    // File mapping, if mapped by ctensor_dataset_map.
+    void                *map;
+    size_t              map_size;
+} CTensor_Dataset_s;
+
+/*
+ *  Sets up the model of one run of a sweep (layers, loss,
+ *  optimizer and hyperparameters, 'epochs' and 'batch_size'
+ *  included), called on the thread that will train it.
+ *
+ *  The model is handed zeroed, and shall be initialized
+ *  with ctensor_init. 'batches' may be left as 0 to train
+ *  over the whole training set.
+ *
+ *  The first argument is the model, the second is the run's
+ *  index, the third is the sweep's user argument.
+*/
+typedef void (*CTensor_Sweep_cb)(CTensor_Model_s *, size_t, void *);
+
+/*
+ *  Results of one run of a sweep.
+*/
+typedef struct {
+    // Training loss of the last epoch.
+    ctensor_data_t      loss;
+    // Validation loss and accuracy (largest output matching
+    // the largest expected one), NaN without a validation set.
+    ctensor_data_t      vloss;
+    ctensor_data_t      accuracy;
+    // Epochs actually run (early stopping may cut them short).
+    size_t              epochs;
+    // Wall-clock time of the run, setup included.
+    double              seconds;
+    // Non-zero if the run couldn't be trained (e.g. its
+    // model doesn't match the dataset).
+    int                 error;
+} CTensor_Run_s;
+
+/*
+ *  An ensemble of trained models, evaluated together.
+*/
+typedef struct {
+    CTensor_Model_s     **models;
+    size_t              count;
+    // CT_ENSEMBLE_MEAN or CT_ENSEMBLE_VOTE.
+    int                 combine;
+    // Combined output.
+    CTensor_s           *out;
+    void                *internal;
+} CTensor_Ensemble_s;
+
 /*
  *  Initialize model.
  *
@@ -169,6 +517,41 @@ void ctensor_init(CTensor_Model_s *model, size_t in_size);
 */
 CTensor_Layer_s *ctensor_add_layer(CTensor_Model_s *model, size_t out_size, CTensor_Layer_cb init_cb);
 
+/*
+ *  Set the next layer to the model, fed by the given
+ *  (previously added) layers instead of the last one,
+ *  making the model a DAG: branches, residual connections,
+ *  and layers merging several of them (ctensor_merge_add,
+ *  ctensor_merge_concat). The last added layer is still
+ *  the model's output, every other layer shall feed some
+ *  layer (or the model can't be trained).
+ *
+ *  Layers of a DAG model run level by level, those of a
+ *  level (independent branches) concurrently on the thread
+ *  pool. Predictions keep intermediate outputs in a single
+ *  buffer, shared according to their liveness.
+ *
+ *  Pipeline stages, Hogwild! and local SGD replicas aren't
+ *  used with DAG models (they're trained on one thread),
+ *  nor can they be stacked (ctensor_stack_train).
+ *
+ *  @param model - Pointer to the model.
+ *  @param inputs - Layers feeding this one.
+ *  @param ninputs - Number of them.
+ *  @param out_size - Number of output nodes of the layer.
+ *  @param init_cb - Init callback function
+ *  (function shall be casted to CTensor_Layer_cb).
+ *
+ *  @return - The layer, NULL if there are no inputs, more
+ *  than one for a layer that isn't a merge, an input isn't
+ *  a layer of 'model', sizes don't match the merge (inputs
+ *  of ctensor_merge_add shall be 'out_size' each, those of
+ *  ctensor_merge_concat add up to it), or allocation failed
+ *  (the model is left as it was).
+*/
+CTensor_Layer_s *ctensor_add_node(CTensor_Model_s *model, CTensor_Layer_s **inputs,
+                    size_t ninputs, size_t out_size, CTensor_Layer_cb init_cb);
+
 /*
  *  Define the loss function for this model.
  *
@@ -191,6 +574,49 @@ CTensor_Loss_s *ctensor_set_loss(CTensor_Model_s *model, CTensor_Layer_cb init_c
 */
 CTensor_Optimizer_s *ctensor_set_optimizer(CTensor_Model_s *model, CTensor_Layer_cb init_cb);
 
+/*
+ *  Define the model's learning rate schedule, evaluated
+ *  at every optimization step.
+ *
+ *  @param model - Model to optimize.
+ *  @param init_cb - Init callback function
+ *  (function shall be casted to CTensor_Layer_cb).
+ *
+ *  @return - Scheduler pointer, for configuration.
+*/
+CTensor_Scheduler_s *ctensor_set_scheduler(CTensor_Model_s *model, CTensor_Layer_cb init_cb);
+
+/*
+ *  Finalize the model once all of its layers are set,
+ *  optimizing how they run: element-wise layers (ReLU,
+ *  affine) following an FCL are fused into its kernel, so
+ *  that forward and backward passes go over the outputs
+ *  once. Results stay the same. Sequential models only.
+ *
+ *  Called by ctensor_train; call it before predicting with
+ *  a model that isn't trained. Pipeline stages, Hogwild!
+ *  and local SGD replicas run the layers unfused.
+ *
+ *  @param model - Model to finalize.
+*/
+void ctensor_finalize(CTensor_Model_s *model);
+
+/*
+ *  Freeze a trained model for inference: each FCL is folded
+ *  together with an affine layer, or another FCL (with no
+ *  nonlinearity in between), following it into a single
+ *  FCL, whenever that takes fewer FLOPs. The model is then
+ *  finalized. Sequential models only.
+ *
+ *  Results only change by rounding. Frozen models aren't
+ *  meant to be trained further.
+ *
+ *  @param model - Model to freeze.
+ *
+ *  @return - Number of layers folded away.
+*/
+size_t ctensor_freeze(CTensor_Model_s *model);
+
 /*
  *  Obtain the model's prediction, given an input.
  *
@@ -208,6 +634,34 @@ CTensor_s *ctensor_predict(CTensor_Model_s *model, CTensor_s *input);
 */
 ctensor_data_t ctensor_test(CTensor_Model_s *model, CTensor_s *input, CTensor_s *expected);
 
+/*
+ *  Average loss over a whole set of examples, stored
+ *  contiguously (as batches are).
+ *
+ *  @param model - Model to be evaluated.
+ *  @param input - Input tensor (a multiple of in_size).
+ *  @param expected - Expected output tensor (a multiple of out_size).
+ *
+ *  @return - Mean loss over all examples.
+*/
+ctensor_data_t ctensor_evaluate(CTensor_Model_s *model, CTensor_s *input, CTensor_s *expected);
+
+/*
+ *  Train the model for 'epochs' epochs, of 'batches'
+ *  mini-batches each.
+ *
+ *  If 'val_interval' is set, x_test/y_test are used
+ *  as the validation set for early stopping.
+ *
+ *  @param model - Model to be trained.
+ *  @param get_nbatch - Batch loading callback.
+ *  @param x_test - Validation inputs (may be NULL).
+ *  @param y_test - Validation expected outputs (may be NULL).
+ *
+ *  @return - Average training loss of the last epoch, NaN
+ *  if the communicator failed (see CTensor_Comm_s.error)
+ *  or a DAG model couldn't be planned (nothing is trained).
+*/
 ctensor_data_t ctensor_train(CTensor_Model_s *model, CTensor_Batch_cb get_nbatch,
                             CTensor_s *x_test, CTensor_s *y_test);
 
@@ -218,6 +672,226 @@ ctensor_data_t ctensor_train(CTensor_Model_s *model, CTensor_Batch_cb get_nbatch
 */
 void ctensor_destroy(CTensor_Model_s *model);
 
+/*
+ *  Map a dataset file read-only, shared between all threads
+ *  (and processes) using it. The file holds all the inputs
+ *  followed by all the expected outputs, as raw ctensor_data_t.
+ *
+ *  @param ds - Dataset to fill.
+ *  @param path - File path.
+ *  @param in_size - Size of each input.
+ *  @param out_size - Size of each expected output.
+ *
+ *  @return - 0 on success, -1 on failure.
+*/
+int ctensor_dataset_map(CTensor_Dataset_s *ds, const char *path,
+                    size_t in_size, size_t out_size);
+
+/*
+ *  Unmap a dataset mapped with ctensor_dataset_map.
+ *
+ *  @param ds - Dataset.
+*/
+void ctensor_dataset_unmap(CTensor_Dataset_s *ds);
+
+/*
+ *  Train many independent models (e.g. a hyperparameter
+ *  sweep) in parallel, one per pool thread (see
+ *  ctensor_set_threads), all reading the same datasets.
+ *  Runs are handed out to threads as they become free.
+ *
+ *  Each run trains on consecutive batches of the training
+ *  set; with a validation set, it's also used for early
+ *  stopping (if the run sets 'val_interval').
+ *
+ *  @param build - Sets up each run's model.
+ *  @param arg - Argument for 'build'.
+ *  @param runs - Number of runs.
+ *  @param train - Training set.
+ *  @param val - Validation set (may be NULL).
+ *  @param results - Per-run results, 'runs' of them.
+ *
+ *  @return - Number of runs that failed.
+*/
+size_t ctensor_sweep(CTensor_Sweep_cb build, void *arg, size_t runs,
+                    const CTensor_Dataset_s *train, const CTensor_Dataset_s *val,
+                    CTensor_Run_s *results);
+
+/*
+ *  Print a sweep's per-run results, and its best run (by
+ *  validation loss, or training loss without one).
+ *
+ *  @param results - Per-run results.
+ *  @param runs - Number of runs.
+ *  @param stream - Stream to print to.
+*/
+void ctensor_sweep_report(const CTensor_Run_s *results, size_t runs, FILE *stream);
+
+/*
+ *  Train several models of the same architecture (same
+ *  layer sizes and kinds, loss, 'epochs', 'batches' and
+ *  'batch_size') together on the same batches, e.g. sweep
+ *  or ensemble members.
+ *
+ *  The models' parameters, gradients and activations are
+ *  stacked layer by layer while training, and their FCLs
+ *  run as one batched product over the model dimension.
+ *  Each model still steps with its own optimizer, learning
+ *  rate and schedule; validation, early stopping, gradient
+ *  accumulation and parallelism settings aren't used.
+ *
+ *  @param models - Models to train.
+ *  @param m - Number of models.
+ *  @param get_nbatch - Batch loading callback.
+ *  @param losses - If not NULL, set to each model's average
+ *  training loss over the last epoch.
+ *
+ *  @return - 0 on success, -1 on failure (e.g. models
+ *  that differ).
+*/
+int ctensor_stack_train(CTensor_Model_s **models, size_t m, CTensor_Batch_cb get_nbatch,
+                    ctensor_data_t *losses);
+
+/*
+ *  Set up an ensemble for inference. Every member shall
+ *  start with an FCL over the same input size, and have the
+ *  same output size; they may differ otherwise. A model
+ *  can only be a member once.
+ *
+ *  The members' first layers run as a single product of the
+ *  input with their concatenated kernels, the rest of their
+ *  layers interleaved, depth by depth.
+ *
+ *  Members shall outlive the ensemble, and may still be used
+ *  on their own; after training one of them further, call
+ *  ctensor_ensemble_refresh.
+ *
+ *  @param ens - Ensemble to init.
+ *  @param models - Members.
+ *  @param count - Number of members.
+ *  @param combine - CT_ENSEMBLE_MEAN or CT_ENSEMBLE_VOTE.
+ *
+ *  @return - 0 on success, -1 on failure.
+*/
+int ctensor_ensemble_init(CTensor_Ensemble_s *ens, CTensor_Model_s **models,
+                    size_t count, int combine);
+
+/*
+ *  Reload the members' first layer parameters.
+ *
+ *  @param ens - Ensemble.
+*/
+void ctensor_ensemble_refresh(CTensor_Ensemble_s *ens);
+
+/*
+ *  Obtain the ensemble's prediction, given an input.
+ *
+ *  @param ens - Ensemble.
+ *  @param input - Tensor containing the input data.
+ *
+ *  @return - Combined output, owned by the ensemble.
+*/
+CTensor_s *ctensor_ensemble_predict(CTensor_Ensemble_s *ens, CTensor_s *input);
+
+/*
+ *  Cleanup the ensemble, members are left as they were.
+ *
+ *  @param ens - Ensemble.
+*/
+void ctensor_ensemble_destroy(CTensor_Ensemble_s *ens);
+
+/*
+ *  Initialize a shared-memory communicator, for data-parallel
+ *  training between processes of a single host.
+ *
+ *  Every process shall call this function with the same
+ *  'name' and 'world_size' and its own 'rank'. The call
+ *  blocks until all processes have joined.
+ *
+ *  @param comm - Communicator to init.
+ *  @param name - Name of the POSIX shared-memory object
+ *  (e.g. "/ctensor-job0"), unique per training job.
+ *  @param rank - This process' index, in [0, world_size).
+ *  @param world_size - Number of processes.
+ *
+ *  @return - 0 on success, -1 on failure.
+*/
+int ctensor_shm_comm(CTensor_Comm_s *comm, const char *name, int rank, int world_size);
+
+/*
+ *  Initialize a TCP ring communicator, for data-parallel
+ *  training across hosts.
+ *
+ *  Worker 'rank' listens on port + rank, and connects to
+ *  the next worker in the ring. Tensors are averaged with
+ *  a (bandwidth-optimal) ring-allreduce, a reduce-scatter
+ *  followed by an all-gather, with each transfer streamed
+ *  and reduced as it arrives.
+ *
+ *  The call blocks until the ring is connected.
+ *
+ *  @param comm - Communicator to init.
+ *  @param hosts - Host (name or address) of each worker,
+ *  world_size entries; NULL to run all workers on loopback.
+ *  @param port - Base port.
+ *  @param rank - This worker's index, in [0, world_size).
+ *  @param world_size - Number of workers.
+ *
+ *  @return - 0 on success, -1 on failure.
+*/
+int ctensor_tcp_comm(CTensor_Comm_s *comm, const char *const *hosts, uint16_t port,
+                    int rank, int world_size);
+
+/*
+ *  Attach a gradient compressor to a communicator,
+ *  replacing any previous one. It's freed along with
+ *  the communicator.
+ *
+ *  Only the TCP ring communicator compresses, the
+ *  shared-memory one has no wire to save bytes on.
+ *
+ *  @param comm - Communicator.
+ *  @param init_cb - Init callback function
+ *  (function shall be casted to CTensor_Layer_cb).
+ *
+ *  @return - Compressor pointer, for configuration.
+*/
+CTensor_Compressor_s *ctensor_set_compressor(CTensor_Comm_s *comm, CTensor_Layer_cb init_cb);
+
+/*
+ *  FP16 compressor, every transfer is cast to half
+ *  precision (round to nearest even), halving the
+ *  bytes sent. Values beyond +-65504 overflow, prefer
+ *  bf16 for gradients with a large range.
+ *
+ *  @param comp - Compressor to init.
+*/
+void ctensor_fp16_compressor(CTensor_Compressor_s *comp);
+
+/*
+ *  BF16 compressor, every transfer is cast to bfloat16
+ *  (round to nearest even), halving the bytes sent while
+ *  keeping fp32's range.
+ *
+ *  @param comp - Compressor to init.
+*/
+void ctensor_bf16_compressor(CTensor_Compressor_s *comp);
+
+/*
+ *  Top-k compressor, each worker only sends the 'ratio'
+ *  (default 0.01) largest-magnitude elements of its
+ *  gradient, as (index, value) pairs.
+ *
+ *  The elements left out are kept in a per-worker residual
+ *  and added to the next gradient (error feedback), so
+ *  small updates are delayed instead of lost.
+ *
+ *  Tensors of up to 2^32 elements.
+ *
+ *  @param comp - Compressor to init.
+*/
+void ctensor_topk_compressor(CTensor_Compressor_s *comp);
+
 /*
  *  Adam init function.
  *
@@ -225,6 +899,108 @@ void ctensor_destroy(CTensor_Model_s *model);
 */
 void ctensor_adam(CTensor_Optimizer_s *layer);
 
+/*
+ *  Adam init function, storing both moments as
+ *  block-quantized 8-bit values (with a scale per block),
+ *  a 4x reduction of the optimizer's state memory.
+ *
+ *  @param layer - Layer info to init.
+*/
+void ctensor_adam8(CTensor_Optimizer_s *layer);
+
+/*
+ *  LAMB init function.
+ *
+ *  Adam with decoupled weight decay, and a per-layer
+ *  trust ratio (||w|| / ||update||) scaling each layer's
+ *  step. Defaults to weight_decay = 0.01.
+ *
+ *  @param layer - Layer info to init.
+*/
+void ctensor_lamb(CTensor_Optimizer_s *layer);
+
+/*
+ *  LARS init function.
+ *
+ *  SGD with momentum, and a per-layer learning rate
+ *  of eta * ||w|| / (||g|| + weight_decay * ||w||).
+ *  Defaults to momentum = 0.9, weight_decay = 5e-4,
+ *  eta = 0.001.
+ *
+ *  @param layer - Layer info to init.
+*/
+void ctensor_lars(CTensor_Optimizer_s *layer);
+
+/*
+ *  SGD init function, keeps no state.
+ *
+ *  @param layer - Layer info to init.
+*/
+void ctensor_sgd(CTensor_Optimizer_s *layer);
+
+/*
+ *  SGD with Momentum init function, keeps a single
+ *  velocity vector. Defaults to momentum = 0.9.
+ *
+ *  @param layer - Layer info to init.
+*/
+void ctensor_momentum(CTensor_Optimizer_s *layer);
+
+/*
+ *  SGD with Nesterov Momentum init function, keeps a
+ *  single velocity vector. Defaults to momentum = 0.9.
+ *
+ *  @param layer - Layer info to init.
+*/
+void ctensor_nesterov(CTensor_Optimizer_s *layer);
+
+/*
+ *  Adafactor init function.
+ *
+ *  Keeps only row and column second moment statistics
+ *  for each layer's 2-D kernel (O(rows + cols) memory,
+ *  instead of O(rows x cols)), the rest of the parameters
+ *  (e.g. bias) keep a full second moment.
+ *
+ *  @param layer - Layer info to init.
+*/
+void ctensor_adafactor(CTensor_Optimizer_s *layer);
+
+/*
+ *  Linear warmup, then a constant learning rate.
+ *  Defaults to 100 warmup steps.
+ *
+ *  @param sched - Scheduler to init.
+*/
+void ctensor_lr_warmup(CTensor_Scheduler_s *sched);
+
+/*
+ *  Step decay, multiplies the learning rate by 'gamma'
+ *  every 'step_size' steps (after warmup, if any).
+ *  Defaults to gamma = 0.1, every 1000 steps.
+ *
+ *  @param sched - Scheduler to init.
+*/
+void ctensor_lr_step_decay(CTensor_Scheduler_s *sched);
+
+/*
+ *  Cosine annealing from the learning rate down to
+ *  'min_lr' over 'total_steps' (after warmup, if any).
+ *
+ *  @param sched - Scheduler to init.
+*/
+void ctensor_lr_cosine(CTensor_Scheduler_s *sched);
+
+/*
+ *  One-cycle policy, linear rise from lr / 'div_factor'
+ *  to lr during the first 'pct_start' of the steps,
+ *  then cosine annealing down to 'min_lr'.
+ *  Defaults to pct_start = 0.3, div_factor = 25.
+ *
+ *  @param sched - Scheduler to init.
+*/
+void ctensor_lr_one_cycle(CTensor_Scheduler_s *sched);
+
 /*
  *  ReLU initial layer function.
  *  Fills all the layer information for the
@@ -236,6 +1012,46 @@ void ctensor_adam(CTensor_Optimizer_s *layer);
 */
 void ctensor_relu(CTensor_Layer_s *layer);
 
+/*
+ *  Element-wise sum of all of the layer's inputs, which
+ *  shall be of the layer's size (ctensor_add_node).
+ *
+ *  @param layer - Pointer of the current
+ *  layer "object" to be filled.
+*/
+void ctensor_merge_add(CTensor_Layer_s *layer);
+
+/*
+ *  Concatenation of all of the layer's inputs, in order;
+ *  the layer's size shall be the sum of theirs
+ *  (ctensor_add_node).
+ *
+ *  @param layer - Pointer of the current
+ *  layer "object" to be filled.
+*/
+void ctensor_merge_concat(CTensor_Layer_s *layer);
+
+/*
+ *  Element-wise affine initial layer function, out =
+ *  scale * in + shift, of the same size as its input.
+ *  The scale and shift are fixed (e.g. a normalization),
+ *  identity by default, see ctensor_affine_set.
+ *
+ *  @param layer - Pointer of the current
+ *  layer "object" to be filled.
+*/
+void ctensor_affine(CTensor_Layer_s *layer);
+
+/*
+ *  Set an affine layer's scale and shift.
+ *
+ *  @param layer - Affine layer.
+ *  @param scale - Scale (out_size), NULL to keep it.
+ *  @param shift - Shift (out_size), NULL to keep it.
+*/
+void ctensor_affine_set(CTensor_Layer_s *layer, const ctensor_data_t *scale,
+                    const ctensor_data_t *shift);
+
 /*
  *  FCL initial layer function.
  *  Fills all the layer information for the
@@ -257,6 +1073,119 @@ void ctensor_fcl_init(CTensor_Layer_s *layer);
 */
 void ctensor_fcl_param_init(CTensor_Layer_s *layer, uint64_t seed);
 
+/*
+ *  Row-sharded FCL initial layer function, for kernels
+ *  too large for a single core (or memory node).
+ *
+ *  The kernel is partitioned by output rows into one
+ *  shard per thread (see ctensor_set_threads), each shard
+ *  first touched by the thread computing its slice of
+ *  'out'. The input gradient slices are reduced at the end
+ *  of the backward pass. Same parameter layout as
+ *  ctensor_fcl_init, use ctensor_fcl_param_init to init.
+ *
+ *  @param layer - Pointer of the current
+ *  layer "object" to be filled.
+*/
+void ctensor_fcl_par_init(CTensor_Layer_s *layer);
+
+/*
+ *  Set the number of threads used by parallel kernels
+ *  (including the calling thread). Layers keep the
+ *  number of shards they were created with.
+ *
+ *  @param threads - Number of threads, 0 (default) for
+ *  one per online CPU.
+*/
+void ctensor_set_threads(size_t threads);
+
+/*
+ *  Get the number of threads used by parallel kernels.
+ *
+ *  @return - Number of threads.
+*/
+size_t ctensor_get_threads(void);
+
+/*
+ *  Set the CPU affinity of worker threads (the thread pool,
+ *  and pipeline stages), initially taken from the
+ *  CTENSOR_AFFINITY environment variable ("none", "compact"
+ *  or "scatter"). Takes effect on threads started afterwards.
+ *
+ *  When pinned, pool worker t (t >= 1, thread 0 being the
+ *  caller, which is left alone) runs on the t-th CPU of the
+ *  policy's order, and the shards of ctensor_fcl_par_init
+ *  layers (parameters and activations) are placed on their
+ *  thread's node. Pipeline stages are spread over nodes, and
+ *  place their layers' parameters and activations on their
+ *  node.
+ *
+ *  @param policy - CT_AFFINITY_NONE, CT_AFFINITY_COMPACT or
+ *  CT_AFFINITY_SCATTER.
+*/
+void ctensor_set_affinity(int policy);
+
+/*
+ *  Get the number of NUMA nodes (with CPUs), read from
+ *  /sys; 1 without NUMA support.
+ *
+ *  @return - Number of nodes.
+*/
+int ctensor_numa_nodes(void);
+
+/*
+ *  Place (migrating if needed) a tensor's memory on a
+ *  NUMA node. Pages only partially covered by the tensor
+ *  are left alone.
+ *
+ *  @param tensor - Tensor.
+ *  @param node - Node id.
+ *
+ *  @return - 0 on success, -1 on failure.
+*/
+int ctensor_tensor_bind(CTensor_s *tensor, int node);
+
+/*
+ *  Set the huge page policy of tensors allocated afterwards
+ *  by ctensor_new_tensor, initially taken from the
+ *  CTENSOR_HUGE_PAGES environment variable ("none", "thp"
+ *  or "hugetlb").
+ *
+ *  Only tensors of at least 'min_bytes' (parameters,
+ *  gradients and optimizer state of large layers) get huge
+ *  pages; when none are available allocation falls back to
+ *  THP, then to malloc.
+ *
+ *  @param policy - CT_HUGE_PAGES_NONE, CT_HUGE_PAGES_THP or
+ *  CT_HUGE_PAGES_HUGETLB.
+ *  @param min_bytes - Smallest tensor to back with huge
+ *  pages, 0 for the default (4MB).
+*/
+void ctensor_set_huge_pages(int policy, size_t min_bytes);
+
+/*
+ *  Get the page size actually backing a tensor (tensors
+ *  not allocated by ctensor_new_tensor are taken to be on
+ *  regular pages). Transparent huge pages are only
+ *  given once memory is touched (if the kernel has them
+ *  to spare), so THP tensors may report regular pages.
+ *
+ *  @param tensor - Tensor.
+ *
+ *  @return - Page size, in bytes.
+*/
+size_t ctensor_tensor_page_size(const CTensor_s *tensor);
+
+/*
+ *  Print the size, backing and realized page size of each
+ *  layer's parameters and gradients, followed by the
+ *  process' live tensor totals for each backing.
+ *
+ *  @param model - Model, NULL for the totals only.
+ *  @param stream - Stream to print to.
+*/
+void ctensor_memory_report(CTensor_Model_s *model, FILE *stream);
+
 /*
  *  Initializes the Loss Layer with fwd and bck
  *  callbacks.
@@ -369,7 +1298,8 @@ void ctensor_vector_sum(float *A, size_t elements, float *B, float *C);
 CTensor_s *ctensor_new_tensor(size_t size);
 
 /*
- *  De-allocate tensor.
+ *  De-allocate tensor, either from ctensor_new_tensor or
+ *  with both the struct and its data from malloc.
  *
  *  @param tensor - Pointer to the tensor struct
  *  to be de-allocated.
@@ -20,8 +20,8 @@
 
 #include <math.h>
 
-static void ctensor_relu_fwd(CTensor_Layer_s *layer);
-static void ctensor_relu_bckp(CTensor_Layer_s *layer);
+void ctensor_relu_fwd(CTensor_Layer_s *layer);
+void ctensor_relu_bckp(CTensor_Layer_s *layer);
 
 /*
  *  ReLU initial layer function.
@@ -45,6 +45,7 @@ void ctensor_relu(CTensor_Layer_s *layer)
     // This layer is not trainable.
     layer->internal = NULL;
     layer->internal_grad = NULL;
+    layer->internal_params = NULL;
 
     return;
 }
@@ -57,7 +58,7 @@ void ctensor_relu(CTensor_Layer_s *layer)
  *  @params layer - Pointer to the current
  *  ReLU layer "object".
 */
-static void ctensor_relu_fwd(CTensor_Layer_s *layer)
+void ctensor_relu_fwd(CTensor_Layer_s *layer)
 {
     ctensor_data_t *in, *out;
     size_t in_size;
@@ -85,7 +86,7 @@ static void ctensor_relu_fwd(CTensor_Layer_s *layer)
  *  @params layer - Pointer to the current
  *  ReLU layer "object".
 */
-static void ctensor_relu_bckp(CTensor_Layer_s *layer)
+void ctensor_relu_bckp(CTensor_Layer_s *layer)
 {
     ctensor_data_t *in, *out, *loss;
     size_t in_size;
@@ -0,0 +1,105 @@
+/*
+ *  Adafactor Optimization for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctensor/ctensor.h>
+#include <math.h>
+
+/*
+ *  Adafactor (factored second moments, no first moment)
+ *  Optimization Algorithm, for a single layer.
+ *
+ *  The layer's block starts with a rows x cols kernel,
+ *  whose second moment is approximated by the outer product
+ *  of its row (R) and column (C) statistics. The remaining
+ *  elements keep a full second moment (v).
+ *
+ *  @param grad - evaluated gradient vector of the layer.
+ *  @param grad_size - number of elements in gradient vector.
+ *  @param rows - kernel rows (0 if not factored).
+ *  @param cols - kernel columns (0 if not factored).
+ *  @param R - row statistics (rows).
+ *  @param C - column statistics (cols).
+ *  @param v - second moment vector (grad_size - rows * cols).
+ *  @param b2 - second moment decay for this step.
+ *  @param lr - learning rate.
+*/
+void _ct_adafactor(float *grad, size_t grad_size, size_t rows, size_t cols,
+            float *R, float *C, float *v, float b2, float lr)
+{
+    float g2, r_mean = 0.00, rms = 0.00, scale, row, u;
+    size_t i, j, k, n;
+
+    n = rows * cols;
+
+    // Update the row/column statistics, with
+    // the mean squared gradient of each row/column.
+    for (i = 0; i < rows; i++)
+        R[i] *= b2;
+
+    for (j = 0; j < cols; j++)
+        C[j] *= b2;
+
+    for (i = 0; i < rows; i++) {
+        for (j = 0; j < cols; j++) {
+            g2 = grad[i * cols + j] * grad[i * cols + j] + 1e-30;
+
+            R[i] += (1 - b2) * g2 / (float)cols;
+            C[j] += (1 - b2) * g2 / (float)rows;
+        }
+    }
+
+    for (i = 0; i < rows; i++)
+        r_mean += R[i];
+
+    if (rows != 0)
+        r_mean /= (float)rows;
+
+    // u = g / sqrt(R_i * C_j / mean(R)), without forming
+    // R_i * C_j, which underflows for all-zero rows and
+    // columns (both are then about the eps).
+    for (i = 0; i < rows; i++) {
+        row = sqrtf(r_mean / R[i]);
+
+        for (j = 0; j < cols; j++) {
+            k = i * cols + j;
+            u = grad[k] * row / sqrtf(C[j]);
+
+            rms += u * u;
+            grad[k] = u;
+        }
+    }
+
+    // Everything past the kernel isn't factored.
+    for (k = n; k < grad_size; k++) {
+        g2 = grad[k] * grad[k] + 1e-30;
+        v[k - n] = b2 * v[k - n] + (1 - b2) * g2;
+
+        u = grad[k] / sqrtf(v[k - n]);
+
+        rms += u * u;
+        grad[k] = u;
+    }
+
+    // Clip the update to an RMS of at most 1.
+    rms = sqrtf(rms / (float)grad_size);
+    scale = (rms > 1.00) ? 1.00 / rms : 1.00;
+
+    for (k = 0; k < grad_size; k++)
+        grad[k] *= -lr * scale;
+
+    return;
+}
@@ -19,6 +19,8 @@
 #include <ctensor/ctensor.h>
 #include <math.h>
 
+#include "adam8.h"
+
 /*
  *  Adam Stochastic Optimization Algorithm
  *  
@@ -47,4 +49,103 @@ void _ct_adam(float *grad, size_t grad_size, float *m, float *v, float b1, float
     }
 
     return;
-}
\ No newline at end of file
+}
+
+/*
+ *  Dynamic-range mapping for the quantized states.
+ *
+ *  Codes are companded with a square root before being
+ *  stored (x = scale * (q / qmax)^2), so that most of the
+ *  256 levels are spent near zero, where the moments of
+ *  most parameters live.
+*/
+static inline float _ct_q8_decode(float q, float qmax, float scale)
+{
+    q /= qmax;
+
+    return scale * q * q;
+}
+
+static inline float _ct_q8_encode(float x, float qmax, float scale)
+{
+    if (scale <= 0)
+        return 0;
+
+    return qmax * sqrtf(x / scale);
+}
+
+/*
+ *  Adam Stochastic Optimization Algorithm, with 8-bit
+ *  block-quantized moments.
+ *
+ *  Each block of CT_ADAM8_BLOCK elements is dequantized,
+ *  updated and requantized (with its new absolute max as
+ *  the scale) in a single pass.
+ *  
+ *  @param grad - evaluated gradient vector.
+ *  @param grad_size - number of elements in gradient vector.
+ *  @param qm - quantized first moment vector.
+ *  @param m_scale - first moment block scales.
+ *  @param qv - quantized sqrt of the second moment vector.
+ *  @param v_scale - second moment block scales.
+ *  @param b1 - first bias correction.
+ *  @param b2 - second bias correction.
+ *  @param lr - learning rate.
+ *  @param t - Number of gradient update.
+*/
+void _ct_adam8(float *grad, size_t grad_size, int8_t *qm, float *m_scale,
+            uint8_t *qv, float *v_scale, float b1, float b2, float lr, int t)
+{
+    float m[CT_ADAM8_BLOCK], r[CT_ADAM8_BLOCK];
+    float c1, c2, m_max, r_max, q, v;
+    size_t i, j, b, n;
+
+    c1 = 1 / (1 - powf(b1, t));
+    c2 = 1 / (1 - powf(b2, t));
+
+    for (b = 0, i = 0; i < grad_size; b++, i += n) {
+        n = grad_size - i;
+
+        if (n > CT_ADAM8_BLOCK)
+            n = CT_ADAM8_BLOCK;
+
+        m_max = 0.00;
+        r_max = 0.00;
+
+        for (j = 0; j < n; j++) {
+            // Dequantize.
+            q = (float)qm[i + j];
+            m[j] = _ct_q8_decode(q, 127.0, m_scale[b]);
+            m[j] = (q < 0) ? -m[j] : m[j];
+
+            r[j] = _ct_q8_decode((float)qv[i + j], 255.0, v_scale[b]);
+
+            // Adam.
+            m[j] = b1 * m[j] + (1 - b1) * grad[i + j];
+            v = b2 * r[j] * r[j] + (1 - b2) * (grad[i + j] * grad[i + j]);
+
+            // We store sqrt(v), halving its dynamic range.
+            r[j] = sqrtf(v);
+
+            grad[i + j] = (-lr * m[j] * c1) / (sqrtf(v * c2) + 1e-7);
+
+            m_max = fmaxf(m_max, fabsf(m[j]));
+            r_max = fmaxf(r_max, r[j]);
+        }
+
+        m_scale[b] = m_max;
+        v_scale[b] = r_max;
+
+        // Requantize.
+        for (j = 0; j < n; j++) {
+            q = roundf(_ct_q8_encode(fabsf(m[j]), 127.0, m_max));
+            qm[i + j] = (int8_t)((m[j] < 0) ? -q : q);
+
+            // Round up, never underestimate the denominator.
+            q = ceilf(_ct_q8_encode(r[j], 255.0, r_max));
+            qv[i + j] = (uint8_t)fminf(q, 255.0);
+        }
+    }
+
+    return;
+}
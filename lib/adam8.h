@@ -0,0 +1,27 @@
+/*
+ *  8-bit Adam shared definitions for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CT_ADAM8_H
+#define CT_ADAM8_H
+
+/*
+ *  Number of elements sharing a scale in the
+ *  8-bit quantized states.
+*/
+#define CT_ADAM8_BLOCK 256
+
+#endif
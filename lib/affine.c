@@ -0,0 +1,153 @@
+/*
+ *  Element-wise affine layer for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctensor/ctensor.h>
+
+#include <string.h>
+
+void ctensor_affine_fwd(CTensor_Layer_s *layer);
+void ctensor_affine_bckp(CTensor_Layer_s *layer);
+static void ctensor_affine_del(CTensor_Layer_s *layer);
+
+/*
+ *  Affine initial layer function.
+ *  Fills all the layer information for the
+ *  Model Abstraction API. As defined in
+ *  the documentation.
+ *
+ *  The scale and shift (out_size each, stored one
+ *  after the other in 'internal') are fixed, not
+ *  trained; identity by default.
+ *
+ *  @param layer - Pointer of the current
+ *  layer "object" to be filled.
+*/
+void ctensor_affine(CTensor_Layer_s *layer)
+{
+    CTensor_s *params;
+    size_t i, size;
+
+    layer->fwd = (CTensor_Layer_cb)ctensor_affine_fwd;
+    layer->bckp = (CTensor_Layer_cb)ctensor_affine_bckp;
+    layer->update = NULL;
+    layer->del = (CTensor_Layer_cb)ctensor_affine_del;
+
+    // This layer is not trainable.
+    layer->internal_grad = NULL;
+    layer->internal_params = NULL;
+
+    size = layer->out->size;
+
+    params = ctensor_new_tensor(2 * size);
+    layer->internal = (void *)params;
+    // Only read while training, replicas can share it.
+    layer->shared_internal = 1;
+
+    if (params == NULL)
+        return;
+
+    for (i = 0; i < size; i++) {
+        params->data[i] = 1.00;
+        params->data[size + i] = 0.00;
+    }
+
+    return;
+}
+
+/*
+ *  Set an affine layer's scale and shift.
+ *
+ *  @param layer - Affine layer.
+ *  @param scale - Scale (out_size), NULL to keep it.
+ *  @param shift - Shift (out_size), NULL to keep it.
+*/
+void ctensor_affine_set(CTensor_Layer_s *layer, const ctensor_data_t *scale,
+                    const ctensor_data_t *shift)
+{
+    CTensor_s *params;
+    size_t size;
+
+    params = (CTensor_s *)layer->internal;
+    size = layer->out->size;
+
+    if (scale != NULL)
+        memcpy(params->data, scale, size * sizeof(ctensor_data_t));
+
+    if (shift != NULL)
+        memcpy(&params->data[size], shift, size * sizeof(ctensor_data_t));
+
+    return;
+}
+
+/*
+ *  Affine forward pass, out = scale * in + shift.
+ *
+ *  @params layer - Pointer to the current
+ *  layer "object".
+*/
+void ctensor_affine_fwd(CTensor_Layer_s *layer)
+{
+    ctensor_data_t *in, *out, *scale, *shift;
+    size_t i, size;
+
+    in = layer->in->data;
+    out = layer->out->data;
+
+    size = layer->out->size;
+
+    scale = ((CTensor_s *)layer->internal)->data;
+    shift = &scale[size];
+
+    for (i = 0; i < size; i++)
+        out[i] = in[i] * scale[i] + shift[i];
+
+    return;
+}
+
+/*
+ *  Affine backprop pass, scales the loss gradient.
+ *
+ *  @params layer - Pointer to the current
+ *  layer "object".
+*/
+void ctensor_affine_bckp(CTensor_Layer_s *layer)
+{
+    ctensor_data_t *in_grad, *loss, *scale;
+    size_t i, size;
+
+    in_grad = layer->in_grad->data;
+    loss = layer->loss_grad->data;
+
+    size = layer->out->size;
+
+    scale = ((CTensor_s *)layer->internal)->data;
+
+    for (i = 0; i < size; i++)
+        in_grad[i] = loss[i] * scale[i];
+
+    return;
+}
+
+static void ctensor_affine_del(CTensor_Layer_s *layer)
+{
+    if (layer->internal != NULL)
+        ctensor_destroy_tensor((CTensor_s *)layer->internal);
+
+    layer->internal = NULL;
+
+    return;
+}
@@ -0,0 +1,229 @@
+/*
+ *  Bucketed gradient communication for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctensor/ctensor.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+
+/*
+ *  During the last backward pass before an optimization
+ *  step, each layer's block of the gradient vector is final
+ *  as soon as its 'bckp' returns. Blocks are grouped into
+ *  buckets of (at least) 'bucket_size' elements, and each
+ *  bucket is handed to a communication thread that averages
+ *  it across workers, while the earlier layers are still
+ *  back-propagating.
+ *
+ *  The communication thread is the only one talking to the
+ *  communicator, and it processes buckets in order, so all
+ *  workers issue the same sequence of collectives.
+*/
+typedef struct _ct_bucket_s {
+    CTensor_Comm_s  *comm;
+    // Our own copy of the gradient vector's bounds, as
+    // backprop walks 'grad->data' while we communicate.
+    ctensor_data_t  *base;
+    size_t          size;
+    size_t          bucket_size;
+    // Start of the bucket being filled.
+    size_t          start;
+    // Sealed buckets, as [lo, hi) ranges of 'grad'.
+    size_t          *ranges;
+    size_t          capacity;
+    size_t          queued;
+    size_t          done;
+    int             stop;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    pthread_t       thread;
+} _ct_bucket_s;
+
+static void *_ct_bucket_worker(void *arg)
+{
+    _ct_bucket_s *bk;
+    CTensor_s view;
+    size_t i;
+
+    bk = (_ct_bucket_s *)arg;
+
+    pthread_mutex_lock(&bk->lock);
+
+    for (;;) {
+        while (bk->done == bk->queued && !bk->stop)
+            pthread_cond_wait(&bk->cond, &bk->lock);
+
+        if (bk->done == bk->queued)
+            break;
+
+        i = bk->done;
+
+        view.data = &bk->base[bk->ranges[2 * i]];
+        view.size = bk->ranges[2 * i + 1] - bk->ranges[2 * i];
+
+        // Communicate without holding the lock, backprop
+        // keeps sealing buckets meanwhile.
+        pthread_mutex_unlock(&bk->lock);
+        bk->comm->allreduce(bk->comm, &view);
+        pthread_mutex_lock(&bk->lock);
+
+        bk->done++;
+        pthread_cond_broadcast(&bk->cond);
+    }
+
+    pthread_mutex_unlock(&bk->lock);
+
+    return NULL;
+}
+
+/*
+ *  Start the communication thread.
+ *
+ *  @param comm - Communicator.
+ *  @param grad - Gradient vector to be communicated.
+ *  @param bucket_size - Minimum number of elements per bucket.
+ *  @param max_buckets - Maximum number of buckets per step
+ *  (i.e. number of trainable layers).
+ *
+ *  @return - Bucket state, NULL on failure.
+*/
+_ct_bucket_s *_ct_bucket_new(CTensor_Comm_s *comm, CTensor_s *grad,
+                    size_t bucket_size, size_t max_buckets)
+{
+    _ct_bucket_s *bk;
+
+    bk = (_ct_bucket_s *)malloc(sizeof(_ct_bucket_s));
+
+    if (bk == NULL)
+        return NULL;
+
+    // Plus the remainder flushed at the end of the step.
+    bk->capacity = max_buckets + 1;
+    bk->ranges = (size_t *)malloc(2 * bk->capacity * sizeof(size_t));
+
+    if (bk->ranges == NULL) {
+        free(bk);
+        return NULL;
+    }
+
+    bk->comm = comm;
+    bk->base = grad->data;
+    bk->size = grad->size;
+    bk->bucket_size = bucket_size;
+    bk->start = 0;
+    bk->queued = 0;
+    bk->done = 0;
+    bk->stop = 0;
+
+    pthread_mutex_init(&bk->lock, NULL);
+    pthread_cond_init(&bk->cond, NULL);
+
+    if (pthread_create(&bk->thread, NULL, _ct_bucket_worker, (void *)bk) != 0) {
+        pthread_cond_destroy(&bk->cond);
+        pthread_mutex_destroy(&bk->lock);
+        free(bk->ranges);
+        free(bk);
+        return NULL;
+    }
+
+    return bk;
+}
+
+/*
+ *  Queue [start, end) for communication.
+*/
+static void _ct_bucket_seal(_ct_bucket_s *bk, size_t end)
+{
+    pthread_mutex_lock(&bk->lock);
+
+    bk->ranges[2 * bk->queued] = bk->start;
+    bk->ranges[2 * bk->queued + 1] = end;
+    bk->queued++;
+
+    pthread_cond_broadcast(&bk->cond);
+    pthread_mutex_unlock(&bk->lock);
+
+    bk->start = end;
+
+    return;
+}
+
+/*
+ *  Notify that grad[0, end) is final, sealing the current
+ *  bucket once it's large enough.
+ *
+ *  @param bk - Bucket state.
+ *  @param end - End of the final part of the gradient vector.
+*/
+void _ct_bucket_ready(_ct_bucket_s *bk, size_t end)
+{
+    if (end - bk->start < bk->bucket_size || bk->queued + 1 >= bk->capacity)
+        return;
+
+    _ct_bucket_seal(bk, end);
+
+    return;
+}
+
+/*
+ *  Flush the last (partial) bucket, and wait for all
+ *  buckets of this step to be averaged.
+ *
+ *  @param bk - Bucket state.
+*/
+void _ct_bucket_wait(_ct_bucket_s *bk)
+{
+    if (bk->start < bk->size)
+        _ct_bucket_seal(bk, bk->size);
+
+    pthread_mutex_lock(&bk->lock);
+
+    while (bk->done != bk->queued)
+        pthread_cond_wait(&bk->cond, &bk->lock);
+
+    // Ready for the next step.
+    bk->queued = 0;
+    bk->done = 0;
+    bk->start = 0;
+
+    pthread_mutex_unlock(&bk->lock);
+
+    return;
+}
+
+/*
+ *  Stop the communication thread, and free its state.
+ *
+ *  @param bk - Bucket state.
+*/
+void _ct_bucket_free(_ct_bucket_s *bk)
+{
+    pthread_mutex_lock(&bk->lock);
+    bk->stop = 1;
+    pthread_cond_broadcast(&bk->cond);
+    pthread_mutex_unlock(&bk->lock);
+
+    pthread_join(bk->thread, NULL);
+
+    pthread_cond_destroy(&bk->cond);
+    pthread_mutex_destroy(&bk->lock);
+
+    free(bk->ranges);
+    free(bk);
+
+    return;
+}
@@ -0,0 +1,566 @@
+/*
+ *  Gradient compression for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctensor/ctensor.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+static size_t ctensor_fp16_encode(CTensor_Compressor_s *comp, ctensor_data_t *src, size_t n, void *dst);
+static int ctensor_fp16_decode(CTensor_Compressor_s *comp, const void *src, size_t bytes,
+                    ctensor_data_t *dst, size_t n);
+static size_t ctensor_bf16_encode(CTensor_Compressor_s *comp, ctensor_data_t *src, size_t n, void *dst);
+static int ctensor_bf16_decode(CTensor_Compressor_s *comp, const void *src, size_t bytes,
+                    ctensor_data_t *dst, size_t n);
+static size_t ctensor_topk_encode(CTensor_Compressor_s *comp, ctensor_data_t *src, size_t n, void *dst);
+static int ctensor_topk_decode(CTensor_Compressor_s *comp, const void *src, size_t bytes,
+                    ctensor_data_t *dst, size_t n);
+static void ctensor_compressor_del(CTensor_Compressor_s *comp);
+static void ctensor_topk_del(CTensor_Compressor_s *comp);
+static void ctensor_topk_reset(CTensor_Compressor_s *comp);
+
+/*
+ *  Error-feedback residual of one tensor.
+ *
+ *  Tensors are told apart by their data pointer, so that
+ *  each bucket of a gradient vector keeps its own residual.
+ *  Pointers only stay meaningful for a training run, all
+ *  residuals are dropped when the next one starts.
+*/
+typedef struct {
+    const ctensor_data_t    *key;
+    CTensor_s               *residual;
+} _topk_entry_s;
+
+typedef struct {
+    _topk_entry_s   *entries;
+    size_t          count;
+    // Magnitudes, scratch space for the selection.
+    ctensor_data_t  *mag;
+    size_t          mag_size;
+} _topk_s;
+
+/*
+ *  Attach a compressor to a communicator.
+ *
+ *  @param comm - Communicator.
+ *  @param init_cb - Init callback function
+ *  (function shall be casted to CTensor_Layer_cb).
+ *
+ *  @return - Compressor pointer, for configuration.
+*/
+CTensor_Compressor_s *ctensor_set_compressor(CTensor_Comm_s *comm, CTensor_Layer_cb init_cb)
+{
+    CTensor_Compressor_s *comp;
+
+    comp = (CTensor_Compressor_s *)malloc(sizeof(CTensor_Compressor_s));
+
+    if (comp == NULL)
+        return NULL;
+
+    comp->reset = NULL;
+    comp->elem_size = 0;
+    comp->ratio = 1.00;
+    comp->internal = NULL;
+
+    init_cb((void *)comp);
+
+    if (comm->compressor != NULL) {
+        comm->compressor->del((void *)comm->compressor);
+        free(comm->compressor);
+    }
+
+    comm->compressor = comp;
+
+    return comp;
+}
+
+/*
+ *  Float to half precision, rounding to nearest even.
+*/
+static inline uint16_t _ct_f32_to_f16(float f)
+{
+    uint32_t x, sign, mant, half, rem, halfway;
+    int32_t exp, shift;
+
+    memcpy(&x, &f, sizeof(x));
+
+    sign = (x >> 16) & 0x8000;
+    exp = (int32_t)((x >> 23) & 0xff);
+    mant = x & 0x7fffff;
+
+    // Inf/NaN.
+    if (exp == 0xff)
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+
+    exp = exp - 127 + 15;
+
+    // Overflows to infinity.
+    if (exp >= 31)
+        return sign | 0x7c00;
+
+    // Subnormal (or zero) half.
+    if (exp <= 0) {
+        if (exp < -10)
+            return sign;
+
+        mant |= 0x800000;
+        shift = 14 - exp;
+
+        half = mant >> shift;
+        rem = mant & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+
+        if (rem > halfway || (rem == halfway && (half & 1)))
+            half++;
+
+        return sign | half;
+    }
+
+    half = ((uint32_t)exp << 10) | (mant >> 13);
+    rem = mant & 0x1fff;
+
+    // A carry into the exponent is still correct.
+    if (rem > 0x1000 || (rem == 0x1000 && (half & 1)))
+        half++;
+
+    return sign | half;
+}
+
+static inline float _ct_f16_to_f32(uint16_t h)
+{
+    uint32_t sign, exp, mant, x;
+    float f;
+
+    sign = (uint32_t)(h & 0x8000) << 16;
+    exp = (h >> 10) & 0x1f;
+    mant = h & 0x3ff;
+
+    if (exp == 0) {
+        // Subnormal, mant * 2^-24.
+        f = (float)mant * 5.9604644775390625e-8f;
+        return sign ? -f : f;
+    }
+
+    if (exp == 31)
+        x = sign | 0x7f800000 | (mant << 13);
+    else
+        x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+
+    memcpy(&f, &x, sizeof(f));
+
+    return f;
+}
+
+/*
+ *  Float to bfloat16, rounding to nearest even.
+*/
+static inline uint16_t _ct_f32_to_bf16(float f)
+{
+    uint32_t x;
+
+    memcpy(&x, &f, sizeof(x));
+
+    // Keep NaNs quiet.
+    if ((x & 0x7fffffff) > 0x7f800000)
+        return (x >> 16) | 0x40;
+
+    x += 0x7fff + ((x >> 16) & 1);
+
+    return x >> 16;
+}
+
+static inline float _ct_bf16_to_f32(uint16_t h)
+{
+    uint32_t x;
+    float f;
+
+    x = (uint32_t)h << 16;
+    memcpy(&f, &x, sizeof(f));
+
+    return f;
+}
+
+/*
+ *  FP16 compressor, casts every transfer to half
+ *  precision (2x fewer bytes).
+ *
+ *  @param comp - Compressor to init.
+*/
+void ctensor_fp16_compressor(CTensor_Compressor_s *comp)
+{
+    comp->encode = (CTensor_Encode_cb)ctensor_fp16_encode;
+    comp->decode = (CTensor_Decode_cb)ctensor_fp16_decode;
+    comp->del = (CTensor_Layer_cb)ctensor_compressor_del;
+    comp->elem_size = sizeof(uint16_t);
+
+    return;
+}
+
+/*
+ *  BF16 compressor, casts every transfer to bfloat16
+ *  (2x fewer bytes, with fp32's range).
+ *
+ *  @param comp - Compressor to init.
+*/
+void ctensor_bf16_compressor(CTensor_Compressor_s *comp)
+{
+    comp->encode = (CTensor_Encode_cb)ctensor_bf16_encode;
+    comp->decode = (CTensor_Decode_cb)ctensor_bf16_decode;
+    comp->del = (CTensor_Layer_cb)ctensor_compressor_del;
+    comp->elem_size = sizeof(uint16_t);
+
+    return;
+}
+
+/*
+ *  Top-k sparsification compressor, with error feedback.
+ *
+ *  @param comp - Compressor to init.
+*/
+void ctensor_topk_compressor(CTensor_Compressor_s *comp)
+{
+    _topk_s *data;
+
+    comp->encode = (CTensor_Encode_cb)ctensor_topk_encode;
+    comp->decode = (CTensor_Decode_cb)ctensor_topk_decode;
+    comp->del = (CTensor_Layer_cb)ctensor_topk_del;
+    comp->reset = (CTensor_Layer_cb)ctensor_topk_reset;
+    comp->elem_size = 0;
+    comp->ratio = 0.01;
+
+    data = (_topk_s *)malloc(sizeof(_topk_s));
+    comp->internal = (void *)data;
+
+    if (data == NULL)
+        return;
+
+    data->entries = NULL;
+    data->count = 0;
+    data->mag = NULL;
+    data->mag_size = 0;
+
+    return;
+}
+
+static size_t ctensor_fp16_encode(CTensor_Compressor_s *comp, ctensor_data_t *src, size_t n, void *dst)
+{
+    uint16_t *out;
+    size_t i;
+
+    out = (uint16_t *)dst;
+
+    if (out != NULL) {
+        for (i = 0; i < n; i++)
+            out[i] = _ct_f32_to_f16(src[i]);
+    }
+
+    return n * sizeof(uint16_t);
+}
+
+static int ctensor_fp16_decode(CTensor_Compressor_s *comp, const void *src, size_t bytes,
+                    ctensor_data_t *dst, size_t n)
+{
+    const uint16_t *in;
+    size_t i;
+
+    if (bytes != n * sizeof(uint16_t))
+        return -1;
+
+    in = (const uint16_t *)src;
+
+    for (i = 0; i < n; i++)
+        dst[i] += _ct_f16_to_f32(in[i]);
+
+    return 0;
+}
+
+static size_t ctensor_bf16_encode(CTensor_Compressor_s *comp, ctensor_data_t *src, size_t n, void *dst)
+{
+    uint16_t *out;
+    size_t i;
+
+    out = (uint16_t *)dst;
+
+    if (out != NULL) {
+        for (i = 0; i < n; i++)
+            out[i] = _ct_f32_to_bf16(src[i]);
+    }
+
+    return n * sizeof(uint16_t);
+}
+
+static int ctensor_bf16_decode(CTensor_Compressor_s *comp, const void *src, size_t bytes,
+                    ctensor_data_t *dst, size_t n)
+{
+    const uint16_t *in;
+    size_t i;
+
+    if (bytes != n * sizeof(uint16_t))
+        return -1;
+
+    in = (const uint16_t *)src;
+
+    for (i = 0; i < n; i++)
+        dst[i] += _ct_bf16_to_f32(in[i]);
+
+    return 0;
+}
+
+/*
+ *  Find the k-th largest value (k >= 1) with quickselect,
+ *  reorders 'a'.
+*/
+static ctensor_data_t _ct_kth_largest(ctensor_data_t *a, size_t n, size_t k)
+{
+    size_t lo = 0, hi = n - 1, i, j;
+    ctensor_data_t pivot, tmp;
+
+    k--;
+
+    while (lo < hi) {
+        pivot = a[lo + (hi - lo) / 2];
+        i = lo;
+        j = hi;
+
+        // Partition in descending order.
+        while (i <= j) {
+            while (a[i] > pivot)
+                i++;
+
+            while (a[j] < pivot)
+                j--;
+
+            if (i <= j) {
+                tmp = a[i];
+                a[i] = a[j];
+                a[j] = tmp;
+
+                i++;
+
+                if (j == 0)
+                    break;
+
+                j--;
+            }
+        }
+
+        if (k <= j)
+            hi = j;
+        else if (k >= i)
+            lo = i;
+        else
+            break;
+    }
+
+    return a[k];
+}
+
+/*
+ *  Residual of the given tensor, allocated (as zeros) the
+ *  first time we see it.
+*/
+static ctensor_data_t *_ct_topk_residual(_topk_s *data, const ctensor_data_t *key, size_t n)
+{
+    _topk_entry_s *entries;
+    size_t i;
+
+    for (i = 0; i < data->count; i++) {
+        if (data->entries[i].key == key && data->entries[i].residual->size == n)
+            return data->entries[i].residual->data;
+    }
+
+    entries = (_topk_entry_s *)realloc(data->entries, (data->count + 1) * sizeof(_topk_entry_s));
+
+    if (entries == NULL)
+        return NULL;
+
+    data->entries = entries;
+
+    entries[data->count].key = key;
+    entries[data->count].residual = ctensor_new_tensor(n);
+
+    if (entries[data->count].residual == NULL)
+        return NULL;
+
+    ctensor_tensor_zeros(entries[data->count].residual);
+
+    return entries[data->count++].residual->data;
+}
+
+/*
+ *  Encoded as a uint32_t count, followed by count
+ *  (uint32_t index, float value) pairs.
+ *
+ *  The elements not sent are kept in the residual, and
+ *  added back to the tensor the next time it's encoded
+ *  (error feedback), so no gradient is ever lost, only
+ *  delayed.
+*/
+static size_t ctensor_topk_encode(CTensor_Compressor_s *comp, ctensor_data_t *src, size_t n, void *dst)
+{
+    ctensor_data_t *r, thr;
+    size_t i, k, count = 0;
+    uint32_t *out, idx;
+    _topk_s *data;
+
+    data = (_topk_s *)comp->internal;
+
+    k = (size_t)(comp->ratio * (ctensor_data_t)n);
+
+    if (k == 0)
+        k = 1;
+
+    if (k > n)
+        k = n;
+
+    if (dst == NULL)
+        return sizeof(uint32_t) + k * (sizeof(uint32_t) + sizeof(ctensor_data_t));
+
+    out = (uint32_t *)dst;
+
+    r = _ct_topk_residual(data, src, n);
+
+    if (n == 0 || r == NULL) {
+        out[0] = 0;
+        return sizeof(uint32_t);
+    }
+
+    if (data->mag_size < n) {
+        free(data->mag);
+
+        data->mag = (ctensor_data_t *)malloc(n * sizeof(ctensor_data_t));
+        data->mag_size = (data->mag == NULL) ? 0 : n;
+
+        if (data->mag == NULL) {
+            out[0] = 0;
+            return sizeof(uint32_t);
+        }
+    }
+
+    // Accumulate into the residual, which now holds
+    // everything that's pending to be sent.
+    for (i = 0; i < n; i++) {
+        r[i] += src[i];
+        data->mag[i] = fabsf(r[i]);
+    }
+
+    thr = _ct_kth_largest(data->mag, n, k);
+
+    // Everything above the threshold, then ties
+    // until we've got k elements.
+    for (i = 0; i < n && count < k; i++) {
+        if (fabsf(r[i]) <= thr)
+            continue;
+
+        idx = (uint32_t)i;
+        memcpy(&out[1 + 2 * count], &idx, sizeof(idx));
+        memcpy(&out[2 + 2 * count], &r[i], sizeof(ctensor_data_t));
+
+        r[i] = 0.00;
+        count++;
+    }
+
+    for (i = 0; i < n && count < k; i++) {
+        if (fabsf(r[i]) != thr)
+            continue;
+
+        idx = (uint32_t)i;
+        memcpy(&out[1 + 2 * count], &idx, sizeof(idx));
+        memcpy(&out[2 + 2 * count], &r[i], sizeof(ctensor_data_t));
+
+        r[i] = 0.00;
+        count++;
+    }
+
+    out[0] = (uint32_t)count;
+
+    return sizeof(uint32_t) + count * (sizeof(uint32_t) + sizeof(ctensor_data_t));
+}
+
+static int ctensor_topk_decode(CTensor_Compressor_s *comp, const void *src, size_t bytes,
+                    ctensor_data_t *dst, size_t n)
+{
+    const uint32_t *in;
+    ctensor_data_t v;
+    size_t i, count;
+
+    if (bytes < sizeof(uint32_t))
+        return -1;
+
+    in = (const uint32_t *)src;
+    count = in[0];
+
+    if (bytes != sizeof(uint32_t) + count * (sizeof(uint32_t) + sizeof(ctensor_data_t)))
+        return -1;
+
+    // Check the whole payload before touching 'dst'.
+    for (i = 0; i < count; i++) {
+        if (in[1 + 2 * i] >= n)
+            return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        memcpy(&v, &in[2 + 2 * i], sizeof(v));
+        dst[in[1 + 2 * i]] += v;
+    }
+
+    return 0;
+}
+
+static void ctensor_compressor_del(CTensor_Compressor_s *comp)
+{
+    return;
+}
+
+static void ctensor_topk_reset(CTensor_Compressor_s *comp)
+{
+    _topk_s *data;
+    size_t i;
+
+    data = (_topk_s *)comp->internal;
+
+    if (data == NULL)
+        return;
+
+    for (i = 0; i < data->count; i++)
+        ctensor_destroy_tensor(data->entries[i].residual);
+
+    free(data->entries);
+
+    data->entries = NULL;
+    data->count = 0;
+
+    return;
+}
+
+static void ctensor_topk_del(CTensor_Compressor_s *comp)
+{
+    _topk_s *data;
+
+    data = (_topk_s *)comp->internal;
+
+    if (data == NULL)
+        return;
+
+    ctensor_topk_reset(comp);
+    free(data->mag);
+    free(data);
+
+    return;
+}
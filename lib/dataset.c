@@ -0,0 +1,101 @@
+/*
+ *  Memory-mapped datasets for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctensor/ctensor.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/*
+ *  Map a dataset file, read-only. The file holds all the
+ *  inputs (samples x in_size) followed by all the expected
+ *  outputs (samples x out_size), as raw ctensor_data_t.
+ *
+ *  The mapping is shared, every thread (and process) using
+ *  the same file reads the same page cache pages.
+ *
+ *  @param ds - Dataset to fill.
+ *  @param path - File path.
+ *  @param in_size - Size of each input.
+ *  @param out_size - Size of each expected output.
+ *
+ *  @return - 0 on success, -1 on failure.
+*/
+int ctensor_dataset_map(CTensor_Dataset_s *ds, const char *path,
+                    size_t in_size, size_t out_size)
+{
+    size_t sample_size;
+    struct stat st;
+    void *map;
+    int fd;
+
+    sample_size = (in_size + out_size) * sizeof(ctensor_data_t);
+
+    if (sample_size == 0)
+        return -1;
+
+    fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0 || st.st_size % sample_size != 0) {
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    // The mapping keeps the file around.
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return -1;
+
+    ds->samples = st.st_size / sample_size;
+    ds->in_size = in_size;
+    ds->out_size = out_size;
+
+    ds->x.size = ds->samples * in_size;
+    ds->x.data = (ctensor_data_t *)map;
+
+    ds->y.size = ds->samples * out_size;
+    ds->y.data = &ds->x.data[ds->x.size];
+
+    ds->map = map;
+    ds->map_size = st.st_size;
+
+    return 0;
+}
+
+/*
+ *  Unmap a dataset mapped with ctensor_dataset_map.
+ *
+ *  @param ds - Dataset.
+*/
+void ctensor_dataset_unmap(CTensor_Dataset_s *ds)
+{
+    if (ds->map != NULL)
+        munmap(ds->map, ds->map_size);
+
+    ds->map = NULL;
+    ds->map_size = 0;
+
+    return;
+}
@@ -0,0 +1,300 @@
+/*
+ *  Ensemble inference for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctensor/ctensor.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+void ctensor_fcl_fwd(CTensor_Layer_s *layer);
+void _ct_fuse(CTensor_Model_s *model, int enable);
+
+/*
+ *  All members start with an FCL over the same input, their
+ *  kernels are concatenated (row-wise) into a single one, so
+ *  that the input is streamed once, by one matrix-vector
+ *  product. Each member's first layer output is pointed into
+ *  the concatenated output.
+ *
+ *  The remaining layers run depth by depth, interleaving
+ *  members, and the outputs are combined in a single pass.
+*/
+typedef struct {
+    // Concatenated first layers, kernels (rows x in_size)
+    // followed by biases (rows).
+    ctensor_data_t      *params;
+    ctensor_data_t      *hidden;
+    size_t              rows;
+    size_t              in_size;
+    // Members' first layer outputs, before the ensemble.
+    ctensor_data_t      **own_out;
+    // Deepest member, in layers, and each member's next
+    // layer to run.
+    size_t              depth;
+    CTensor_Layer_s     **pos;
+} _ct_ensemble_s;
+
+/*
+ *  Set up an ensemble over trained models. Members keep
+ *  being usable on their own, but shall outlive the ensemble.
+ *
+ *  @param ens - Ensemble to init.
+ *  @param models - Members.
+ *  @param count - Number of members.
+ *  @param combine - CT_ENSEMBLE_MEAN or CT_ENSEMBLE_VOTE.
+ *
+ *  @return - 0 on success, -1 on failure.
+*/
+int ctensor_ensemble_init(CTensor_Ensemble_s *ens, CTensor_Model_s **models,
+                    size_t count, int combine)
+{
+    CTensor_Layer_s *first, *pos;
+    _ct_ensemble_s *data;
+    size_t i, j, depth;
+
+    if (count == 0)
+        return -1;
+
+    data = (_ct_ensemble_s *)calloc(1, sizeof(_ct_ensemble_s));
+
+    if (data == NULL)
+        return -1;
+
+    data->in_size = models[0]->startl->out->size;
+
+    for (i = 0; i < count; i++) {
+        // Members' first layers output into the ensemble,
+        // a model can only take one place.
+        for (j = 0; j < i; j++) {
+            if (models[j] == models[i]) {
+                free(data);
+                return -1;
+            }
+        }
+
+        // The first layer runs apart from the rest.
+        _ct_fuse(models[i], 0);
+
+        first = models[i]->startl->next;
+
+        if (first == NULL || first->fwd != (CTensor_Layer_cb)ctensor_fcl_fwd ||
+                    first->in->size != data->in_size ||
+                    models[i]->lastl->out->size != models[0]->lastl->out->size) {
+            free(data);
+            return -1;
+        }
+
+        data->rows += first->out->size;
+
+        depth = 0;
+
+        for (pos = first; pos != NULL; pos = pos->next)
+            depth++;
+
+        if (depth > data->depth)
+            data->depth = depth;
+    }
+
+    data->params = (ctensor_data_t *)malloc(data->rows * (data->in_size + 1) *
+                        sizeof(ctensor_data_t));
+    data->hidden = (ctensor_data_t *)malloc(data->rows * sizeof(ctensor_data_t));
+    data->own_out = (ctensor_data_t **)malloc(count * sizeof(ctensor_data_t *));
+    data->pos = (CTensor_Layer_s **)malloc(count * sizeof(CTensor_Layer_s *));
+
+    ens->out = ctensor_new_tensor(models[0]->lastl->out->size);
+
+    if (data->params == NULL || data->hidden == NULL || data->own_out == NULL ||
+                data->pos == NULL || ens->out == NULL) {
+        free(data->params);
+        free(data->hidden);
+        free(data->own_out);
+        free(data->pos);
+        free(data);
+
+        if (ens->out != NULL)
+            ctensor_destroy_tensor(ens->out);
+
+        return -1;
+    }
+
+    ens->models = models;
+    ens->count = count;
+    ens->combine = combine;
+    ens->internal = (void *)data;
+
+    ctensor_ensemble_refresh(ens);
+
+    return 0;
+}
+
+/*
+ *  Copy the members' first layer parameters into the
+ *  concatenated kernel, after members have been (re)trained.
+ *
+ *  @param ens - Ensemble.
+*/
+void ctensor_ensemble_refresh(CTensor_Ensemble_s *ens)
+{
+    size_t i, row = 0, in_s, out_s;
+    _ct_ensemble_s *data;
+    CTensor_Layer_s *first;
+    ctensor_data_t *bias;
+
+    data = (_ct_ensemble_s *)ens->internal;
+
+    in_s = data->in_size;
+    bias = &data->params[data->rows * in_s];
+
+    for (i = 0; i < ens->count; i++) {
+        // ctensor_train fuses the member's layers again.
+        _ct_fuse(ens->models[i], 0);
+
+        first = ens->models[i]->startl->next;
+        out_s = first->out->size;
+
+        memcpy(&data->params[row * in_s], first->internal_params->data,
+                    out_s * in_s * sizeof(ctensor_data_t));
+        memcpy(&bias[row], &first->internal_params->data[out_s * in_s],
+                    out_s * sizeof(ctensor_data_t));
+
+        if (first->out->data != &data->hidden[row]) {
+            data->own_out[i] = first->out->data;
+            first->out->data = &data->hidden[row];
+        }
+
+        row += out_s;
+    }
+
+    return;
+}
+
+/*
+ *  Combine the members' outputs into the ensemble's.
+*/
+static void _ct_ensemble_combine(CTensor_Ensemble_s *ens)
+{
+    ctensor_data_t *out, *member, inv;
+    size_t i, j, size, best;
+
+    out = ens->out->data;
+    size = ens->out->size;
+
+    inv = 1.00 / (ctensor_data_t)ens->count;
+
+    for (j = 0; j < size; j++)
+        out[j] = 0.00;
+
+    for (i = 0; i < ens->count; i++) {
+        member = ens->models[i]->lastl->out->data;
+
+        if (ens->combine != CT_ENSEMBLE_VOTE) {
+            for (j = 0; j < size; j++)
+                out[j] += member[j] * inv;
+
+            continue;
+        }
+
+        best = 0;
+
+        for (j = 1; j < size; j++) {
+            if (member[j] > member[best])
+                best = j;
+        }
+
+        out[best] += inv;
+    }
+
+    return;
+}
+
+/*
+ *  Obtain the ensemble's prediction, given an input.
+ *
+ *  @param ens - Ensemble.
+ *  @param input - Tensor containing the input data.
+ *
+ *  @return - Combined output (owned by the ensemble).
+*/
+CTensor_s *ctensor_ensemble_predict(CTensor_Ensemble_s *ens, CTensor_s *input)
+{
+    CTensor_Layer_s **pos;
+    _ct_ensemble_s *data;
+    size_t i, d;
+
+    data = (_ct_ensemble_s *)ens->internal;
+
+    // All first layers at once.
+    ctensor_mv_dot_product(data->params, data->rows, data->in_size,
+                input->data, data->hidden);
+    ctensor_vector_sum(data->hidden, data->rows,
+                &data->params[data->rows * data->in_size], data->hidden);
+
+    pos = data->pos;
+
+    // In case a member was trained without a refresh.
+    for (i = 0; i < ens->count; i++) {
+        _ct_fuse(ens->models[i], 0);
+        pos[i] = ens->models[i]->startl->next->next;
+    }
+
+    // Then the rest, one depth at a time.
+    for (d = 1; d < data->depth; d++) {
+        for (i = 0; i < ens->count; i++) {
+            if (pos[i] == NULL)
+                continue;
+
+            pos[i]->fwd(pos[i]);
+            pos[i] = pos[i]->next;
+        }
+    }
+
+    _ct_ensemble_combine(ens);
+
+    return ens->out;
+}
+
+/*
+ *  Cleanup the ensemble, members are left as they were.
+ *
+ *  @param ens - Ensemble.
+*/
+void ctensor_ensemble_destroy(CTensor_Ensemble_s *ens)
+{
+    _ct_ensemble_s *data;
+    CTensor_Layer_s *first;
+    size_t i;
+
+    data = (_ct_ensemble_s *)ens->internal;
+
+    for (i = 0; i < ens->count; i++) {
+        first = ens->models[i]->startl->next;
+        first->out->data = data->own_out[i];
+    }
+
+    ctensor_destroy_tensor(ens->out);
+
+    free(data->params);
+    free(data->hidden);
+    free(data->own_out);
+    free(data->pos);
+    free(data);
+
+    ens->out = NULL;
+    ens->internal = NULL;
+
+    return;
+}
@@ -19,17 +19,33 @@
 #include <ctensor/ctensor.h>
 
 #include <stdlib.h>
-
-typedef struct {
-    CTensor_s   *kernel;
-    CTensor_s   *bias;
-} _fcl_s;
+#include <string.h>
 
 void ctensor_fcl_fwd(CTensor_Layer_s *layer);
 void ctensor_fcl_bckp(CTensor_Layer_s *layer);
 void ctensor_fcl_update(CTensor_Layer_s *layer);
 void ctensor_fcl_del(CTensor_Layer_s *layer);
 
+static void ctensor_fcl_par_fwd(CTensor_Layer_s *layer);
+static void ctensor_fcl_par_bckp(CTensor_Layer_s *layer);
+static void ctensor_fcl_par_update(CTensor_Layer_s *layer);
+static void ctensor_fcl_par_del(CTensor_Layer_s *layer);
+
+void _ct_parallel_for(size_t n, void (*fn)(void *, size_t), void *arg);
+int _ct_pool_node(size_t t);
+int _ct_numa_bind(void *addr, size_t bytes, int node);
+
+/*
+ *  Row-sharded FCL state, shard s owns kernel rows
+ *  [out * s / shards, out * (s + 1) / shards) (and the
+ *  matching bias elements).
+*/
+typedef struct {
+    size_t          shards;
+    // Per-shard partial input gradients (shards x in_size).
+    ctensor_data_t  *partial;
+} _fcl_par_s;
+
 /*
  *  FCL initial layer function.
  *  Fills all the layer information for the
@@ -41,7 +57,7 @@ void ctensor_fcl_del(CTensor_Layer_s *layer);
 */
 void ctensor_fcl_init(CTensor_Layer_s *layer)
 {
-    _fcl_s *data;
+    size_t params_size;
 
     // Set all callbacks.
     layer->fwd = (CTensor_Layer_cb)ctensor_fcl_fwd;
@@ -49,28 +65,25 @@ void ctensor_fcl_init(CTensor_Layer_s *layer)
     layer->update = (CTensor_Layer_cb)ctensor_fcl_update;
     layer->del = (CTensor_Layer_cb)ctensor_fcl_del;
 
-    // Allocate internal state.
-    data = (_fcl_s *)malloc(sizeof(_fcl_s));
-    layer->internal = (void *)data;
-
-    if (data == NULL)
-        return;
+    // All of our state lives in the exported parameters.
+    layer->internal = NULL;
+    layer->internal_grad = NULL;
 
-    // Allocate the Tensor for the weights.
-    data->kernel = ctensor_new_tensor(layer->out->size * layer->in->size);
+    // The parameters are conformed by both the weights
+    // (out_size x in_size) and the bias (out_size), stored
+    // one after the other.
+    params_size = layer->out->size * layer->in->size + layer->out->size;
 
-    if (data->kernel == NULL)
-        return;
+    layer->internal_params = ctensor_new_tensor(params_size);
 
-    // Allocate the Tensor for the bias.
-    data->bias = ctensor_new_tensor(layer->out->size);
+    layer->kernel_rows = layer->out->size;
+    layer->kernel_cols = layer->in->size;
 
-    if (data->bias == NULL)
+    if (layer->internal_params == NULL)
         return;
 
-    // The internal gradient is conformed by both the weights and the bias.
-    layer->internal_grad =
-            ctensor_new_tensor(data->kernel->size + data->bias->size);
+    // The internal gradient shares the same layout.
+    layer->internal_grad = ctensor_new_tensor(params_size);
 
     if (layer->internal_grad == NULL)
         return;
@@ -88,19 +101,19 @@ void ctensor_fcl_init(CTensor_Layer_s *layer)
 */
 void ctensor_fcl_param_init(CTensor_Layer_s *layer, uint64_t seed)
 {
-    CTensor_s *kernel, *bias;
-    _fcl_s *data;
-    int i;
+    CTensor_s kernel, bias;
+    size_t offset;
 
-    data = (_fcl_s *)layer->internal;
+    offset = layer->out->size * layer->in->size;
 
-    kernel = data->kernel;
-    bias = data->bias;
+    kernel.size = offset;
+    kernel.data = layer->internal_params->data;
 
-    ctensor_xavier_he_init(kernel, layer->in->size, seed);
+    bias.size = layer->out->size;
+    bias.data = &layer->internal_params->data[offset];
 
-    for (i = 0; i < bias->size; i++)
-        bias->data[i] = 0.00;
+    ctensor_xavier_he_init(&kernel, layer->in->size, seed);
+    ctensor_tensor_zeros(&bias);
 
     return;
 }
@@ -119,19 +132,17 @@ void ctensor_fcl_param_init(CTensor_Layer_s *layer, uint64_t seed)
 */
 void ctensor_fcl_fwd(CTensor_Layer_s *layer)
 {
-    CTensor_s *kernel, *bias, *in, *out;
-    _fcl_s *data;
+    ctensor_data_t *kernel, *bias;
+    CTensor_s *in, *out;
 
     in = layer->in;
     out = layer->out;
 
-    data = (_fcl_s *)layer->internal;
-
-    kernel = data->kernel;
-    bias = data->bias;
+    kernel = layer->internal_params->data;
+    bias = &kernel[out->size * in->size];
 
-    ctensor_mv_dot_product(kernel->data, out->size, in->size, in->data, out->data);
-    ctensor_vector_sum(out->data, out->size, bias->data, out->data);
+    ctensor_mv_dot_product(kernel, out->size, in->size, in->data, out->data);
+    ctensor_vector_sum(out->data, out->size, bias, out->data);
 
     return;
 }
@@ -147,7 +158,6 @@ void ctensor_fcl_bckp(CTensor_Layer_s *layer)
     ctensor_data_t *kernel_grad, *bias_grad, *loss_grad, *in_grad;
     ctensor_data_t *in_data, *kernel_data;
     size_t in_size, out_size;
-    _fcl_s *data;
     int i, j;
 
     in_size = layer->in->size;
@@ -155,8 +165,7 @@ void ctensor_fcl_bckp(CTensor_Layer_s *layer)
 
     in_data = layer->in->data;
 
-    data = (_fcl_s *)layer->internal;
-    kernel_data = data->kernel->data;
+    kernel_data = layer->internal_params->data;
 
     in_grad = layer->in_grad->data;
     loss_grad = layer->loss_grad->data;
@@ -168,7 +177,7 @@ void ctensor_fcl_bckp(CTensor_Layer_s *layer)
         in_grad[i] = 0.00;
 
         for (j = 0; j < out_size; j++) {
-            in_grad[i] += kernel_data[j * in_size + i] * loss_grad[i];
+            in_grad[i] += kernel_data[j * in_size + i] * loss_grad[j];
         }
     }
 
@@ -197,20 +206,13 @@ void ctensor_fcl_bckp(CTensor_Layer_s *layer)
 */
 void ctensor_fcl_update(CTensor_Layer_s *layer)
 {
-    ctensor_data_t *kernel, *bias, *internal_grad;
-    _fcl_s *data;
-    int offset;
+    CTensor_s *params, *internal_grad;
 
-    internal_grad = layer->internal_grad->data;
-    data = (_fcl_s *)layer->internal;
+    internal_grad = layer->internal_grad;
+    params = layer->internal_params;
 
-    kernel = data->kernel->data;
-    bias = data->bias->data;
-
-    offset = data->kernel->size;
-
-    ctensor_vector_sum(kernel, data->kernel->size, internal_grad, kernel);
-    ctensor_vector_sum(bias, data->bias->size, &internal_grad[offset], bias);
+    // Kernel and bias are contiguous, update both at once.
+    ctensor_vector_sum(params->data, params->size, internal_grad->data, params->data);
 
     return;
 }
@@ -223,20 +225,337 @@ void ctensor_fcl_update(CTensor_Layer_s *layer)
 */
 void ctensor_fcl_del(CTensor_Layer_s *layer)
 {
-    _fcl_s *data;
-
     ctensor_destroy_tensor(layer->internal_grad);
     layer->internal_grad = NULL;
 
-    data = layer->internal;
+    ctensor_destroy_tensor(layer->internal_params);
+    layer->internal_params = NULL;
+
+    return;
+}
+
+/*
+ *  Rows of the s-th shard.
+*/
+static inline void _ct_fcl_shard(CTensor_Layer_s *layer, size_t s, size_t *lo, size_t *hi)
+{
+    _fcl_par_s *data;
+
+    data = (_fcl_par_s *)layer->internal;
+
+    *lo = layer->out->size * s / data->shards;
+    *hi = layer->out->size * (s + 1) / data->shards;
+
+    return;
+}
+
+/*
+ *  First touch of each shard's rows, by the thread the
+ *  shard is dealt to, so that pages land on its memory
+ *  node. If threads are pinned, the rows are also
+ *  explicitly placed on its node. Idle threads may still
+ *  steal a shard, so locality is best-effort.
+ *
+ *  Same for the activations the shard writes: its slice
+ *  of 'out', its partial input gradient, and the columns
+ *  of 'in_grad' it reduces.
+*/
+static void _ct_fcl_par_touch(void *arg, size_t s)
+{
+    size_t lo, hi, in_s, out_s, clo, chi;
+    ctensor_data_t *partial;
+    CTensor_Layer_s *layer;
+    _fcl_par_s *data;
+    int node;
+
+    layer = (CTensor_Layer_s *)arg;
+    data = (_fcl_par_s *)layer->internal;
+
+    in_s = layer->in->size;
+    out_s = layer->out->size;
+
+    _ct_fcl_shard(layer, s, &lo, &hi);
+
+    partial = &data->partial[s * in_s];
+
+    clo = in_s * s / data->shards;
+    chi = in_s * (s + 1) / data->shards;
+
+    node = _ct_pool_node(s);
+
+    if (node >= 0) {
+        _ct_numa_bind(&layer->internal_params->data[lo * in_s],
+                    (hi - lo) * in_s * sizeof(ctensor_data_t), node);
+        _ct_numa_bind(&layer->internal_grad->data[lo * in_s],
+                    (hi - lo) * in_s * sizeof(ctensor_data_t), node);
+
+        _ct_numa_bind(&layer->out->data[lo], (hi - lo) * sizeof(ctensor_data_t), node);
+        _ct_numa_bind(partial, in_s * sizeof(ctensor_data_t), node);
+        _ct_numa_bind(&layer->in_grad->data[clo], (chi - clo) * sizeof(ctensor_data_t),
+                    node);
+    }
+
+    memset(&layer->out->data[lo], 0, (hi - lo) * sizeof(ctensor_data_t));
+    memset(partial, 0, in_s * sizeof(ctensor_data_t));
+    memset(&layer->in_grad->data[clo], 0, (chi - clo) * sizeof(ctensor_data_t));
+
+    memset(&layer->internal_params->data[lo * in_s], 0,
+            (hi - lo) * in_s * sizeof(ctensor_data_t));
+    memset(&layer->internal_params->data[out_s * in_s + lo], 0,
+            (hi - lo) * sizeof(ctensor_data_t));
 
-    ctensor_destroy_tensor(data->kernel);
-    ctensor_destroy_tensor(data->bias);
+    memset(&layer->internal_grad->data[lo * in_s], 0,
+            (hi - lo) * in_s * sizeof(ctensor_data_t));
+    memset(&layer->internal_grad->data[out_s * in_s + lo], 0,
+            (hi - lo) * sizeof(ctensor_data_t));
 
-    data->kernel = NULL;
-    data->bias = NULL;
+    return;
+}
 
-    free(data);
+/*
+ *  Give the layer back the plain FCL callbacks.
+*/
+static void _ct_fcl_par_fallback(CTensor_Layer_s *layer)
+{
+    layer->fwd = (CTensor_Layer_cb)ctensor_fcl_fwd;
+    layer->bckp = (CTensor_Layer_cb)ctensor_fcl_bckp;
+    layer->update = (CTensor_Layer_cb)ctensor_fcl_update;
+    layer->del = (CTensor_Layer_cb)ctensor_fcl_del;
+    layer->internal = NULL;
 
     return;
-}
\ No newline at end of file
+}
+
+/*
+ *  Row-sharded FCL initial layer function.
+ *
+ *  Same layer as ctensor_fcl_init (and the same parameter
+ *  layout, so ctensor_fcl_param_init applies), with the
+ *  kernel partitioned by output rows into one shard per
+ *  thread (see ctensor_set_threads). Each thread computes
+ *  its slice of 'out', and the slices of the input gradient
+ *  are reduced at the end of the backward pass.
+ *
+ *  @param layer - Pointer of the current
+ *  layer "object" to be filled.
+*/
+void ctensor_fcl_par_init(CTensor_Layer_s *layer)
+{
+    _fcl_par_s *data;
+
+    ctensor_fcl_init(layer);
+
+    layer->fwd = (CTensor_Layer_cb)ctensor_fcl_par_fwd;
+    layer->bckp = (CTensor_Layer_cb)ctensor_fcl_par_bckp;
+    layer->update = (CTensor_Layer_cb)ctensor_fcl_par_update;
+    layer->del = (CTensor_Layer_cb)ctensor_fcl_par_del;
+
+    data = (_fcl_par_s *)malloc(sizeof(_fcl_par_s));
+    layer->internal = (void *)data;
+
+    // Without our state, run as a plain FCL.
+    if (data == NULL) {
+        _ct_fcl_par_fallback(layer);
+        return;
+    }
+
+    data->shards = 1;
+    data->partial = NULL;
+
+    if (layer->internal_grad == NULL)
+        return;
+
+    data->shards = ctensor_get_threads();
+
+    // Every shard needs at least a row.
+    if (data->shards > layer->out->size)
+        data->shards = layer->out->size;
+
+    if (data->shards == 0)
+        data->shards = 1;
+
+    data->partial = (ctensor_data_t *)malloc(data->shards * layer->in->size *
+                        sizeof(ctensor_data_t));
+
+    if (data->partial == NULL) {
+        free(data);
+        _ct_fcl_par_fallback(layer);
+        return;
+    }
+
+    _ct_parallel_for(data->shards, _ct_fcl_par_touch, (void *)layer);
+
+    return;
+}
+
+static void _ct_fcl_par_fwd_shard(void *arg, size_t s)
+{
+    ctensor_data_t *kernel, *bias;
+    CTensor_Layer_s *layer;
+    size_t lo, hi, in_s;
+
+    layer = (CTensor_Layer_s *)arg;
+
+    in_s = layer->in->size;
+
+    kernel = layer->internal_params->data;
+    bias = &kernel[layer->out->size * in_s];
+
+    _ct_fcl_shard(layer, s, &lo, &hi);
+
+    ctensor_mv_dot_product(&kernel[lo * in_s], hi - lo, in_s, layer->in->data,
+                &layer->out->data[lo]);
+    ctensor_vector_sum(&layer->out->data[lo], hi - lo, &bias[lo], &layer->out->data[lo]);
+
+    return;
+}
+
+static void ctensor_fcl_par_fwd(CTensor_Layer_s *layer)
+{
+    _fcl_par_s *data;
+
+    data = (_fcl_par_s *)layer->internal;
+
+    _ct_parallel_for(data->shards, _ct_fcl_par_fwd_shard, (void *)layer);
+
+    return;
+}
+
+/*
+ *  Kernel and bias gradients of the shard's rows, and
+ *  the shard's partial input gradient.
+*/
+static void _ct_fcl_par_bckp_shard(void *arg, size_t s)
+{
+    ctensor_data_t *kernel, *kernel_grad, *loss_grad, *in_data, *partial;
+    CTensor_Layer_s *layer;
+    size_t lo, hi, in_s, out_s, i, j;
+    _fcl_par_s *data;
+
+    layer = (CTensor_Layer_s *)arg;
+    data = (_fcl_par_s *)layer->internal;
+
+    in_s = layer->in->size;
+    out_s = layer->out->size;
+
+    kernel = layer->internal_params->data;
+    kernel_grad = layer->internal_grad->data;
+    loss_grad = layer->loss_grad->data;
+    in_data = layer->in->data;
+
+    partial = &data->partial[s * in_s];
+
+    _ct_fcl_shard(layer, s, &lo, &hi);
+
+    for (i = 0; i < in_s; i++)
+        partial[i] = 0.00;
+
+    // Row-wise, so we stream through our rows once.
+    for (j = lo; j < hi; j++) {
+        for (i = 0; i < in_s; i++) {
+            partial[i] += kernel[j * in_s + i] * loss_grad[j];
+            kernel_grad[j * in_s + i] = in_data[i] * loss_grad[j];
+        }
+
+        kernel_grad[out_s * in_s + j] = loss_grad[j];
+    }
+
+    return;
+}
+
+/*
+ *  Sum the partial input gradients, the input is split
+ *  into as many column ranges as shards.
+*/
+static void _ct_fcl_par_reduce(void *arg, size_t s)
+{
+    ctensor_data_t *in_grad, sum;
+    CTensor_Layer_s *layer;
+    size_t lo, hi, in_s, i, k;
+    _fcl_par_s *data;
+
+    layer = (CTensor_Layer_s *)arg;
+    data = (_fcl_par_s *)layer->internal;
+
+    in_s = layer->in->size;
+    in_grad = layer->in_grad->data;
+
+    lo = in_s * s / data->shards;
+    hi = in_s * (s + 1) / data->shards;
+
+    for (i = lo; i < hi; i++) {
+        sum = 0.00;
+
+        for (k = 0; k < data->shards; k++)
+            sum += data->partial[k * in_s + i];
+
+        in_grad[i] = sum;
+    }
+
+    return;
+}
+
+static void ctensor_fcl_par_bckp(CTensor_Layer_s *layer)
+{
+    _fcl_par_s *data;
+
+    data = (_fcl_par_s *)layer->internal;
+
+    _ct_parallel_for(data->shards, _ct_fcl_par_bckp_shard, (void *)layer);
+    _ct_parallel_for(data->shards, _ct_fcl_par_reduce, (void *)layer);
+
+    return;
+}
+
+static void _ct_fcl_par_update_shard(void *arg, size_t s)
+{
+    ctensor_data_t *params, *grad;
+    CTensor_Layer_s *layer;
+    size_t lo, hi, in_s, out_s;
+
+    layer = (CTensor_Layer_s *)arg;
+
+    in_s = layer->in->size;
+    out_s = layer->out->size;
+
+    params = layer->internal_params->data;
+    grad = layer->internal_grad->data;
+
+    _ct_fcl_shard(layer, s, &lo, &hi);
+
+    ctensor_vector_sum(&params[lo * in_s], (hi - lo) * in_s, &grad[lo * in_s],
+                &params[lo * in_s]);
+    ctensor_vector_sum(&params[out_s * in_s + lo], hi - lo, &grad[out_s * in_s + lo],
+                &params[out_s * in_s + lo]);
+
+    return;
+}
+
+static void ctensor_fcl_par_update(CTensor_Layer_s *layer)
+{
+    _fcl_par_s *data;
+
+    data = (_fcl_par_s *)layer->internal;
+
+    _ct_parallel_for(data->shards, _ct_fcl_par_update_shard, (void *)layer);
+
+    return;
+}
+
+static void ctensor_fcl_par_del(CTensor_Layer_s *layer)
+{
+    _fcl_par_s *data;
+
+    data = (_fcl_par_s *)layer->internal;
+
+    if (data != NULL) {
+        free(data->partial);
+        free(data);
+    }
+
+    layer->internal = NULL;
+
+    ctensor_fcl_del(layer);
+
+    return;
+}
@@ -0,0 +1,236 @@
+/*
+ *  Freeze-time layer folding for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctensor/ctensor.h>
+
+#include <stdlib.h>
+
+void ctensor_fcl_fwd(CTensor_Layer_s *layer);
+void ctensor_affine_fwd(CTensor_Layer_s *layer);
+
+void _ct_fuse(CTensor_Model_s *model, int enable);
+
+/*
+ *  An FCL followed by an affine layer, or by another FCL
+ *  (nothing in between), is a single affine map:
+ *
+ *      s * (W x + b) + t = (s W) x + (s b + t)
+ *      W2 (W1 x + b1) + b2 = (W2 W1) x + (W2 b1 + b2)
+ *
+ *  The first FCL gets the combined kernel and bias, and
+ *  takes over the second layer's output tensor (which the
+ *  following layer reads), the second layer is dropped.
+ *
+ *  Two FCLs are only folded when the combined kernel is
+ *  smaller than theirs combined (it's out x in, instead of
+ *  hidden x in + out x hidden).
+*/
+
+static int _ct_fold_is_fcl(CTensor_Layer_s *layer)
+{
+    return layer->fwd == (CTensor_Layer_cb)ctensor_fcl_fwd && layer->internal == NULL;
+}
+
+/*
+ *  Whether 'next' can be folded into the FCL 'layer'.
+*/
+static int _ct_fold_check(CTensor_Layer_s *layer, CTensor_Layer_s *next)
+{
+    size_t in, hidden, out;
+
+    if (next->inputs != NULL || next->in != layer->out)
+        return 0;
+
+    if (next->fwd == (CTensor_Layer_cb)ctensor_affine_fwd)
+        return next->internal != NULL && next->out->size == layer->out->size;
+
+    if (!_ct_fold_is_fcl(next))
+        return 0;
+
+    in = layer->in->size;
+    hidden = layer->out->size;
+    out = next->out->size;
+
+    return out * in < hidden * (in + out);
+}
+
+/*
+ *  Combined kernel and bias, for an affine 'next'.
+*/
+static void _ct_fold_affine(CTensor_Layer_s *layer, CTensor_Layer_s *next,
+                    ctensor_data_t *params)
+{
+    ctensor_data_t *kernel, *bias, *scale, *shift;
+    size_t i, j, in, out;
+
+    in = layer->in->size;
+    out = layer->out->size;
+
+    kernel = layer->internal_params->data;
+    bias = &kernel[out * in];
+
+    scale = ((CTensor_s *)next->internal)->data;
+    shift = &scale[out];
+
+    for (i = 0; i < out; i++) {
+        for (j = 0; j < in; j++)
+            params[i * in + j] = scale[i] * kernel[i * in + j];
+
+        params[out * in + i] = scale[i] * bias[i] + shift[i];
+    }
+
+    return;
+}
+
+/*
+ *  Combined kernel and bias, for an FCL 'next'.
+*/
+static void _ct_fold_fcl(CTensor_Layer_s *layer, CTensor_Layer_s *next,
+                    ctensor_data_t *params)
+{
+    ctensor_data_t *k1, *b1, *k2, *b2;
+    size_t i, j, h, in, hidden, out;
+    double acc;
+
+    in = layer->in->size;
+    hidden = layer->out->size;
+    out = next->out->size;
+
+    k1 = layer->internal_params->data;
+    b1 = &k1[hidden * in];
+
+    k2 = next->internal_params->data;
+    b2 = &k2[out * hidden];
+
+    for (i = 0; i < out; i++) {
+        for (j = 0; j < in; j++) {
+            acc = 0.00;
+
+            for (h = 0; h < hidden; h++)
+                acc += (double)k2[i * hidden + h] * (double)k1[h * in + j];
+
+            params[i * in + j] = (ctensor_data_t)acc;
+        }
+
+        acc = b2[i];
+
+        for (h = 0; h < hidden; h++)
+            acc += (double)k2[i * hidden + h] * (double)b1[h];
+
+        params[out * in + i] = (ctensor_data_t)acc;
+    }
+
+    return;
+}
+
+/*
+ *  Fold 'next' into the FCL 'layer', and drop it.
+*/
+static int _ct_fold(CTensor_Model_s *model, CTensor_Layer_s *layer, CTensor_Layer_s *next)
+{
+    CTensor_s *params, *grad;
+    size_t in, out;
+
+    in = layer->in->size;
+    out = next->out->size;
+
+    params = ctensor_new_tensor(out * in + out);
+    grad = ctensor_new_tensor(out * in + out);
+
+    if (params == NULL || grad == NULL) {
+        if (params != NULL)
+            ctensor_destroy_tensor(params);
+
+        if (grad != NULL)
+            ctensor_destroy_tensor(grad);
+
+        return -1;
+    }
+
+    if (_ct_fold_is_fcl(next))
+        _ct_fold_fcl(layer, next, params->data);
+    else
+        _ct_fold_affine(layer, next, params->data);
+
+    ctensor_destroy_tensor(layer->internal_params);
+    ctensor_destroy_tensor(layer->internal_grad);
+    ctensor_destroy_tensor(layer->out);
+
+    layer->internal_params = params;
+    layer->internal_grad = grad;
+    layer->kernel_rows = out;
+    layer->kernel_cols = in;
+
+    // Take 'next's place in the list.
+    layer->out = next->out;
+    layer->loss_grad = next->loss_grad;
+    layer->next = next->next;
+
+    if (next->next != NULL)
+        next->next->prev = layer;
+
+    if (model->lastl == next)
+        model->lastl = layer;
+
+    if (model->lossl != NULL && model->lossl->prev == next)
+        model->lossl->prev = layer;
+
+    if (next->del != NULL)
+        next->del(next);
+
+    ctensor_destroy_tensor(next->in_grad);
+    free(next->inputs);
+    free(next);
+
+    return 0;
+}
+
+/*
+ *  Freeze a trained model for inference, folding layers
+ *  into the FCLs before them where possible.
+ *
+ *  @param model - Model.
+ *
+ *  @return - Number of layers folded away.
+*/
+size_t ctensor_freeze(CTensor_Model_s *model)
+{
+    CTensor_Layer_s *pos;
+    size_t folded = 0;
+
+    if (model->graph != NULL)
+        return 0;
+
+    // Fold the layers as they were added.
+    _ct_fuse(model, 0);
+
+    for (pos = model->startl->next; pos != NULL; pos = pos->next) {
+        if (!_ct_fold_is_fcl(pos))
+            continue;
+
+        while (pos->next != NULL && _ct_fold_check(pos, pos->next)) {
+            if (_ct_fold(model, pos, pos->next) != 0)
+                break;
+
+            folded++;
+        }
+    }
+
+    _ct_fuse(model, 1);
+
+    return folded;
+}
@@ -0,0 +1,351 @@
+/*
+ *  Layer fusion for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctensor/ctensor.h>
+
+#include <stdlib.h>
+
+void ctensor_fcl_fwd(CTensor_Layer_s *layer);
+void ctensor_fcl_bckp(CTensor_Layer_s *layer);
+void ctensor_fcl_del(CTensor_Layer_s *layer);
+void ctensor_relu_fwd(CTensor_Layer_s *layer);
+void ctensor_relu_bckp(CTensor_Layer_s *layer);
+void ctensor_affine_fwd(CTensor_Layer_s *layer);
+void ctensor_affine_bckp(CTensor_Layer_s *layer);
+
+static void _ct_fused_fwd(CTensor_Layer_s *layer);
+static void _ct_fused_bckp(CTensor_Layer_s *layer);
+static void _ct_fused_del(CTensor_Layer_s *layer);
+
+/*
+ *  Element-wise layers (ReLU, affine) following an FCL are
+ *  fused into it: the FCL computes each output row, and
+ *  runs it through the whole chain before storing it into
+ *  the chain's last output; the fused layers themselves
+ *  become no-ops. The FCL's own output keeps the values
+ *  before the chain, the backward pass recomputes the
+ *  chain from them to get its derivative, as the FCL's
+ *  kernel gradients are computed.
+ *
+ *  Results match the unfused layers exactly.
+*/
+
+#define CT_FUSE_MAX_OPS 8
+
+enum {
+    CT_FUSE_RELU = 0,
+    CT_FUSE_AFFINE,
+};
+
+typedef struct {
+    CTensor_Layer_s     *layer;
+    int                 kind;
+    // Affine scale and shift.
+    ctensor_data_t      *scale;
+    ctensor_data_t      *shift;
+} _ct_fuse_op_s;
+
+typedef struct {
+    _ct_fuse_op_s       ops[CT_FUSE_MAX_OPS];
+    size_t              nops;
+    CTensor_Layer_s     *last;
+} _ct_fused_s;
+
+static void _ct_fuse_nop(CTensor_Layer_s *layer)
+{
+    (void)layer;
+
+    return;
+}
+
+/*
+ *  Fusable kind of a layer, -1 if it isn't.
+*/
+static int _ct_fuse_kind(CTensor_Layer_s *layer, CTensor_Layer_s *prev)
+{
+    if (layer->inputs != NULL || layer->in != prev->out ||
+                layer->out->size != prev->out->size)
+        return -1;
+
+    if (layer->fwd == (CTensor_Layer_cb)ctensor_relu_fwd)
+        return CT_FUSE_RELU;
+
+    if (layer->fwd == (CTensor_Layer_cb)ctensor_affine_fwd && layer->internal != NULL)
+        return CT_FUSE_AFFINE;
+
+    return -1;
+}
+
+/*
+ *  Give an FCL back its own callbacks, and its fused
+ *  layers theirs.
+*/
+static void _ct_fuse_undo(CTensor_Layer_s *layer)
+{
+    _ct_fused_s *fused;
+    _ct_fuse_op_s *op;
+    size_t k;
+
+    fused = (_ct_fused_s *)layer->internal;
+
+    for (k = 0; k < fused->nops; k++) {
+        op = &fused->ops[k];
+
+        if (op->kind == CT_FUSE_RELU) {
+            op->layer->fwd = (CTensor_Layer_cb)ctensor_relu_fwd;
+            op->layer->bckp = (CTensor_Layer_cb)ctensor_relu_bckp;
+        } else {
+            op->layer->fwd = (CTensor_Layer_cb)ctensor_affine_fwd;
+            op->layer->bckp = (CTensor_Layer_cb)ctensor_affine_bckp;
+        }
+    }
+
+    layer->fwd = (CTensor_Layer_cb)ctensor_fcl_fwd;
+    layer->bckp = (CTensor_Layer_cb)ctensor_fcl_bckp;
+    layer->del = (CTensor_Layer_cb)ctensor_fcl_del;
+    layer->internal = NULL;
+
+    free(fused);
+
+    return;
+}
+
+/*
+ *  Fuse the element-wise layers following an FCL, if any.
+ *
+ *  @return - Last layer of the fused chain.
+*/
+static CTensor_Layer_s *_ct_fuse_fcl(CTensor_Layer_s *layer)
+{
+    CTensor_Layer_s *pos, *prev;
+    _ct_fused_s *fused;
+    _ct_fuse_op_s *op;
+    int kind;
+
+    prev = layer;
+    pos = layer->next;
+
+    if (pos == NULL || _ct_fuse_kind(pos, prev) < 0)
+        return layer;
+
+    fused = (_ct_fused_s *)malloc(sizeof(_ct_fused_s));
+
+    if (fused == NULL)
+        return layer;
+
+    fused->nops = 0;
+
+    while (pos != NULL && fused->nops < CT_FUSE_MAX_OPS) {
+        kind = _ct_fuse_kind(pos, prev);
+
+        if (kind < 0)
+            break;
+
+        op = &fused->ops[fused->nops++];
+
+        op->layer = pos;
+        op->kind = kind;
+        op->scale = NULL;
+        op->shift = NULL;
+
+        if (kind == CT_FUSE_AFFINE) {
+            op->scale = ((CTensor_s *)pos->internal)->data;
+            op->shift = &op->scale[pos->out->size];
+        }
+
+        pos->fwd = (CTensor_Layer_cb)_ct_fuse_nop;
+        pos->bckp = (CTensor_Layer_cb)_ct_fuse_nop;
+
+        prev = pos;
+        pos = pos->next;
+    }
+
+    fused->last = prev;
+
+    layer->fwd = (CTensor_Layer_cb)_ct_fused_fwd;
+    layer->bckp = (CTensor_Layer_cb)_ct_fused_bckp;
+    layer->del = (CTensor_Layer_cb)_ct_fused_del;
+    layer->internal = (void *)fused;
+
+    return prev;
+}
+
+/*
+ *  Undo every fusion of a model, then fuse again if asked
+ *  to (Sequential models only).
+ *
+ *  @param model - Model.
+ *  @param enable - Non-zero to fuse.
+*/
+void _ct_fuse(CTensor_Model_s *model, int enable)
+{
+    CTensor_Layer_s *pos;
+
+    for (pos = model->startl->next; pos != NULL; pos = pos->next) {
+        if (pos->fwd == (CTensor_Layer_cb)_ct_fused_fwd)
+            _ct_fuse_undo(pos);
+    }
+
+    if (!enable || model->graph != NULL)
+        return;
+
+    for (pos = model->startl->next; pos != NULL; pos = pos->next) {
+        if (pos->fwd == (CTensor_Layer_cb)ctensor_fcl_fwd && pos->internal == NULL)
+            pos = _ct_fuse_fcl(pos);
+    }
+
+    return;
+}
+
+/*
+ *  Run the chain over one value, keeping each op's input.
+*/
+static inline ctensor_data_t _ct_fuse_chain(const _ct_fused_s *fused, size_t i,
+                    ctensor_data_t v, ctensor_data_t *vals)
+{
+    const _ct_fuse_op_s *op;
+    size_t k;
+
+    for (k = 0; k < fused->nops; k++) {
+        op = &fused->ops[k];
+
+        if (vals != NULL)
+            vals[k] = v;
+
+        if (op->kind == CT_FUSE_RELU)
+            v = (v < 0) ? 0 : v;
+        else
+            v = v * op->scale[i] + op->shift[i];
+    }
+
+    return v;
+}
+
+/*
+ *  FCL forward pass, with the chain as its epilogue.
+*/
+static void _ct_fused_fwd(CTensor_Layer_s *layer)
+{
+    ctensor_data_t *kernel, *bias, *in, *out, *last, c;
+    size_t i, j, in_size, out_size;
+    _ct_fused_s *fused;
+
+    fused = (_ct_fused_s *)layer->internal;
+
+    in_size = layer->in->size;
+    out_size = layer->out->size;
+
+    kernel = layer->internal_params->data;
+    bias = &kernel[out_size * in_size];
+
+    in = layer->in->data;
+    out = layer->out->data;
+    last = fused->last->out->data;
+
+    for (i = 0; i < out_size; i++) {
+        c = 0.00;
+
+        for (j = 0; j < in_size; j++)
+            c += kernel[j] * in[j];
+
+        out[i] = c + bias[i];
+        last[i] = _ct_fuse_chain(fused, i, out[i], NULL);
+
+        kernel += in_size;
+    }
+
+    return;
+}
+
+/*
+ *  FCL backprop pass, the loss gradient is first taken
+ *  back through the chain, row by row.
+*/
+static void _ct_fused_bckp(CTensor_Layer_s *layer)
+{
+    ctensor_data_t *kernel_grad, *bias_grad, *loss_grad, *grad, *in_grad;
+    ctensor_data_t vals[CT_FUSE_MAX_OPS], *in_data, *kernel_data, g;
+    size_t i, j, k, in_size, out_size;
+    _ct_fused_s *fused;
+
+    fused = (_ct_fused_s *)layer->internal;
+
+    in_size = layer->in->size;
+    out_size = layer->out->size;
+
+    in_data = layer->in->data;
+    kernel_data = layer->internal_params->data;
+
+    in_grad = layer->in_grad->data;
+    loss_grad = fused->last->loss_grad->data;
+    // The first fused layer's input gradient, unused otherwise.
+    grad = layer->loss_grad->data;
+
+    kernel_grad = layer->internal_grad->data;
+    bias_grad = &kernel_grad[out_size * in_size];
+
+    for (i = 0; i < out_size; i++) {
+        _ct_fuse_chain(fused, i, layer->out->data[i], vals);
+
+        g = loss_grad[i];
+
+        for (k = fused->nops; k > 0; k--) {
+            if (fused->ops[k - 1].kind == CT_FUSE_RELU)
+                g = (vals[k - 1] <= 0) ? 0 : g;
+            else
+                g = g * fused->ops[k - 1].scale[i];
+        }
+
+        grad[i] = g;
+
+        for (j = 0; j < in_size; j++)
+            kernel_grad[i * in_size + j] = in_data[j] * g;
+
+        bias_grad[i] = g;
+    }
+
+    for (i = 0; i < in_size; i++) {
+        in_grad[i] = 0.00;
+
+        for (j = 0; j < out_size; j++)
+            in_grad[i] += kernel_data[j * in_size + i] * grad[j];
+    }
+
+    return;
+}
+
+static void _ct_fused_del(CTensor_Layer_s *layer)
+{
+    free(layer->internal);
+    layer->internal = NULL;
+
+    ctensor_fcl_del(layer);
+
+    return;
+}
+
+/*
+ *  Finalize a model once all of its layers are set.
+ *
+ *  @param model - Model.
+*/
+void ctensor_finalize(CTensor_Model_s *model)
+{
+    _ct_fuse(model, 1);
+
+    return;
+}
@@ -0,0 +1,515 @@
+/*
+ *  DAG model execution for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctensor/ctensor.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+
+void _ct_parallel_for(size_t n, void (*fn)(void *, size_t), void *arg);
+
+/*
+ *  Layers are still kept as a list, in the order they were
+ *  added, which is a topological order of the DAG. The plan
+ *  groups them by level (1 + the deepest of their inputs,
+ *  the input layer being level 0); layers of a level don't
+ *  depend on each other, and run concurrently.
+ *
+ *  Layers feeding more than one input (or a merge) get a
+ *  loss gradient accumulator of their own, their consumers'
+ *  input gradients are added into it once computed. Others
+ *  keep using their consumer's 'in_grad' directly.
+ *
+ *  Predictions point the intermediate outputs into a single
+ *  arena, each one live from its level to its last
+ *  consumer's, and placed first-fit among those it overlaps
+ *  with.
+*/
+
+#define CT_GRAPH_NONE SIZE_MAX
+
+typedef struct {
+    CTensor_Layer_s     *layer;
+    // Levels at which the output is produced, and last read.
+    size_t              level;
+    size_t              last;
+    // Producers (node indices, CT_GRAPH_NONE for the
+    // input layer), and number of consumer edges.
+    size_t              *inputs;
+    size_t              ninputs;
+    size_t              consumers;
+    CTensor_s           *acc;
+    // Offset in the flat gradient vector.
+    size_t              grad_off;
+    // Offset in the arena (CT_GRAPH_NONE if not placed),
+    // and the layer's own output buffer meanwhile.
+    size_t              slot;
+    ctensor_data_t      *own;
+} _ct_node_s;
+
+struct _ct_graph_s {
+    int                 stale;
+    _ct_node_s          *nodes;
+    size_t              nnodes;
+    // Node indices by level, level l being
+    // order[levels[l - 1], levels[l]).
+    size_t              *order;
+    size_t              *levels;
+    size_t              nlevels;
+    CTensor_s           *arena;
+    // Current pass.
+    size_t              lo;
+    ctensor_data_t      *grad;
+};
+
+/*
+ *  Drop the plan's contents (keeps the plan itself).
+*/
+static void _ct_graph_clear(struct _ct_graph_s *g)
+{
+    size_t i;
+
+    for (i = 0; g->nodes != NULL && i < g->nnodes; i++) {
+        free(g->nodes[i].inputs);
+
+        if (g->nodes[i].acc != NULL)
+            ctensor_destroy_tensor(g->nodes[i].acc);
+    }
+
+    if (g->arena != NULL)
+        ctensor_destroy_tensor(g->arena);
+
+    free(g->nodes);
+    free(g->order);
+    free(g->levels);
+
+    g->nodes = NULL;
+    g->order = NULL;
+    g->levels = NULL;
+    g->arena = NULL;
+    g->nnodes = 0;
+    g->nlevels = 0;
+
+    return;
+}
+
+/*
+ *  Mark the model's plan as out of date, creating it if
+ *  needed (the model becomes a DAG one).
+ *
+ *  @param model - Model.
+*/
+void _ct_graph_invalidate(CTensor_Model_s *model)
+{
+    if (model->graph == NULL)
+        model->graph = (struct _ct_graph_s *)calloc(1, sizeof(struct _ct_graph_s));
+
+    if (model->graph != NULL)
+        model->graph->stale = 1;
+
+    return;
+}
+
+void _ct_graph_free(CTensor_Model_s *model)
+{
+    if (model->graph == NULL)
+        return;
+
+    _ct_graph_clear(model->graph);
+    free(model->graph);
+
+    model->graph = NULL;
+
+    return;
+}
+
+static size_t _ct_graph_index(struct _ct_graph_s *g, CTensor_Layer_s *layer, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (g->nodes[i].layer == layer)
+            return i;
+    }
+
+    return CT_GRAPH_NONE;
+}
+
+/*
+ *  Place the intermediate outputs in the arena.
+*/
+static int _ct_graph_place(struct _ct_graph_s *g, CTensor_Model_s *model)
+{
+    size_t i, j, k, off, size = 0;
+    _ct_node_s *a, *b;
+    int moved;
+
+    for (i = 0; i < g->nnodes; i++) {
+        a = &g->nodes[g->order[i]];
+
+        // The output is handed to the caller.
+        if (a->layer == model->lastl)
+            continue;
+
+        off = 0;
+
+        do {
+            moved = 0;
+
+            for (j = 0; j < i; j++) {
+                b = &g->nodes[g->order[j]];
+
+                if (b->slot == CT_GRAPH_NONE || b->last < a->level || a->last < b->level)
+                    continue;
+
+                if (off < b->slot + b->layer->out->size &&
+                            b->slot < off + a->layer->out->size) {
+                    off = b->slot + b->layer->out->size;
+                    moved = 1;
+                }
+            }
+        } while (moved);
+
+        a->slot = off;
+
+        if (off + a->layer->out->size > size)
+            size = off + a->layer->out->size;
+    }
+
+    if (size == 0)
+        return 0;
+
+    g->arena = ctensor_new_tensor(size);
+
+    if (g->arena == NULL) {
+        for (k = 0; k < g->nnodes; k++)
+            g->nodes[k].slot = CT_GRAPH_NONE;
+
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ *  (Re)build the model's plan.
+*/
+static int _ct_graph_plan(CTensor_Model_s *model)
+{
+    CTensor_Layer_s *pos, **inputs;
+    struct _ct_graph_s *g;
+    size_t i, k, n = 0, off;
+    _ct_node_s *node, *p;
+
+    g = model->graph;
+
+    _ct_graph_clear(g);
+
+    for (pos = model->startl->next; pos != NULL; pos = pos->next)
+        n++;
+
+    g->nodes = (_ct_node_s *)calloc(n, sizeof(_ct_node_s));
+    g->order = (size_t *)malloc(n * sizeof(size_t));
+    g->levels = (size_t *)malloc((n + 1) * sizeof(size_t));
+
+    if (g->nodes == NULL || g->order == NULL || g->levels == NULL) {
+        _ct_graph_clear(g);
+        return -1;
+    }
+
+    g->nnodes = n;
+
+    // Nodes in list order, with their producers and levels.
+    for (i = 0, pos = model->startl->next; pos != NULL; i++, pos = pos->next) {
+        node = &g->nodes[i];
+
+        node->layer = pos;
+        node->slot = CT_GRAPH_NONE;
+        node->ninputs = (pos->inputs != NULL) ? pos->ninputs : 1;
+        node->inputs = (size_t *)malloc(node->ninputs * sizeof(size_t));
+
+        if (node->inputs == NULL) {
+            _ct_graph_clear(g);
+            return -1;
+        }
+
+        inputs = (pos->inputs != NULL) ? pos->inputs : &pos->prev;
+
+        for (k = 0; k < node->ninputs; k++) {
+            node->inputs[k] = _ct_graph_index(g, inputs[k], i);
+
+            if (node->inputs[k] == CT_GRAPH_NONE)
+                continue;
+
+            p = &g->nodes[node->inputs[k]];
+
+            if (p->level + 1 > node->level)
+                node->level = p->level + 1;
+
+            p->consumers++;
+        }
+
+        if (node->level == 0)
+            node->level = 1;
+
+        node->last = node->level;
+
+        if (node->level > g->nlevels)
+            g->nlevels = node->level;
+    }
+
+    for (i = 0; i < n; i++) {
+        node = &g->nodes[i];
+
+        for (k = 0; k < node->ninputs; k++) {
+            if (node->inputs[k] != CT_GRAPH_NONE &&
+                        g->nodes[node->inputs[k]].last < node->level)
+                g->nodes[node->inputs[k]].last = node->level;
+        }
+    }
+
+    // Every branch shall lead to the output (the last node),
+    // a dangling one would have no gradient to backpropagate.
+    for (i = 0; i + 1 < n; i++) {
+        if (g->nodes[i].consumers == 0) {
+            _ct_graph_clear(g);
+            return -1;
+        }
+    }
+
+    // Group by level, keeping the list order within each.
+    for (k = 1, off = 0; k <= g->nlevels; k++) {
+        for (i = 0; i < n; i++) {
+            if (g->nodes[i].level == k)
+                g->order[off++] = i;
+        }
+
+        g->levels[k] = off;
+    }
+
+    g->levels[0] = 0;
+
+    // Where each layer's loss gradient comes from.
+    for (i = 0; i < n; i++) {
+        node = &g->nodes[i];
+
+        for (k = 0; k < node->ninputs; k++) {
+            if (node->inputs[k] == CT_GRAPH_NONE)
+                continue;
+
+            p = &g->nodes[node->inputs[k]];
+
+            if (p->consumers == 1 && node->ninputs == 1) {
+                p->layer->loss_grad = node->layer->in_grad;
+                continue;
+            }
+
+            if (p->acc != NULL)
+                continue;
+
+            p->acc = ctensor_new_tensor(p->layer->out->size);
+
+            if (p->acc == NULL) {
+                _ct_graph_clear(g);
+                return -1;
+            }
+
+            p->layer->loss_grad = p->acc;
+        }
+    }
+
+    if (model->lossl != NULL)
+        model->lastl->loss_grad = model->lossl->in_grad;
+
+    // Gradient vector, from the last layer to the first.
+    for (i = n, off = 0; i > 0; i--) {
+        node = &g->nodes[i - 1];
+        node->grad_off = off;
+
+        if (node->layer->internal_grad != NULL)
+            off += node->layer->internal_grad->size;
+    }
+
+    // Without an arena, predictions use the layers' buffers.
+    _ct_graph_place(g, model);
+
+    g->stale = 0;
+
+    return 0;
+}
+
+/*
+ *  Build the model's plan if out of date.
+ *
+ *  @param model - Model.
+ *
+ *  @return - 0 on success, -1 on failure.
+*/
+int _ct_graph_ready(CTensor_Model_s *model)
+{
+    if (model->graph == NULL)
+        return -1;
+
+    if (model->graph->stale)
+        return _ct_graph_plan(model);
+
+    return 0;
+}
+
+static void _ct_graph_fwd_node(void *arg, size_t i)
+{
+    struct _ct_graph_s *g;
+    CTensor_Layer_s *layer;
+
+    g = (struct _ct_graph_s *)arg;
+    layer = g->nodes[g->order[g->lo + i]].layer;
+
+    layer->fwd(layer);
+
+    return;
+}
+
+/*
+ *  Forward pass over a DAG model, its input layer shall
+ *  already point to the input.
+ *
+ *  @param model - Model.
+ *  @param infer - Non-zero if no backward pass follows,
+ *  outputs may then be kept in the arena.
+*/
+void _ct_graph_fwd(CTensor_Model_s *model, int infer)
+{
+    CTensor_Layer_s *pos;
+    struct _ct_graph_s *g;
+    _ct_node_s *node;
+    size_t i, l;
+
+    g = model->graph;
+
+    // Plain list order still works.
+    if (_ct_graph_ready(model) != 0) {
+        for (pos = model->startl->next; pos != NULL; pos = pos->next)
+            pos->fwd(pos);
+
+        return;
+    }
+
+    infer = infer && g->arena != NULL;
+
+    for (i = 0; infer && i < g->nnodes; i++) {
+        node = &g->nodes[i];
+
+        if (node->slot == CT_GRAPH_NONE)
+            continue;
+
+        node->own = node->layer->out->data;
+        node->layer->out->data = &g->arena->data[node->slot];
+    }
+
+    for (l = 1; l <= g->nlevels; l++) {
+        g->lo = g->levels[l - 1];
+
+        if (g->levels[l] - g->lo == 1)
+            _ct_graph_fwd_node(g, 0);
+        else
+            _ct_parallel_for(g->levels[l] - g->lo, _ct_graph_fwd_node, g);
+    }
+
+    for (i = 0; infer && i < g->nnodes; i++) {
+        node = &g->nodes[i];
+
+        if (node->slot != CT_GRAPH_NONE)
+            node->layer->out->data = node->own;
+    }
+
+    return;
+}
+
+static void _ct_graph_bckp_node(void *arg, size_t i)
+{
+    struct _ct_graph_s *g;
+    CTensor_Layer_s *layer;
+    _ct_node_s *node;
+
+    g = (struct _ct_graph_s *)arg;
+    node = &g->nodes[g->order[g->lo + i]];
+    layer = node->layer;
+
+    layer->bckp(layer);
+
+    if (layer->internal_grad != NULL)
+        ctensor_vector_sum(layer->internal_grad->data, layer->internal_grad->size,
+                    &g->grad[node->grad_off], &g->grad[node->grad_off]);
+
+    return;
+}
+
+/*
+ *  Backward pass over a DAG model, after _ct_graph_fwd,
+ *  accumulating each layer's gradient into the flat
+ *  gradient vector.
+ *
+ *  @param model - Model.
+ *  @param grad - Gradient vector.
+*/
+void _ct_graph_bckp(CTensor_Model_s *model, CTensor_s *grad)
+{
+    CTensor_Layer_s *layer;
+    struct _ct_graph_s *g;
+    size_t i, k, l, off;
+    _ct_node_s *node, *p;
+
+    g = model->graph;
+    g->grad = grad->data;
+
+    for (i = 0; i < g->nnodes; i++) {
+        if (g->nodes[i].acc != NULL)
+            ctensor_tensor_zeros(g->nodes[i].acc);
+    }
+
+    for (l = g->nlevels; l > 0; l--) {
+        g->lo = g->levels[l - 1];
+
+        if (g->levels[l] - g->lo == 1)
+            _ct_graph_bckp_node(g, 0);
+        else
+            _ct_parallel_for(g->levels[l] - g->lo, _ct_graph_bckp_node, g);
+
+        // Hand the input gradients to their producers.
+        for (i = g->lo; i < g->levels[l]; i++) {
+            node = &g->nodes[g->order[i]];
+            layer = node->layer;
+
+            for (k = 0, off = 0; k < node->ninputs; k++) {
+                if (node->inputs[k] == CT_GRAPH_NONE) {
+                    off += model->startl->out->size;
+                    continue;
+                }
+
+                p = &g->nodes[node->inputs[k]];
+
+                if (p->acc != NULL)
+                    ctensor_vector_sum(&layer->in_grad->data[off], p->acc->size,
+                                p->acc->data, p->acc->data);
+
+                off += p->layer->out->size;
+            }
+        }
+    }
+
+    return;
+}
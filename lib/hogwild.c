@@ -0,0 +1,310 @@
+/*
+ *  Hogwild! asynchronous training for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctensor/ctensor.h>
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+void _ct_parallel_for(size_t n, void (*fn)(void *, size_t), void *arg);
+
+int _ct_replica_supported(CTensor_Model_s *model);
+int _ct_replica_new(CTensor_Model_s *model, CTensor_Model_s *rep, int share_params);
+void _ct_replica_free(CTensor_Model_s *rep, int share_params);
+
+ctensor_data_t _ct_sched_lr(CTensor_Model_s *model, size_t step, size_t total);
+
+/*
+ *  Each thread trains its own replica of the model, a copy
+ *  of the layer list with its own activations and gradients,
+ *  but sharing the parameters (and layer callbacks) with the
+ *  model itself, replica 0.
+ *
+ *  Replicas grab batches as they go, and add their updates
+ *  straight into the shared parameters with relaxed atomic
+ *  loads and stores, with no locks nor barriers. Concurrent
+ *  updates to the same parameter may be lost, which is fine
+ *  as long as they rarely collide (sparse inputs).
+*/
+
+typedef struct {
+    CTensor_Model_s     model;
+    // Gradients accumulated over the current batch.
+    CTensor_s           *grad;
+    ctensor_data_t      loss;
+} _ct_hogwild_rep_s;
+
+struct _ct_hogwild_s {
+    CTensor_Model_s     *model;
+    _ct_hogwild_rep_s   *replicas;
+    size_t              nreplicas;
+    // Batch source, called under 'lock'.
+    CTensor_Batch_cb    get_nbatch;
+    pthread_mutex_t     lock;
+    // Next batch of the epoch, and next optimization step
+    // (out of 'total', for the learning rate schedule).
+    _Atomic size_t      next;
+    _Atomic size_t      step;
+    size_t              total;
+};
+
+void _ct_hogwild_free(struct _ct_hogwild_s *hw);
+
+/*
+ *  Set up Hogwild! training, with 'model->hogwild' replicas.
+ *
+ *  Layers keeping state of their own in 'internal' (e.g.
+ *  ctensor_fcl_par_init scratch buffers) can't be shared
+ *  between threads, such models train on a single replica.
+ *
+ *  @param model - Model.
+ *  @param grad_size - Size of the flat gradient vector.
+ *
+ *  @return - Hogwild! state, NULL on failure.
+*/
+struct _ct_hogwild_s *_ct_hogwild_new(CTensor_Model_s *model, size_t grad_size)
+{
+    struct _ct_hogwild_s *hw;
+    size_t n, r;
+
+    n = _ct_replica_supported(model) ? model->hogwild : 1;
+
+    hw = (struct _ct_hogwild_s *)calloc(1, sizeof(struct _ct_hogwild_s));
+
+    if (hw == NULL)
+        return NULL;
+
+    hw->replicas = (_ct_hogwild_rep_s *)calloc(n, sizeof(_ct_hogwild_rep_s));
+
+    if (hw->replicas == NULL) {
+        free(hw);
+        return NULL;
+    }
+
+    hw->model = model;
+    hw->nreplicas = n;
+
+    pthread_mutex_init(&hw->lock, NULL);
+
+    for (r = 0; r < n; r++) {
+        hw->replicas[r].grad = ctensor_new_tensor(grad_size);
+
+        if (hw->replicas[r].grad == NULL) {
+            _ct_hogwild_free(hw);
+            return NULL;
+        }
+
+        ctensor_tensor_zeros(hw->replicas[r].grad);
+
+        // The model itself is the first replica.
+        if (r == 0) {
+            hw->replicas[r].model = *model;
+            continue;
+        }
+
+        if (_ct_replica_new(model, &hw->replicas[r].model, 1) != 0) {
+            _ct_hogwild_free(hw);
+            return NULL;
+        }
+    }
+
+    return hw;
+}
+
+void _ct_hogwild_free(struct _ct_hogwild_s *hw)
+{
+    size_t r;
+
+    for (r = 0; r < hw->nreplicas; r++) {
+        if (hw->replicas[r].grad != NULL)
+            ctensor_destroy_tensor(hw->replicas[r].grad);
+
+        if (r != 0)
+            _ct_replica_free(&hw->replicas[r].model, 1);
+    }
+
+    pthread_mutex_destroy(&hw->lock);
+
+    free(hw->replicas);
+    free(hw);
+
+    return;
+}
+
+/*
+ *  Forward and backward pass over a batch, accumulating
+ *  the replica's gradients (in the same layout as the
+ *  model's gradient vector).
+ *
+ *  @return - Average loss over the batch.
+*/
+static ctensor_data_t _ct_hogwild_batch(_ct_hogwild_rep_s *rep, CTensor_s *x_train,
+                    CTensor_s *y_train, size_t batch_size)
+{
+    ctensor_data_t batch_loss = 0.00;
+    ctensor_data_t *grad;
+    CTensor_Layer_s *pos;
+    CTensor_s x, y;
+    size_t i;
+
+    x.size = rep->model.startl->out->size;
+    y.size = rep->model.lastl->out->size;
+
+    for (i = 0; i < batch_size; i++) {
+        x.data = &x_train->data[i * x.size];
+        y.data = &y_train->data[i * y.size];
+
+        batch_loss += ctensor_test(&rep->model, &x, &y);
+
+        rep->model.lossl->bckp(rep->model.lossl, &y);
+
+        grad = rep->grad->data;
+
+        for (pos = rep->model.lastl; pos != NULL && pos->bckp != NULL; pos = pos->prev) {
+            pos->bckp(pos);
+
+            if (pos->internal_grad == NULL)
+                continue;
+
+            ctensor_vector_sum(pos->internal_grad->data, pos->internal_grad->size,
+                        grad, grad);
+
+            grad += pos->internal_grad->size;
+        }
+    }
+
+    return batch_loss / (ctensor_data_t)batch_size;
+}
+
+/*
+ *  Add the replica's SGD step into the shared parameters,
+ *  skipping the (many, for sparse inputs) untouched ones.
+ *  Other replicas may be reading or writing them meanwhile,
+ *  relaxed atomics are enough: each store is of a whole
+ *  value, with no ordering needed among them.
+*/
+static void _ct_hogwild_apply(_ct_hogwild_rep_s *rep, ctensor_data_t scale)
+{
+    _Atomic ctensor_data_t *params;
+    ctensor_data_t *grad, p;
+    CTensor_Layer_s *pos;
+    size_t i, size;
+
+    grad = rep->grad->data;
+
+    for (pos = rep->model.lastl; pos != NULL; pos = pos->prev) {
+        if (pos->internal_grad == NULL)
+            continue;
+
+        params = (_Atomic ctensor_data_t *)pos->internal_params->data;
+        size = pos->internal_params->size;
+
+        for (i = 0; i < size; i++) {
+            if (grad[i] == 0.00)
+                continue;
+
+            p = atomic_load_explicit(&params[i], memory_order_relaxed);
+            atomic_store_explicit(&params[i], p + scale * grad[i], memory_order_relaxed);
+
+            grad[i] = 0.00;
+        }
+
+        grad += size;
+    }
+
+    return;
+}
+
+static void _ct_hogwild_run(void *arg, size_t r)
+{
+    struct _ct_hogwild_s *hw;
+    CTensor_s *x_train, *y_train;
+    CTensor_Model_s *model;
+    ctensor_data_t lr;
+    _ct_hogwild_rep_s *rep;
+    CTensor_s x, y;
+    size_t batch, step;
+
+    hw = (struct _ct_hogwild_s *)arg;
+    model = hw->model;
+    rep = &hw->replicas[r];
+
+    for (;;) {
+        batch = atomic_fetch_add_explicit(&hw->next, 1, memory_order_relaxed);
+
+        if (batch >= model->batches)
+            break;
+
+        // Batch callbacks needn't be thread-safe, but the
+        // tensors they return shall stay valid for the
+        // whole epoch (e.g. views into the dataset).
+        pthread_mutex_lock(&hw->lock);
+
+        hw->get_nbatch(&x_train, &y_train, batch);
+
+        x = *x_train;
+        y = *y_train;
+
+        pthread_mutex_unlock(&hw->lock);
+
+        rep->loss += _ct_hogwild_batch(rep, &x, &y, model->batch_size);
+
+        step = atomic_fetch_add(&hw->step, 1);
+        lr = _ct_sched_lr(model, step, hw->total);
+
+        _ct_hogwild_apply(rep, -lr / (ctensor_data_t)model->batch_size);
+    }
+
+    return;
+}
+
+/*
+ *  Train one epoch, Hogwild! style.
+ *
+ *  @param hw - Hogwild! state.
+ *  @param get_nbatch - Batch callback.
+ *  @param step - Optimization steps done so far (updated).
+ *  @param total - Optimization steps of the whole run.
+ *
+ *  @return - Sum of the batches' average losses.
+*/
+ctensor_data_t _ct_hogwild_epoch(struct _ct_hogwild_s *hw, CTensor_Batch_cb get_nbatch,
+                    size_t *step, size_t total)
+{
+    ctensor_data_t loss = 0.00;
+    size_t r;
+
+    hw->get_nbatch = get_nbatch;
+
+    atomic_store(&hw->next, 0);
+    atomic_store(&hw->step, *step);
+    hw->total = total;
+
+    for (r = 0; r < hw->nreplicas; r++)
+        hw->replicas[r].loss = 0.00;
+
+    _ct_parallel_for(hw->nreplicas, _ct_hogwild_run, hw);
+
+    for (r = 0; r < hw->nreplicas; r++)
+        loss += hw->replicas[r].loss;
+
+    *step = atomic_load(&hw->step);
+
+    return loss;
+}
@@ -0,0 +1,78 @@
+/*
+ *  LAMB Layer-wise Adaptive Optimization for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctensor/ctensor.h>
+#include <math.h>
+
+/*
+ *  LAMB (Layer-wise Adaptive Moments for Batch training)
+ *  Optimization Algorithm, for a single layer.
+ *
+ *  @param grad - evaluated gradient vector of the layer.
+ *  @param params - the layer's parameters (NULL disables
+ *  weight decay and the trust ratio).
+ *  @param grad_size - number of elements in gradient vector.
+ *  @param m - first moment vector.
+ *  @param v - second moment vector.
+ *  @param b1 - first bias correction.
+ *  @param b2 - second bias correction.
+ *  @param wd - weight decay.
+ *  @param lr - learning rate.
+ *  @param t - Number of gradient update.
+*/
+void _ct_lamb(float *grad, float *params, size_t grad_size, float *m, float *v,
+            float b1, float b2, float wd, float lr, int t)
+{
+    float c1, c2, mb, vb, u, w_norm = 0.00, u_norm = 0.00, ratio;
+    size_t i;
+
+    c1 = 1 / (1 - powf(b1, t));
+    c2 = 1 / (1 - powf(b2, t));
+
+    // First pass, Adam's update direction (stored in grad)
+    // and both norms.
+    for (i = 0; i < grad_size; i++) {
+        m[i] = b1 * m[i] + (1 - b1) * grad[i];
+        v[i] = b2 * v[i] + (1 - b2) * (grad[i] * grad[i]);
+
+        mb = m[i] * c1;
+        vb = v[i] * c2;
+
+        u = mb / (sqrtf(vb) + 1e-6);
+
+        if (params != NULL) {
+            u += wd * params[i];
+            w_norm += params[i] * params[i];
+        }
+
+        u_norm += u * u;
+        grad[i] = u;
+    }
+
+    w_norm = sqrtf(w_norm);
+    u_norm = sqrtf(u_norm);
+
+    // Layers whose weights (or updates) are all zeros
+    // fall back to plain Adam.
+    ratio = (w_norm > 0 && u_norm > 0) ? w_norm / u_norm : 1.00;
+
+    // Second pass, scale by the trust ratio.
+    for (i = 0; i < grad_size; i++)
+        grad[i] *= -lr * ratio;
+
+    return;
+}
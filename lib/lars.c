@@ -0,0 +1,67 @@
+/*
+ *  LARS Layer-wise Adaptive Optimization for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctensor/ctensor.h>
+#include <math.h>
+
+/*
+ *  LARS (Layer-wise Adaptive Rate Scaling) Optimization
+ *  Algorithm, for a single layer.
+ *
+ *  @param grad - evaluated gradient vector of the layer.
+ *  @param params - the layer's parameters (NULL disables
+ *  weight decay and the trust ratio).
+ *  @param grad_size - number of elements in gradient vector.
+ *  @param v - momentum vector.
+ *  @param mu - momentum.
+ *  @param eta - trust coefficient.
+ *  @param wd - weight decay.
+ *  @param lr - learning rate.
+*/
+void _ct_lars(float *grad, float *params, size_t grad_size, float *v,
+            float mu, float eta, float wd, float lr)
+{
+    float w_norm = 0.00, g_norm = 0.00, local_lr, g;
+    size_t i;
+
+    if (params != NULL) {
+        for (i = 0; i < grad_size; i++) {
+            w_norm += params[i] * params[i];
+            g_norm += grad[i] * grad[i];
+        }
+    }
+
+    w_norm = sqrtf(w_norm);
+    g_norm = sqrtf(g_norm);
+
+    local_lr = lr;
+
+    if (w_norm > 0 && g_norm > 0)
+        local_lr *= eta * w_norm / (g_norm + wd * w_norm);
+
+    for (i = 0; i < grad_size; i++) {
+        g = grad[i];
+
+        if (params != NULL)
+            g += wd * params[i];
+
+        v[i] = mu * v[i] + local_lr * g;
+        grad[i] = -v[i];
+    }
+
+    return;
+}
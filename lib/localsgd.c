@@ -0,0 +1,365 @@
+/*
+ *  Local SGD (periodic model averaging) for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctensor/ctensor.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct _ct_bucket_s;
+
+void _ct_parallel_for(size_t n, void (*fn)(void *, size_t), void *arg);
+
+int _ct_replica_supported(CTensor_Model_s *model);
+int _ct_replica_new(CTensor_Model_s *model, CTensor_Model_s *rep, int share_params);
+void _ct_replica_free(CTensor_Model_s *rep, int share_params);
+
+void _ct_set_segments(CTensor_Model_s *model, size_t lo, size_t hi);
+ctensor_data_t _ct_train_batch(CTensor_Model_s *model,
+                    CTensor_s *x_train, CTensor_s *y_train, CTensor_s *avg_grad,
+                    struct _ct_bucket_s *bk);
+void _ct_train_step(CTensor_Model_s *model, CTensor_s *avg_grad,
+                    CTensor_s *shard, size_t samples, ctensor_data_t learning_rate,
+                    struct _ct_bucket_s *bk);
+ctensor_data_t _ct_sched_lr(CTensor_Model_s *model, size_t step, size_t total);
+
+/*
+ *  Each thread trains a replica of the model, with its own
+ *  parameters and optimizer state, for 'local_steps' steps
+ *  (a round) on its own batches. Replicas are then averaged,
+ *  or pulled towards a center variable when elastic, and the
+ *  next round starts.
+ *
+ *  Round batches are dealt out strided, replica r gets the
+ *  round's r-th, (r + R)-th, ... batches, so that all
+ *  replicas do the same number of steps (but the last
+ *  round's, of each epoch).
+ *
+ *  Replicas are synchronized at the end of every epoch, the
+ *  model (replica 0) then holds the average (or the center).
+*/
+
+typedef struct {
+    CTensor_Model_s     model;
+    CTensor_s           *grad;
+    ctensor_data_t      loss;
+} _ct_local_rep_s;
+
+struct _ct_local_s {
+    CTensor_Model_s     *model;
+    _ct_local_rep_s     *replicas;
+    size_t              nreplicas;
+    // Parameters of every replica, 'nparams' per replica.
+    CTensor_s           **params;
+    size_t              nparams;
+    // Elastic averaging, center variable (flat).
+    ctensor_data_t      elastic;
+    CTensor_s           *center;
+    // Steps per round.
+    size_t              steps;
+    // Current round.
+    CTensor_Batch_cb    get_nbatch;
+    pthread_mutex_t     lock;
+    size_t              base;
+    size_t              step;
+    // Optimization steps of the whole run.
+    size_t              total;
+    int                 hard;
+};
+
+void _ct_local_free(struct _ct_local_s *ls);
+
+/*
+ *  Set up local SGD, with 'model->local_sgd' replicas.
+ *  Models that can't be replicated train on a single one.
+ *
+ *  @param model - Model.
+ *  @param grad_size - Size of the flat gradient vector.
+ *  @param replicas - Set to the number of replicas.
+ *
+ *  @return - Local SGD state, NULL on failure.
+*/
+struct _ct_local_s *_ct_local_new(CTensor_Model_s *model, size_t grad_size,
+                    size_t *replicas)
+{
+    struct _ct_local_s *ls;
+    CTensor_Layer_s *pos;
+    size_t n, r, j, off;
+
+    n = _ct_replica_supported(model) ? model->local_sgd : 1;
+
+    ls = (struct _ct_local_s *)calloc(1, sizeof(struct _ct_local_s));
+
+    if (ls == NULL)
+        return NULL;
+
+    ls->model = model;
+    ls->nreplicas = n;
+    ls->elastic = model->elastic;
+    ls->steps = (model->local_steps == 0) ? 1 : model->local_steps;
+
+    pthread_mutex_init(&ls->lock, NULL);
+
+    ls->replicas = (_ct_local_rep_s *)calloc(n, sizeof(_ct_local_rep_s));
+
+    for (pos = model->startl; pos != NULL; pos = pos->next) {
+        if (pos->internal_params != NULL)
+            ls->nparams++;
+    }
+
+    ls->params = (CTensor_s **)calloc(n * ls->nparams + 1, sizeof(CTensor_s *));
+
+    if (ls->replicas == NULL || ls->params == NULL) {
+        _ct_local_free(ls);
+        return NULL;
+    }
+
+    for (r = 0; r < n; r++) {
+        ls->replicas[r].grad = ctensor_new_tensor(grad_size);
+
+        if (ls->replicas[r].grad == NULL) {
+            _ct_local_free(ls);
+            return NULL;
+        }
+
+        ctensor_tensor_zeros(ls->replicas[r].grad);
+
+        // The model itself is the first replica, on its own.
+        if (r == 0) {
+            ls->replicas[r].model = *model;
+            ls->replicas[r].model.comm = NULL;
+        } else if (_ct_replica_new(model, &ls->replicas[r].model, 0) != 0) {
+            _ct_local_free(ls);
+            return NULL;
+        } else if (ls->replicas[r].model.optimizer != NULL) {
+            _ct_set_segments(&ls->replicas[r].model, 0, grad_size);
+        }
+
+        j = 0;
+
+        for (pos = ls->replicas[r].model.startl; pos != NULL; pos = pos->next) {
+            if (pos->internal_params != NULL)
+                ls->params[r * ls->nparams + j++] = pos->internal_params;
+        }
+    }
+
+    if (ls->elastic != 0.00) {
+        ls->center = ctensor_new_tensor(grad_size);
+
+        if (ls->center == NULL) {
+            _ct_local_free(ls);
+            return NULL;
+        }
+
+        for (j = 0, off = 0; j < ls->nparams; j++) {
+            memcpy(&ls->center->data[off], ls->params[j]->data,
+                        ls->params[j]->size * sizeof(ctensor_data_t));
+
+            off += ls->params[j]->size;
+        }
+    }
+
+    *replicas = n;
+
+    return ls;
+}
+
+void _ct_local_free(struct _ct_local_s *ls)
+{
+    size_t r;
+
+    for (r = 0; ls->replicas != NULL && r < ls->nreplicas; r++) {
+        if (ls->replicas[r].grad != NULL)
+            ctensor_destroy_tensor(ls->replicas[r].grad);
+
+        if (r != 0)
+            _ct_replica_free(&ls->replicas[r].model, 0);
+    }
+
+    if (ls->center != NULL)
+        ctensor_destroy_tensor(ls->center);
+
+    pthread_mutex_destroy(&ls->lock);
+
+    free(ls->params);
+    free(ls->replicas);
+    free(ls);
+
+    return;
+}
+
+/*
+ *  Replica r's part of a round.
+*/
+static void _ct_local_run(void *arg, size_t r)
+{
+    CTensor_s *x_train, *y_train;
+    struct _ct_local_s *ls;
+    CTensor_Model_s *model;
+    _ct_local_rep_s *rep;
+    ctensor_data_t lr;
+    CTensor_s x, y;
+    size_t k, batch;
+
+    ls = (struct _ct_local_s *)arg;
+    model = ls->model;
+    rep = &ls->replicas[r];
+
+    for (k = 0; k < ls->steps; k++) {
+        batch = ls->base + k * ls->nreplicas + r;
+
+        if (batch >= model->batches)
+            break;
+
+        // Batch callbacks needn't be thread-safe.
+        pthread_mutex_lock(&ls->lock);
+
+        ls->get_nbatch(&x_train, &y_train, batch);
+
+        x = *x_train;
+        y = *y_train;
+
+        pthread_mutex_unlock(&ls->lock);
+
+        rep->loss += _ct_train_batch(&rep->model, &x, &y, rep->grad, NULL);
+
+        lr = _ct_sched_lr(model, ls->step + k, ls->total);
+
+        _ct_train_step(&rep->model, rep->grad, rep->grad, model->batch_size, lr, NULL);
+    }
+
+    return;
+}
+
+/*
+ *  Average the t-th (out of nreplicas) part of every
+ *  parameter tensor across replicas.
+ *
+ *  Elastic averaging moves each replica towards the center
+ *  by 'elastic' times their difference, and the center
+ *  towards the replicas by the sum of those; a hard sync
+ *  then sets every replica to the center.
+*/
+static void _ct_local_average(void *arg, size_t t)
+{
+    ctensor_data_t sum, c, d, alpha, inv;
+    size_t R, j, r, i, lo, hi, off = 0;
+    struct _ct_local_s *ls;
+    CTensor_s **params;
+
+    ls = (struct _ct_local_s *)arg;
+
+    R = ls->nreplicas;
+    alpha = ls->elastic;
+    inv = 1.00 / (ctensor_data_t)R;
+
+    for (j = 0; j < ls->nparams; j++) {
+        params = &ls->params[j];
+
+        lo = params[0]->size * t / R;
+        hi = params[0]->size * (t + 1) / R;
+
+        for (i = lo; i < hi; i++) {
+            if (ls->center == NULL) {
+                sum = 0.00;
+
+                for (r = 0; r < R; r++)
+                    sum += params[r * ls->nparams]->data[i];
+
+                for (r = 0; r < R; r++)
+                    params[r * ls->nparams]->data[i] = sum * inv;
+
+                continue;
+            }
+
+            c = ls->center->data[off + i];
+            sum = 0.00;
+
+            for (r = 0; r < R; r++) {
+                d = params[r * ls->nparams]->data[i] - c;
+                sum += d;
+
+                params[r * ls->nparams]->data[i] -= alpha * d;
+            }
+
+            c += alpha * sum;
+            ls->center->data[off + i] = c;
+
+            if (!ls->hard)
+                continue;
+
+            for (r = 0; r < R; r++)
+                params[r * ls->nparams]->data[i] = c;
+        }
+
+        off += params[0]->size;
+    }
+
+    return;
+}
+
+/*
+ *  Train one epoch with local SGD.
+ *
+ *  @param ls - Local SGD state.
+ *  @param get_nbatch - Batch callback.
+ *  @param step - Optimization steps done so far (updated).
+ *  @param total - Optimization steps of the whole run.
+ *
+ *  @return - Sum of the batches' average losses.
+*/
+ctensor_data_t _ct_local_epoch(struct _ct_local_s *ls, CTensor_Batch_cb get_nbatch,
+                    size_t *step, size_t total)
+{
+    ctensor_data_t loss = 0.00;
+    size_t r, round, batches;
+    CTensor_Model_s *model;
+
+    model = ls->model;
+    batches = model->batches;
+
+    // Batches of a full round.
+    round = ls->steps * ls->nreplicas;
+
+    ls->get_nbatch = get_nbatch;
+    ls->step = *step;
+    ls->total = total;
+
+    for (r = 0; r < ls->nreplicas; r++)
+        ls->replicas[r].loss = 0.00;
+
+    for (ls->base = 0; ls->base < batches; ls->base += round) {
+        _ct_parallel_for(ls->nreplicas, _ct_local_run, ls);
+
+        // Replica 0 does the most steps.
+        ls->step += (((batches - ls->base < round) ? batches - ls->base : round) +
+                        ls->nreplicas - 1) / ls->nreplicas;
+
+        ls->hard = (ls->base + round >= batches);
+
+        if (ls->nreplicas > 1)
+            _ct_parallel_for(ls->nreplicas, _ct_local_average, ls);
+    }
+
+    for (r = 0; r < ls->nreplicas; r++)
+        loss += ls->replicas[r].loss;
+
+    *step = ls->step;
+
+    return loss;
+}
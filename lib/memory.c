@@ -0,0 +1,488 @@
+/*
+ *  Tensor memory allocation for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <ctensor/ctensor.h>
+
+#include <sys/mman.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+
+// How tensor data was allocated.
+#define CT_MEM_MALLOC   0
+#define CT_MEM_THP      1
+#define CT_MEM_HUGETLB  2
+#define CT_MEM_KINDS    3
+
+// Default size from which tensors get huge pages.
+#define CT_MEM_MIN_BYTES    (4 << 20)
+
+// Buckets of the data blocks table (a power of 2).
+#define CT_MEM_BUCKETS      1024
+
+/*
+ *  Tensors keep their plain layout (a malloc'd CTensor_s
+ *  and its data), so that tensors built by hand can still
+ *  be destroyed. How the data of ctensor_new_tensor's
+ *  tensors was allocated is kept on the side, by data
+ *  address; data we don't know of came from malloc.
+*/
+typedef struct _ct_mem_block_s {
+    void                    *data;
+    int                     kind;
+    size_t                  map_size;
+    struct _ct_mem_block_s  *next;
+} _ct_mem_block_s;
+
+static _ct_mem_block_s *_ct_mem_blocks[CT_MEM_BUCKETS];
+static pthread_mutex_t _ct_mem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+    int             policy;
+    size_t          min_bytes;
+    size_t          base_page;
+    size_t          huge_page;
+    // Live tensors and bytes, of each kind.
+    _Atomic size_t  count[CT_MEM_KINDS];
+    _Atomic size_t  bytes[CT_MEM_KINDS];
+} _ct_mem;
+
+static pthread_once_t _ct_mem_once = PTHREAD_ONCE_INIT;
+
+static const char *_ct_mem_names[CT_MEM_KINDS] = {
+    "malloc", "thp", "hugetlb"
+};
+
+static void _ct_mem_init(void)
+{
+    unsigned long kb;
+    const char *env;
+    char line[128];
+    FILE *f;
+
+    _ct_mem.base_page = (size_t)sysconf(_SC_PAGESIZE);
+    _ct_mem.huge_page = 2 << 20;
+    _ct_mem.min_bytes = CT_MEM_MIN_BYTES;
+    _ct_mem.policy = CT_HUGE_PAGES_NONE;
+
+    f = fopen("/proc/meminfo", "r");
+
+    if (f != NULL) {
+        while (fgets(line, sizeof(line), f) != NULL) {
+            if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+                _ct_mem.huge_page = (size_t)kb << 10;
+                break;
+            }
+        }
+
+        fclose(f);
+    }
+
+    env = getenv("CTENSOR_HUGE_PAGES");
+
+    if (env != NULL && strcmp(env, "thp") == 0)
+        _ct_mem.policy = CT_HUGE_PAGES_THP;
+    else if (env != NULL && strcmp(env, "hugetlb") == 0)
+        _ct_mem.policy = CT_HUGE_PAGES_HUGETLB;
+
+    return;
+}
+
+/*
+ *  Set the huge page policy for tensors allocated
+ *  from now on.
+ *
+ *  @param policy - CT_HUGE_PAGES_NONE, CT_HUGE_PAGES_THP or
+ *  CT_HUGE_PAGES_HUGETLB.
+ *  @param min_bytes - Smallest tensor to back with huge
+ *  pages, 0 for the default.
+*/
+void ctensor_set_huge_pages(int policy, size_t min_bytes)
+{
+    pthread_once(&_ct_mem_once, _ct_mem_init);
+
+    _ct_mem.policy = policy;
+    _ct_mem.min_bytes = (min_bytes == 0) ? CT_MEM_MIN_BYTES : min_bytes;
+
+    return;
+}
+
+/*
+ *  Explicit huge pages, from the pool reserved with
+ *  vm.nr_hugepages. Reserved at map time, so running out
+ *  fails here instead of faulting later.
+*/
+static void *_ct_mem_hugetlb(size_t bytes, size_t *map_size)
+{
+    void *p;
+
+    *map_size = (bytes + _ct_mem.huge_page - 1) & ~(_ct_mem.huge_page - 1);
+
+    p = mmap(NULL, *map_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    return (p == MAP_FAILED) ? NULL : p;
+}
+
+/*
+ *  Transparent huge pages, on a huge page aligned mapping
+ *  so that the kernel can back all of it.
+*/
+static void *_ct_mem_thp(size_t bytes, size_t *map_size)
+{
+    uintptr_t start, aligned;
+    size_t size, huge;
+    char *p;
+
+    huge = _ct_mem.huge_page;
+    size = (bytes + huge - 1) & ~(huge - 1);
+
+    p = mmap(NULL, size + huge, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (p == MAP_FAILED)
+        return NULL;
+
+    // Trim the excess, leaving an aligned mapping.
+    start = (uintptr_t)p;
+    aligned = (start + huge - 1) & ~(uintptr_t)(huge - 1);
+
+    if (aligned != start)
+        munmap(p, aligned - start);
+
+    if (aligned + size != start + size + huge)
+        munmap((void *)(aligned + size), start + huge - aligned);
+
+    if (madvise((void *)aligned, size, MADV_HUGEPAGE) != 0) {
+        munmap((void *)aligned, size);
+        return NULL;
+    }
+
+    *map_size = size;
+
+    return (void *)aligned;
+}
+
+/*
+ *  Allocate a tensor's data following the huge page
+ *  policy, falling back to the next option down (hugetlb,
+ *  thp, malloc) whenever one isn't available.
+*/
+static void *_ct_mem_alloc(size_t bytes, int *kind, size_t *map_size)
+{
+    void *p = NULL;
+
+    pthread_once(&_ct_mem_once, _ct_mem_init);
+
+    *kind = CT_MEM_MALLOC;
+    *map_size = 0;
+
+    if (bytes >= _ct_mem.min_bytes && _ct_mem.policy == CT_HUGE_PAGES_HUGETLB) {
+        p = _ct_mem_hugetlb(bytes, map_size);
+        *kind = CT_MEM_HUGETLB;
+    }
+
+    if (p == NULL && bytes >= _ct_mem.min_bytes && _ct_mem.policy != CT_HUGE_PAGES_NONE) {
+        p = _ct_mem_thp(bytes, map_size);
+        *kind = CT_MEM_THP;
+    }
+
+    if (p == NULL) {
+        p = malloc(bytes);
+        *kind = CT_MEM_MALLOC;
+        *map_size = bytes;
+    }
+
+    if (p != NULL) {
+        atomic_fetch_add(&_ct_mem.count[*kind], 1);
+        atomic_fetch_add(&_ct_mem.bytes[*kind], *map_size);
+    }
+
+    return p;
+}
+
+static void _ct_mem_free(void *p, int kind, size_t map_size)
+{
+    if (kind == CT_MEM_MALLOC)
+        free(p);
+    else
+        munmap(p, map_size);
+
+    atomic_fetch_sub(&_ct_mem.count[kind], 1);
+    atomic_fetch_sub(&_ct_mem.bytes[kind], map_size);
+
+    return;
+}
+
+static inline size_t _ct_mem_bucket(const void *data)
+{
+    return (size_t)(((uint64_t)(uintptr_t)data * 0x9e3779b97f4a7c15ULL) >> 32) &
+                (CT_MEM_BUCKETS - 1);
+}
+
+/*
+ *  Remember how 'data' was allocated.
+ *
+ *  @return - 0 on success, -1 on failure.
+*/
+static int _ct_mem_track(void *data, int kind, size_t map_size)
+{
+    _ct_mem_block_s *b;
+    size_t k;
+
+    b = (_ct_mem_block_s *)malloc(sizeof(_ct_mem_block_s));
+
+    if (b == NULL)
+        return -1;
+
+    b->data = data;
+    b->kind = kind;
+    b->map_size = map_size;
+
+    k = _ct_mem_bucket(data);
+
+    pthread_mutex_lock(&_ct_mem_lock);
+    b->next = _ct_mem_blocks[k];
+    _ct_mem_blocks[k] = b;
+    pthread_mutex_unlock(&_ct_mem_lock);
+
+    return 0;
+}
+
+/*
+ *  How 'data' was allocated, forgetting it if 'untrack'.
+ *
+ *  @return - 1 if known, 0 otherwise (plain malloc).
+*/
+static int _ct_mem_lookup(const void *data, int untrack, int *kind, size_t *map_size)
+{
+    _ct_mem_block_s **pos, *b;
+
+    pthread_mutex_lock(&_ct_mem_lock);
+
+    for (pos = &_ct_mem_blocks[_ct_mem_bucket(data)]; *pos != NULL; pos = &(*pos)->next) {
+        if ((*pos)->data == data)
+            break;
+    }
+
+    b = *pos;
+
+    if (b != NULL && untrack)
+        *pos = b->next;
+
+    pthread_mutex_unlock(&_ct_mem_lock);
+
+    *kind = CT_MEM_MALLOC;
+    *map_size = 0;
+
+    if (b == NULL)
+        return 0;
+
+    *kind = b->kind;
+    *map_size = b->map_size;
+
+    if (untrack)
+        free(b);
+
+    return 1;
+}
+
+/*
+ *  Allocate a new tensor.
+ *
+ *  @param size - Size of the new tensor.
+ *
+ *  @return - New allocated tensor pointer.
+*/
+CTensor_s *ctensor_new_tensor(size_t size)
+{
+    CTensor_s *tensor;
+    size_t map_size;
+    int kind;
+
+    tensor = (CTensor_s *)malloc(sizeof(CTensor_s));
+
+    // Something went wrong with allocating a new
+    // tensor; we'll return NULL to indicate an issue.
+    if (tensor == NULL)
+        return NULL;
+
+    // As of now, treat all tensors as 1-D Tensors.
+    tensor->size = size;
+    tensor->data = (ctensor_data_t *)_ct_mem_alloc(size * sizeof(ctensor_data_t),
+                                &kind, &map_size);
+
+    // Something went wrong with allocating data,
+    // we'll free our tensor struct, and return
+    // NULL to indicate an issue.
+    if (tensor->data == NULL) {
+        free(tensor);
+        return NULL;
+    }
+
+    if (_ct_mem_track(tensor->data, kind, map_size) != 0) {
+        _ct_mem_free(tensor->data, kind, map_size);
+        free(tensor);
+        return NULL;
+    }
+
+    return tensor;
+}
+
+/*
+ *  De-allocate tensor.
+ *
+ *  @param tensor - Pointer to the tensor struct
+ *  to be de-allocated.
+*/
+void ctensor_destroy_tensor(CTensor_s *tensor)
+{
+    size_t map_size;
+    int kind;
+
+    if (_ct_mem_lookup(tensor->data, 1, &kind, &map_size))
+        _ct_mem_free(tensor->data, kind, map_size);
+    else
+        free(tensor->data);
+
+    free(tensor);
+
+    return;
+}
+
+/*
+ *  Whether any of the mapping holding 'addr' is backed by
+ *  transparent huge pages, from /proc/self/smaps.
+*/
+static int _ct_mem_thp_backed(const void *addr)
+{
+    unsigned long lo, hi, kb;
+    int found = 0, ret = 0;
+    char line[256];
+    FILE *f;
+
+    f = fopen("/proc/self/smaps", "r");
+
+    if (f == NULL)
+        return 0;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        // Mapping headers start with "lo-hi ".
+        if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+            if (found)
+                break;
+
+            found = ((uintptr_t)addr >= lo && (uintptr_t)addr < hi);
+            continue;
+        }
+
+        if (found && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) {
+            ret = (kb != 0);
+            break;
+        }
+    }
+
+    fclose(f);
+
+    return ret;
+}
+
+/*
+ *  Page size backing a tensor. Transparent huge pages are
+ *  only given by the kernel once memory is touched (and if
+ *  available), so this reports what was actually realized.
+ *
+ *  @param tensor - Tensor.
+ *
+ *  @return - Page size, in bytes.
+*/
+size_t ctensor_tensor_page_size(const CTensor_s *tensor)
+{
+    size_t map_size;
+    int kind;
+
+    pthread_once(&_ct_mem_once, _ct_mem_init);
+
+    _ct_mem_lookup(tensor->data, 0, &kind, &map_size);
+
+    if (kind == CT_MEM_HUGETLB)
+        return _ct_mem.huge_page;
+
+    if (kind == CT_MEM_THP && _ct_mem_thp_backed(tensor->data))
+        return _ct_mem.huge_page;
+
+    return _ct_mem.base_page;
+}
+
+static void _ct_mem_report_tensor(FILE *stream, size_t index, const char *name,
+                    const CTensor_s *tensor)
+{
+    size_t map_size;
+    int kind;
+
+    _ct_mem_lookup(tensor->data, 0, &kind, &map_size);
+
+    fprintf(stream, "%-6zu %-8s %12zu %14zu %-8s %8zuK\n", index, name,
+            tensor->size, tensor->size * sizeof(ctensor_data_t),
+            _ct_mem_names[kind], ctensor_tensor_page_size(tensor) >> 10);
+
+    return;
+}
+
+/*
+ *  Print the model's parameter and gradient tensors, with
+ *  their backing and realized page size, followed by the
+ *  live tensor totals of the whole process.
+ *
+ *  @param model - Model (NULL for the totals only).
+ *  @param stream - Where to print.
+*/
+void ctensor_memory_report(CTensor_Model_s *model, FILE *stream)
+{
+    CTensor_Layer_s *pos;
+    size_t i = 0;
+    int k;
+
+    pthread_once(&_ct_mem_once, _ct_mem_init);
+
+    if (model != NULL) {
+        fprintf(stream, "%-6s %-8s %12s %14s %-8s %9s\n", "layer", "tensor",
+                "elements", "bytes", "backing", "page");
+
+        for (pos = model->startl->next; pos != NULL; pos = pos->next) {
+            i++;
+
+            if (pos->internal_params != NULL)
+                _ct_mem_report_tensor(stream, i, "params", pos->internal_params);
+
+            if (pos->internal_grad != NULL)
+                _ct_mem_report_tensor(stream, i, "grad", pos->internal_grad);
+        }
+    }
+
+    for (k = 0; k < CT_MEM_KINDS; k++) {
+        fprintf(stream, "%-8s %8zu tensors %14zu bytes\n", _ct_mem_names[k],
+                atomic_load(&_ct_mem.count[k]), atomic_load(&_ct_mem.bytes[k]));
+    }
+
+    return;
+}
@@ -0,0 +1,153 @@
+/*
+ *  Merge layers for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctensor/ctensor.h>
+
+#include <string.h>
+
+static void ctensor_merge_add_fwd(CTensor_Layer_s *layer);
+static void ctensor_merge_add_bckp(CTensor_Layer_s *layer);
+static void ctensor_merge_concat_fwd(CTensor_Layer_s *layer);
+static void ctensor_merge_concat_bckp(CTensor_Layer_s *layer);
+
+/*
+ *  Add merge initial layer function.
+ *  Fills all the layer information for the
+ *  Model Abstraction API. As defined in
+ *  the documentation.
+ *
+ *  @param layer - Pointer of the current
+ *  layer "object" to be filled.
+*/
+void ctensor_merge_add(CTensor_Layer_s *layer)
+{
+    // Merges aren't trainable.
+    layer->fwd = (CTensor_Layer_cb)ctensor_merge_add_fwd;
+    layer->bckp = (CTensor_Layer_cb)ctensor_merge_add_bckp;
+    layer->update = NULL;
+    layer->del = NULL;
+
+    layer->internal = NULL;
+    layer->internal_grad = NULL;
+    layer->internal_params = NULL;
+
+    return;
+}
+
+/*
+ *  Sum every input into 'out'.
+ *
+ *  @params layer - Pointer to the current
+ *  layer "object".
+*/
+static void ctensor_merge_add_fwd(CTensor_Layer_s *layer)
+{
+    CTensor_s *out;
+    size_t k;
+
+    out = layer->out;
+
+    memcpy(out->data, layer->inputs[0]->out->data, out->size * sizeof(ctensor_data_t));
+
+    for (k = 1; k < layer->ninputs; k++)
+        ctensor_vector_sum(out->data, out->size, layer->inputs[k]->out->data, out->data);
+
+    return;
+}
+
+/*
+ *  Every input gets the loss gradient as is.
+ *
+ *  @params layer - Pointer to the current
+ *  layer "object".
+*/
+static void ctensor_merge_add_bckp(CTensor_Layer_s *layer)
+{
+    ctensor_data_t *in_grad;
+    size_t k, size;
+
+    in_grad = layer->in_grad->data;
+    size = layer->out->size;
+
+    for (k = 0; k < layer->ninputs; k++)
+        memcpy(&in_grad[k * size], layer->loss_grad->data, size * sizeof(ctensor_data_t));
+
+    return;
+}
+
+/*
+ *  Concat merge initial layer function.
+ *  Fills all the layer information for the
+ *  Model Abstraction API. As defined in
+ *  the documentation.
+ *
+ *  @param layer - Pointer of the current
+ *  layer "object" to be filled.
+*/
+void ctensor_merge_concat(CTensor_Layer_s *layer)
+{
+    // Merges aren't trainable.
+    layer->fwd = (CTensor_Layer_cb)ctensor_merge_concat_fwd;
+    layer->bckp = (CTensor_Layer_cb)ctensor_merge_concat_bckp;
+    layer->update = NULL;
+    layer->del = NULL;
+
+    layer->internal = NULL;
+    layer->internal_grad = NULL;
+    layer->internal_params = NULL;
+
+    return;
+}
+
+/*
+ *  Copy the inputs one after the other into 'out'.
+ *
+ *  @params layer - Pointer to the current
+ *  layer "object".
+*/
+static void ctensor_merge_concat_fwd(CTensor_Layer_s *layer)
+{
+    ctensor_data_t *out;
+    CTensor_s *in;
+    size_t k;
+
+    out = layer->out->data;
+
+    for (k = 0; k < layer->ninputs; k++) {
+        in = layer->inputs[k]->out;
+
+        memcpy(out, in->data, in->size * sizeof(ctensor_data_t));
+        out += in->size;
+    }
+
+    return;
+}
+
+/*
+ *  The inputs' gradients are laid out like 'out', the
+ *  loss gradient is just split between them.
+ *
+ *  @params layer - Pointer to the current
+ *  layer "object".
+*/
+static void ctensor_merge_concat_bckp(CTensor_Layer_s *layer)
+{
+    memcpy(layer->in_grad->data, layer->loss_grad->data,
+                layer->out->size * sizeof(ctensor_data_t));
+
+    return;
+}
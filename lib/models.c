@@ -19,6 +19,47 @@
 #include <ctensor/ctensor.h>
 
 #include <stdlib.h>
+#include <math.h>
+
+struct _ct_bucket_s;
+
+struct _ct_bucket_s *_ct_bucket_new(CTensor_Comm_s *comm, CTensor_s *grad,
+                    size_t bucket_size, size_t max_buckets);
+void _ct_bucket_ready(struct _ct_bucket_s *bk, size_t end);
+void _ct_bucket_wait(struct _ct_bucket_s *bk);
+void _ct_bucket_free(struct _ct_bucket_s *bk);
+
+struct _ct_pipeline_s;
+
+struct _ct_pipeline_s *_ct_pipeline_new(CTensor_Model_s *model, CTensor_s *grad);
+ctensor_data_t _ct_pipeline_batch(struct _ct_pipeline_s *pipe, CTensor_s *x_train,
+                    CTensor_s *y_train);
+void _ct_pipeline_free(struct _ct_pipeline_s *pipe);
+
+struct _ct_hogwild_s;
+
+struct _ct_hogwild_s *_ct_hogwild_new(CTensor_Model_s *model, size_t grad_size);
+ctensor_data_t _ct_hogwild_epoch(struct _ct_hogwild_s *hw, CTensor_Batch_cb get_nbatch,
+                    size_t *step, size_t total);
+void _ct_hogwild_free(struct _ct_hogwild_s *hw);
+
+struct _ct_local_s;
+
+struct _ct_local_s *_ct_local_new(CTensor_Model_s *model, size_t grad_size,
+                    size_t *replicas);
+ctensor_data_t _ct_local_epoch(struct _ct_local_s *ls, CTensor_Batch_cb get_nbatch,
+                    size_t *step, size_t total);
+void _ct_local_free(struct _ct_local_s *ls);
+
+void _ct_graph_invalidate(CTensor_Model_s *model);
+void _ct_graph_free(CTensor_Model_s *model);
+int _ct_graph_ready(CTensor_Model_s *model);
+void _ct_graph_fwd(CTensor_Model_s *model, int infer);
+void _ct_graph_bckp(CTensor_Model_s *model, CTensor_s *grad);
+
+void _ct_fuse(CTensor_Model_s *model, int enable);
+
+ctensor_data_t _ct_sched_lr(CTensor_Model_s *model, size_t step, size_t total);
 
 void ctensor_init(CTensor_Model_s *model, size_t in_size)
 {
@@ -29,6 +70,9 @@ void ctensor_init(CTensor_Model_s *model, size_t in_size)
     model->startl = in_layer;
     model->lastl = in_layer;
 
+    // Sequential, until a layer says otherwise.
+    model->graph = NULL;
+
     // Initialize layer.
     in_layer->prev = NULL;
     in_layer->next = NULL;
@@ -50,7 +94,39 @@ void ctensor_init(CTensor_Model_s *model, size_t in_size)
     in_layer->in_grad = ctensor_new_tensor(in_size);
     in_layer->loss_grad = NULL;
     // The start layer has no internal/learnable parameters.
+    in_layer->internal = NULL;
     in_layer->internal_grad = NULL;
+    in_layer->internal_params = NULL;
+    in_layer->shared_internal = 0;
+    in_layer->kernel_rows = 0;
+    in_layer->kernel_cols = 0;
+    in_layer->inputs = NULL;
+    in_layer->ninputs = 0;
+
+    // One optimization step per batch.
+    model->accum_steps = 1;
+
+    // Constant learning rate by default.
+    model->scheduler = NULL;
+
+    // Single process.
+    model->comm = NULL;
+    model->bucket_size = 0;
+    model->shard_optimizer = 0;
+
+    // All layers on the calling thread.
+    model->stages = 0;
+    model->hogwild = 0;
+    model->local_sgd = 0;
+    model->local_steps = 8;
+    model->elastic = 0.00;
+
+    // Early stopping is disabled by default.
+    model->val_interval = 0;
+    model->patience = 0;
+    model->min_delta = 0.00;
+    model->best_vloss = INFINITY;
+    model->stop_epoch = 0;
 
     return;
 }
@@ -83,10 +159,28 @@ CTensor_Layer_s *ctensor_add_layer(CTensor_Model_s *model, size_t out_size, CTen
     // multiply by the 'loss gradient'. 
     pos->loss_grad = layer->in_grad;
 
+    // Layers without a 2-D kernel don't need to care.
+    layer->kernel_rows = 0;
+    layer->kernel_cols = 0;
+
+    // Fed by 'prev'.
+    layer->inputs = NULL;
+    layer->ninputs = 0;
+
+    // Layers without state (or that don't know about
+    // them) leave these untouched.
+    layer->internal = NULL;
+    layer->internal_params = NULL;
+    layer->internal_grad = NULL;
+    layer->shared_internal = 0;
+
     // Initialize layer internals (if any), and get all its
     // callbacks.
     init_cb(layer);
 
+    if (model->graph != NULL)
+        _ct_graph_invalidate(model);
+
     // Layers can have configurable parameters, that are
     // independent from us, so we return the pointer to 
     // this layer in order for the user to be able 
@@ -94,6 +188,99 @@ CTensor_Layer_s *ctensor_add_layer(CTensor_Model_s *model, size_t out_size, CTen
     return layer;
 }
 
+CTensor_Layer_s *ctensor_add_node(CTensor_Model_s *model, CTensor_Layer_s **inputs,
+                    size_t ninputs, size_t out_size, CTensor_Layer_cb init_cb)
+{
+    CTensor_Layer_s *layer, *pos;
+    size_t i, in_size = 0;
+
+    if (inputs == NULL || ninputs == 0)
+        return NULL;
+
+    // Other layers only ever look at 'in', the first input.
+    if (ninputs > 1 && init_cb != (CTensor_Layer_cb)ctensor_merge_add &&
+                init_cb != (CTensor_Layer_cb)ctensor_merge_concat)
+        return NULL;
+
+    for (i = 0; i < ninputs; i++) {
+        // Inputs shall be layers of this model.
+        pos = model->startl;
+
+        while (pos != NULL && pos != inputs[i])
+            pos = pos->next;
+
+        if (pos == NULL)
+            return NULL;
+
+        // Sums are taken element-wise, in 'out' sizes.
+        if (init_cb == (CTensor_Layer_cb)ctensor_merge_add && inputs[i]->out->size != out_size)
+            return NULL;
+
+        in_size += inputs[i]->out->size;
+    }
+
+    // Concats are exactly their inputs, back to back.
+    if (init_cb == (CTensor_Layer_cb)ctensor_merge_concat && in_size != out_size)
+        return NULL;
+
+    layer = (CTensor_Layer_s *)malloc(sizeof(CTensor_Layer_s));
+
+    if (layer == NULL)
+        return NULL;
+
+    layer->inputs = (CTensor_Layer_s **)malloc(ninputs * sizeof(CTensor_Layer_s *));
+    layer->ninputs = ninputs;
+
+    layer->out = ctensor_new_tensor(out_size);
+    // Gradients of every input, back to back.
+    layer->in_grad = ctensor_new_tensor(in_size);
+
+    if (layer->inputs == NULL || layer->out == NULL || layer->in_grad == NULL) {
+        if (layer->out != NULL)
+            ctensor_destroy_tensor(layer->out);
+
+        if (layer->in_grad != NULL)
+            ctensor_destroy_tensor(layer->in_grad);
+
+        free(layer->inputs);
+        free(layer);
+
+        return NULL;
+    }
+
+    for (i = 0; i < ninputs; i++)
+        layer->inputs[i] = inputs[i];
+
+    pos = model->lastl;
+    model->lastl = layer;
+
+    // The list keeps the order layers were added in,
+    // inputs always come first.
+    pos->next = layer;
+
+    layer->next = NULL;
+    layer->prev = pos;
+
+    layer->in = inputs[0]->out;
+
+    // Set once the model is planned.
+    layer->loss_grad = NULL;
+
+    layer->kernel_rows = 0;
+    layer->kernel_cols = 0;
+
+    layer->internal = NULL;
+    layer->internal_params = NULL;
+    layer->internal_grad = NULL;
+    layer->shared_internal = 0;
+
+    init_cb(layer);
+
+    _ct_graph_invalidate(model);
+
+    return layer;
+}
+
 /*
  *  Define the loss function for this model.
  *
@@ -119,6 +306,9 @@ CTensor_Loss_s *ctensor_set_loss(CTensor_Model_s *model, CTensor_Layer_cb init_c
 
     init_cb((void *)loss);
 
+    if (model->graph != NULL)
+        _ct_graph_invalidate(model);
+
     return loss;
 }
 
@@ -138,11 +328,42 @@ CTensor_Optimizer_s *ctensor_set_optimizer(CTensor_Model_s *model, CTensor_Layer
     opt = (CTensor_Optimizer_s *)malloc(sizeof(CTensor_Optimizer_s));
     model->optimizer = opt;
 
+    // The layout is only known once training starts.
+    opt->segments = NULL;
+    opt->nsegments = 0;
+
+    opt->momentum = 0.00;
+    opt->weight_decay = 0.00;
+    opt->eta = 0.00;
+
+    opt->init = init_cb;
     init_cb((void *)opt);
 
     return opt;
 }
 
+/*
+ *  Define the model's learning rate schedule, evaluated
+ *  at every optimization step.
+ *
+ *  @param model - Model to optimize.
+ *  @param init_cb - Init callback function
+ *  (function shall be casted to CTensor_Layer_cb).
+ *
+ *  @return - Scheduler pointer, for configuration.
+*/
+CTensor_Scheduler_s *ctensor_set_scheduler(CTensor_Model_s *model, CTensor_Layer_cb init_cb)
+{
+    CTensor_Scheduler_s *sched;
+
+    sched = (CTensor_Scheduler_s *)malloc(sizeof(CTensor_Scheduler_s));
+    model->scheduler = sched;
+
+    init_cb((void *)sched);
+
+    return sched;
+}
+
 /*
  *  Obtain the model's prediction, given an input.
  *
@@ -161,6 +382,11 @@ CTensor_s *ctensor_predict(CTensor_Model_s *model, CTensor_s *input)
     // Do the forward pass.
     pos = pos->next;
 
+    if (model->graph != NULL) {
+        _ct_graph_fwd(model, 1);
+        pos = NULL;
+    }
+
     while (pos != NULL) {
         pos->fwd(pos);
         pos = pos->next;
@@ -183,6 +409,11 @@ ctensor_data_t ctensor_test(CTensor_Model_s *model, CTensor_s *input, CTensor_s
 
     pos = pos->next;
 
+    if (model->graph != NULL) {
+        _ct_graph_fwd(model, 0);
+        pos = NULL;
+    }
+
     while (pos != NULL) {
         pos->fwd(pos);
         pos = pos->next;
@@ -194,13 +425,64 @@ ctensor_data_t ctensor_test(CTensor_Model_s *model, CTensor_s *input, CTensor_s
     return loss;
 }
 
-static inline void _ct_do_bckp(CTensor_Model_s *model, CTensor_s *grad)
+ctensor_data_t ctensor_evaluate(CTensor_Model_s *model, CTensor_s *input, CTensor_s *expected)
+{
+    ctensor_data_t loss = 0.00;
+    size_t in_s, out_s, n, i;
+    CTensor_s x, y;
+
+    in_s = model->startl->out->size;
+    out_s = model->lastl->out->size;
+
+    n = input->size / in_s;
+
+    if (n == 0)
+        return 0.00;
+
+    x.size = in_s;
+    y.size = out_s;
+
+    // Examples are stored contiguously, walk them
+    // with a pair of views.
+    for (i = 0; i < n; i++) {
+        x.data = &input->data[i * in_s];
+        y.data = &expected->data[i * out_s];
+
+        // No backprop follows.
+        ctensor_predict(model, &x);
+        loss += model->lossl->fwd(model->lossl, &y);
+    }
+
+    return loss / (ctensor_data_t)n;
+}
+
+/*
+ *  Backprop through the whole model, accumulating each
+ *  layer's gradient into the flat gradient vector.
+ *
+ *  @param model - Model.
+ *  @param grad - Gradient vector.
+ *  @param bk - If not NULL, this is the last backward pass
+ *  before an optimization step, and each layer's block is
+ *  handed for communication as soon as it's final.
+*/
+static inline void _ct_do_bckp(CTensor_Model_s *model, CTensor_s *grad,
+                    struct _ct_bucket_s *bk)
 {
     CTensor_Layer_s *pos;
-    size_t grad_size;
+    size_t grad_size, done = 0;
 
     grad_size = grad->size;
 
+    if (model->graph != NULL) {
+        _ct_graph_bckp(model, grad);
+
+        if (bk != NULL)
+            _ct_bucket_ready(bk, grad_size);
+
+        return;
+    }
+
     pos = model->lastl;
 
     while (pos != NULL) {
@@ -218,6 +500,10 @@ static inline void _ct_do_bckp(CTensor_Model_s *model, CTensor_s *grad)
                     grad->data, grad->data);
 
         grad->data += pos->internal_grad->size;
+        done += pos->internal_grad->size;
+
+        if (bk != NULL)
+            _ct_bucket_ready(bk, done);
 
         pos = pos->prev;
     }
@@ -275,11 +561,142 @@ static inline size_t _ct_get_model_param_size(CTensor_Model_s *model)
     return size;
 }
 
-static inline ctensor_data_t _ct_train_batch(CTensor_Model_s *model,
-                    CTensor_s *x_train, CTensor_s *y_train, CTensor_s *x_test,
-                    CTensor_s *y_test, CTensor_s *avg_grad)
+/*
+ *  Copy all of the model's parameters from/to a flat tensor,
+ *  following the same layer order as the gradient vector.
+ *
+ *  @param model - Model.
+ *  @param params - Flat tensor (_ct_get_model_param_size sized).
+ *  @param load - Non-zero to copy 'params' into the model,
+ *  zero to snapshot the model into 'params'.
+*/
+static void _ct_copy_params(CTensor_Model_s *model, CTensor_s *params, int load)
+{
+    ctensor_data_t *flat;
+    CTensor_Layer_s *pos;
+    size_t i, size;
+
+    flat = params->data;
+
+    pos = model->lastl;
+
+    while (pos != NULL) {
+        if (pos->internal_params == NULL) {
+            pos = pos->prev;
+            continue;
+        }
+
+        size = pos->internal_params->size;
+
+        for (i = 0; i < size; i++) {
+            if (load)
+                pos->internal_params->data[i] = flat[i];
+            else
+                flat[i] = pos->internal_params->data[i];
+        }
+
+        flat += size;
+        pos = pos->prev;
+    }
+
+    return;
+}
+
+/*
+ *  Export the per-layer layout of the gradient vector
+ *  to the model's optimizer.
+ *
+ *  The optimizer only sees grad[lo, hi) (this worker's
+ *  shard, or the whole vector), layers crossing its bounds
+ *  are clipped.
+ *
+ *  @param model - Model.
+ *  @param lo - Start of the part of the gradient vector.
+ *  @param hi - End of the part of the gradient vector.
+*/
+void _ct_set_segments(CTensor_Model_s *model, size_t lo, size_t hi)
+{
+    size_t n = 0, offset = 0, start, end;
+    CTensor_Optimizer_s *opt;
+    CTensor_Layer_s *pos;
+
+    opt = model->optimizer;
+
+    for (pos = model->lastl; pos != NULL; pos = pos->prev) {
+        if (pos->internal_grad == NULL)
+            continue;
+
+        start = offset;
+        offset += pos->internal_grad->size;
+
+        if (offset > lo && start < hi)
+            n++;
+    }
+
+    free(opt->segments);
+
+    opt->segments = (CTensor_Segment_s *)malloc(n * sizeof(CTensor_Segment_s));
+    opt->nsegments = n;
+
+    if (opt->segments == NULL) {
+        opt->nsegments = 0;
+        return;
+    }
+
+    n = 0;
+    offset = 0;
+
+    // Same order as _ct_do_bckp fills the gradient vector.
+    for (pos = model->lastl; pos != NULL; pos = pos->prev) {
+        if (pos->internal_grad == NULL)
+            continue;
+
+        start = offset;
+        offset += pos->internal_grad->size;
+
+        if (offset <= lo || start >= hi)
+            continue;
+
+        end = (offset < hi) ? offset : hi;
+
+        opt->segments[n].offset = ((start > lo) ? start : lo) - lo;
+        opt->segments[n].size = end - lo - opt->segments[n].offset;
+        opt->segments[n].params = pos->internal_params;
+        opt->segments[n].first = lo + opt->segments[n].offset - start;
+
+        // A kernel split across shards can't be treated as one.
+        if (start >= lo && offset <= hi) {
+            opt->segments[n].rows = pos->kernel_rows;
+            opt->segments[n].cols = pos->kernel_cols;
+        } else {
+            opt->segments[n].rows = 0;
+            opt->segments[n].cols = 0;
+        }
+
+        n++;
+    }
+
+    return;
+}
+
+/*
+ *  Forward and backward pass over one (micro-)batch,
+ *  accumulating the gradients into 'avg_grad'.
+ *
+ *  @param model - Model.
+ *  @param x_train - Batch inputs.
+ *  @param y_train - Batch expected outputs.
+ *  @param avg_grad - Gradient accumulator.
+ *  @param bk - Bucketed communication, if this is the last
+ *  batch before an optimization step (NULL otherwise).
+ *
+ *  @return - Average loss over the batch.
+*/
+ctensor_data_t _ct_train_batch(CTensor_Model_s *model,
+                    CTensor_s *x_train, CTensor_s *y_train, CTensor_s *avg_grad,
+                    struct _ct_bucket_s *bk)
 {
-    ctensor_data_t loss, vloss, batch_loss = 0.00, avg;
+    ctensor_data_t loss, batch_loss = 0.00;
     CTensor_Loss_s *lossl;
     size_t out_s, in_s;
     int i;
@@ -290,27 +707,19 @@ static inline ctensor_data_t _ct_train_batch(CTensor_Model_s *model,
     // Get the model's loss layer.
     lossl = model->lossl;
 
-    // Clear our average gradient tensor.
-    ctensor_tensor_zeros(avg_grad);
-
     for (i = 0; i < model->batch_size; i++) {
-        // Check how we're doing, by getting the loss
-        // with respect to the test set, data that our network
-        // hasn't been trained on.
-        vloss = ctensor_test(model, x_test, y_test);
         // Get the loss with respect to the training set.
         loss = ctensor_test(model, x_train, y_train);
 
-        // TODO: Check how much vloss is changing to prevent overfitting.
-
         // Add out loss to the overall batch loss (we'll average it
         // later on).
         batch_loss += loss;
 
         // Do the backprop on the loss function, to start the chain rule.
         lossl->bckp(lossl, y_train);
-        // Walk through all of our model and perform backprop.
-        _ct_do_bckp(model, avg_grad);
+        // Walk through all of our model and perform backprop,
+        // the last example finalizes the gradients.
+        _ct_do_bckp(model, avg_grad, (i + 1 == model->batch_size) ? bk : NULL);
 
         // Batches are stored contiguosly in memory.
         // So we just jump to the next example in our batch.
@@ -322,47 +731,243 @@ static inline ctensor_data_t _ct_train_batch(CTensor_Model_s *model,
     x_train->data -= x_train->size;
     y_train->data -= y_train->size;
 
-    avg = 1.00/(ctensor_data_t)model->batch_size;
-
     // Average our loss.
-    batch_loss *= avg;
+    return batch_loss / (ctensor_data_t)model->batch_size;
+}
+
+/*
+ *  Optimization step over the accumulated gradients.
+ *
+ *  @param model - Model.
+ *  @param avg_grad - Accumulated (summed) gradients.
+ *  @param shard - Part of 'avg_grad' optimized by this worker
+ *  ('avg_grad' itself, unless the optimizer is sharded).
+ *  @param samples - Number of examples accumulated.
+ *  @param learning_rate - Learning rate for this step.
+ *  @param bk - Bucketed communication (NULL if not overlapped).
+*/
+void _ct_train_step(CTensor_Model_s *model, CTensor_s *avg_grad,
+                    CTensor_s *shard, size_t samples, ctensor_data_t learning_rate,
+                    struct _ct_bucket_s *bk)
+{
+    ctensor_data_t avg;
+
+    // When data-parallel, average the gradients across all
+    // workers; either wait for the buckets still in flight
+    // or do it all at once. A sharded optimizer only needs
+    // its own shard.
+    if (bk != NULL)
+        _ct_bucket_wait(bk);
+    else if (shard != avg_grad)
+        model->comm->reduce_scatter(model->comm, avg_grad);
+    else if (model->comm != NULL)
+        model->comm->allreduce(model->comm, avg_grad);
+
+    // Workers are out of sync, don't step on a partial
+    // average; training stops here.
+    if (model->comm != NULL && model->comm->error) {
+        ctensor_tensor_zeros(avg_grad);
+        return;
+    }
+
+    avg = 1.00/(ctensor_data_t)samples;
+
     // Average all gradients (we're doing a mini-batch update).
-    ctensor_sv_mult(avg_grad->data, avg_grad->size, avg, avg_grad->data);
+    ctensor_sv_mult(shard->data, shard->size, avg, shard->data);
 
     // Run the average gradients through the selected 
     // optimizer gradient function.
     model->optimizer->opt((void *)model->optimizer,
-                            avg_grad, model->learning_rate);
+                            shard, learning_rate);
+
+    // Every worker gets everyone else's updates.
+    if (shard != avg_grad)
+        model->comm->allgather(model->comm, avg_grad);
+
+    if (model->comm != NULL && model->comm->error) {
+        ctensor_tensor_zeros(avg_grad);
+        return;
+    }
+
     // Perform the update on the model's parameters.
     _ct_grad_update(model, avg_grad);
 
-    return batch_loss;
+    // Clear our average gradient tensor, for the next step.
+    ctensor_tensor_zeros(avg_grad);
+
+    return;
 }
 
 ctensor_data_t ctensor_train(CTensor_Model_s *model, CTensor_Batch_cb get_nbatch,
                             CTensor_s *x_test, CTensor_s *y_test)
 {
     CTensor_s *x_train = NULL, *y_train = NULL;
-    ctensor_data_t network_loss = 0.00;
-    CTensor_s *avg_grad = NULL;
-    size_t grad_size = 0;
-    int epoch, batch;
+    ctensor_data_t network_loss = 0.00, vloss;
+    CTensor_s *avg_grad = NULL, *best = NULL;
+    size_t grad_size = 0, wait = 0, step = 0;
+    struct _ct_pipeline_s *pipe = NULL;
+    struct _ct_hogwild_s *hw = NULL;
+    struct _ct_local_s *ls = NULL;
+    struct _ct_bucket_s *bk = NULL;
+    size_t accum, micro = 0, lo, hi, replicas, total;
+    CTensor_s shard, *opt_grad;
+    CTensor_Comm_s *comm;
+    int epoch, batch, last, replicate;
+
+    // Plan DAG models now, copies of the model share it.
+    // Without a plan there's no backward pass to train with.
+    if (model->graph != NULL && _ct_graph_ready(model) != 0)
+        return NAN;
 
     grad_size = _ct_get_model_param_size(model);
     avg_grad = ctensor_new_tensor(grad_size);
+    ctensor_tensor_zeros(avg_grad);
+
+    accum = (model->accum_steps == 0) ? 1 : model->accum_steps;
+
+    // DAG models are trained on one thread, see ctensor_add_node.
+    replicate = (model->hogwild > 1 || model->local_sgd > 1) && model->graph == NULL;
+
+    // Thread replicas only share memory.
+    comm = replicate ? NULL : model->comm;
+
+    // Compressor state of a previous run refers to its buffers.
+    if (comm != NULL && comm->compressor != NULL && comm->compressor->reset != NULL)
+        comm->compressor->reset((void *)comm->compressor);
+
+    lo = 0;
+    hi = grad_size;
+
+    opt_grad = avg_grad;
+
+    // Only optimize this worker's shard of the gradient vector.
+    if (comm != NULL && model->shard_optimizer && comm->world_size > 1) {
+        lo = grad_size * comm->rank / comm->world_size;
+        hi = grad_size * (comm->rank + 1) / comm->world_size;
+
+        shard.data = &avg_grad->data[lo];
+        shard.size = hi - lo;
+
+        opt_grad = &shard;
+    }
+
+    _ct_set_segments(model, lo, hi);
+
+    // Replicas and pipeline stages need the layers as added.
+    _ct_fuse(model, model->stages <= 1 && model->hogwild <= 1 && model->local_sgd <= 1);
+
+    if (replicate && model->hogwild > 1)
+        hw = _ct_hogwild_new(model, grad_size);
+    else if (replicate)
+        ls = _ct_local_new(model, grad_size, &replicas);
+    else if (model->stages > 1 && model->graph == NULL)
+        pipe = _ct_pipeline_new(model, avg_grad);
+
+    // Every Hogwild! batch is an optimization step, local
+    // SGD replicas step once every 'replicas' batches.
+    if (hw != NULL)
+        accum = 1;
+    else if (ls != NULL)
+        accum = replicas;
+
+    // Overlap gradient communication with backprop.
+    if (comm != NULL && model->bucket_size != 0 && opt_grad == avg_grad && pipe == NULL)
+        bk = _ct_bucket_new(comm, avg_grad, model->bucket_size,
+                            model->optimizer->nsegments);
+
+    // Unless the scheduler says otherwise, anneal over this run.
+    total = model->epochs * ((model->batches + accum - 1) / accum);
+
+    model->best_vloss = INFINITY;
+    model->stop_epoch = 0;
+
+    // Keep a copy of the best parameters seen, we'll
+    // roll back to them once we're done.
+    if (model->val_interval != 0 && x_test != NULL)
+        best = ctensor_new_tensor(grad_size);
 
     for (epoch = 0; epoch < model->epochs; epoch++) {
         network_loss = 0.00;
 
-        for (batch = 0; batch < model->batches; batch++) {
+        if (hw != NULL)
+            network_loss = _ct_hogwild_epoch(hw, get_nbatch, &step, total);
+        else if (ls != NULL)
+            network_loss = _ct_local_epoch(ls, get_nbatch, &step, total);
+
+        for (batch = 0; hw == NULL && ls == NULL && batch < model->batches; batch++) {
             // Obtain the next batch.
             get_nbatch(&x_train, &y_train, batch);
-            network_loss += _ct_train_batch(model, x_train, y_train, x_test, y_test, avg_grad);
+
+            // Keep accumulating micro-batches until we have 'accum'
+            // of them (or we've run out of batches for this epoch).
+            last = (++micro == accum || batch + 1 == model->batches);
+
+            if (pipe != NULL)
+                network_loss += _ct_pipeline_batch(pipe, x_train, y_train);
+            else
+                network_loss += _ct_train_batch(model, x_train, y_train, avg_grad,
+                                                last ? bk : NULL);
+
+            if (!last)
+                continue;
+
+            _ct_train_step(model, avg_grad, opt_grad, micro * model->batch_size,
+                            _ct_sched_lr(model, step++, total), bk);
+            micro = 0;
+
+            if (comm != NULL && comm->error)
+                break;
+        }
+
+        // A collective failed, replicas can't be kept in sync.
+        if (comm != NULL && comm->error) {
+            network_loss = NAN;
+            break;
         }
 
         network_loss /= model->batches;
+        model->stop_epoch = epoch + 1;
+
+        if (best == NULL || (epoch + 1) % model->val_interval != 0)
+            continue;
+
+        // Check how we're doing, by getting the loss
+        // with respect to the validation set, data that
+        // our network hasn't been trained on.
+        vloss = ctensor_evaluate(model, x_test, y_test);
+
+        if (vloss < model->best_vloss - model->min_delta) {
+            model->best_vloss = vloss;
+            wait = 0;
+
+            _ct_copy_params(model, best, 0);
+            continue;
+        }
+
+        // vloss has plateaued (or we're overfitting).
+        if (model->patience != 0 && ++wait >= model->patience)
+            break;
+    }
+
+    if (best != NULL) {
+        if (isfinite(model->best_vloss))
+            _ct_copy_params(model, best, 1);
+
+        ctensor_destroy_tensor(best);
     }
 
+    if (bk != NULL)
+        _ct_bucket_free(bk);
+
+    if (pipe != NULL)
+        _ct_pipeline_free(pipe);
+
+    if (hw != NULL)
+        _ct_hogwild_free(hw);
+
+    if (ls != NULL)
+        _ct_local_free(ls);
+
     ctensor_destroy_tensor(avg_grad);
 
     return network_loss;
@@ -381,6 +986,7 @@ void ctensor_destroy(CTensor_Model_s *model)
             pos->del(pos);
 
         ctensor_destroy_tensor(pos->in_grad);
+        free(pos->inputs);
 
         if (pos->prev == NULL) {
             free(pos->out);
@@ -405,8 +1011,14 @@ void ctensor_destroy(CTensor_Model_s *model)
 
     if (opt != NULL) {
         opt->del((void *)opt);
+        free(opt->segments);
         free(opt);
     }
 
+    if (model->scheduler != NULL)
+        free(model->scheduler);
+
+    _ct_graph_free(model);
+
     return;
 }
\ No newline at end of file
@@ -0,0 +1,367 @@
+/*
+ *  NUMA topology and placement for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <ctensor/ctensor.h>
+
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdio.h>
+
+// Upper bound on nodes we keep track of.
+#define CT_NUMA_MAX_NODES   64
+
+/*
+ *  Topology, read once from /sys. Without NUMA support
+ *  (or /sys), the whole machine is a single node.
+*/
+static struct {
+    int             nnodes;
+    // Node ids, and each node's CPUs (one after the other).
+    int             node_id[CT_NUMA_MAX_NODES];
+    int             *cpus;
+    size_t          cpu_off[CT_NUMA_MAX_NODES + 1];
+    // CPUs in the order threads get pinned to them.
+    int             *order;
+    size_t          ncpus;
+    // Affinity policy.
+    int             affinity;
+} _ct_numa;
+
+static pthread_once_t _ct_numa_once = PTHREAD_ONCE_INIT;
+
+/*
+ *  Parse a /sys list (e.g. "0-3,8-11") into 'out'.
+ *
+ *  @return - Number of entries, at most 'max'.
+*/
+static size_t _ct_numa_parse_list(const char *path, int *out, size_t max)
+{
+    int lo, hi, c, i;
+    size_t n = 0;
+    FILE *f;
+
+    f = fopen(path, "r");
+
+    if (f == NULL)
+        return 0;
+
+    while (fscanf(f, "%d", &lo) == 1) {
+        hi = lo;
+        c = fgetc(f);
+
+        if (c == '-') {
+            if (fscanf(f, "%d", &hi) != 1)
+                break;
+
+            c = fgetc(f);
+        }
+
+        for (i = lo; i <= hi && n < max; i++)
+            out[n++] = i;
+
+        if (c != ',')
+            break;
+    }
+
+    fclose(f);
+
+    return n;
+}
+
+/*
+ *  CPU visiting order for each policy.
+*/
+static void _ct_numa_order(int policy)
+{
+    size_t i, k, n;
+    int node;
+
+    if (policy != CT_AFFINITY_SCATTER) {
+        memcpy(_ct_numa.order, _ct_numa.cpus, _ct_numa.ncpus * sizeof(int));
+        return;
+    }
+
+    // Round-robin over nodes.
+    n = 0;
+
+    for (k = 0; n < _ct_numa.ncpus; k++) {
+        for (node = 0; node < _ct_numa.nnodes; node++) {
+            i = _ct_numa.cpu_off[node] + k;
+
+            if (i < _ct_numa.cpu_off[node + 1])
+                _ct_numa.order[n++] = _ct_numa.cpus[i];
+        }
+    }
+
+    return;
+}
+
+static void _ct_numa_init(void)
+{
+    int nodes[CT_NUMA_MAX_NODES], node_cpus[CPU_SETSIZE];
+    size_t nn, nc, i, k;
+    const char *env;
+    char path[128];
+    long cpus;
+
+    nn = _ct_numa_parse_list("/sys/devices/system/node/online", nodes, CT_NUMA_MAX_NODES);
+
+    cpus = sysconf(_SC_NPROCESSORS_CONF);
+    cpus = (cpus < 1) ? 1 : cpus;
+
+    _ct_numa.cpus = (int *)malloc((cpus + CPU_SETSIZE) * sizeof(int));
+    _ct_numa.order = (int *)malloc((cpus + CPU_SETSIZE) * sizeof(int));
+    _ct_numa.ncpus = 0;
+    _ct_numa.nnodes = 0;
+
+    if (_ct_numa.cpus == NULL || _ct_numa.order == NULL) {
+        _ct_numa.affinity = CT_AFFINITY_NONE;
+        return;
+    }
+
+    for (i = 0; i < nn; i++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", nodes[i]);
+
+        nc = _ct_numa_parse_list(path, node_cpus, CPU_SETSIZE);
+
+        // Memory-only nodes have no CPUs to run on.
+        if (nc == 0)
+            continue;
+
+        _ct_numa.node_id[_ct_numa.nnodes] = nodes[i];
+        _ct_numa.cpu_off[_ct_numa.nnodes] = _ct_numa.ncpus;
+
+        for (k = 0; k < nc; k++)
+            _ct_numa.cpus[_ct_numa.ncpus++] = node_cpus[k];
+
+        _ct_numa.nnodes++;
+    }
+
+    // No NUMA information, a single node with every CPU.
+    if (_ct_numa.nnodes == 0) {
+        _ct_numa.nnodes = 1;
+        _ct_numa.node_id[0] = 0;
+        _ct_numa.cpu_off[0] = 0;
+
+        for (i = 0; i < (size_t)cpus; i++)
+            _ct_numa.cpus[i] = i;
+
+        _ct_numa.ncpus = cpus;
+    }
+
+    _ct_numa.cpu_off[_ct_numa.nnodes] = _ct_numa.ncpus;
+
+    env = getenv("CTENSOR_AFFINITY");
+
+    _ct_numa.affinity = CT_AFFINITY_NONE;
+
+    if (env != NULL && strcmp(env, "compact") == 0)
+        _ct_numa.affinity = CT_AFFINITY_COMPACT;
+    else if (env != NULL && strcmp(env, "scatter") == 0)
+        _ct_numa.affinity = CT_AFFINITY_SCATTER;
+
+    _ct_numa_order(_ct_numa.affinity);
+
+    return;
+}
+
+/*
+ *  Number of NUMA nodes (with CPUs) of this machine.
+*/
+int ctensor_numa_nodes(void)
+{
+    pthread_once(&_ct_numa_once, _ct_numa_init);
+
+    return _ct_numa.nnodes;
+}
+
+/*
+ *  Set the CPU affinity policy of worker threads.
+ *
+ *  @param policy - CT_AFFINITY_NONE, CT_AFFINITY_COMPACT
+ *  or CT_AFFINITY_SCATTER.
+*/
+void ctensor_set_affinity(int policy)
+{
+    pthread_once(&_ct_numa_once, _ct_numa_init);
+
+    if (_ct_numa.ncpus == 0)
+        return;
+
+    _ct_numa.affinity = policy;
+    _ct_numa_order(policy);
+
+    return;
+}
+
+/*
+ *  Current affinity policy, initially read from CTENSOR_AFFINITY
+ *  ("none", "compact" or "scatter").
+*/
+int _ct_numa_affinity(void)
+{
+    pthread_once(&_ct_numa_once, _ct_numa_init);
+
+    return _ct_numa.affinity;
+}
+
+/*
+ *  CPU the t-th worker thread is pinned to, -1 if
+ *  threads aren't pinned.
+*/
+int _ct_numa_cpu(size_t t)
+{
+    if (_ct_numa_affinity() == CT_AFFINITY_NONE || _ct_numa.ncpus == 0)
+        return -1;
+
+    return _ct_numa.order[t % _ct_numa.ncpus];
+}
+
+/*
+ *  Node of a CPU, -1 if unknown.
+*/
+int _ct_numa_node_of(int cpu)
+{
+    size_t i;
+    int k;
+
+    if (cpu < 0)
+        return -1;
+
+    pthread_once(&_ct_numa_once, _ct_numa_init);
+
+    for (k = 0; k < _ct_numa.nnodes; k++) {
+        for (i = _ct_numa.cpu_off[k]; i < _ct_numa.cpu_off[k + 1]; i++) {
+            if (_ct_numa.cpus[i] == cpu)
+                return _ct_numa.node_id[k];
+        }
+    }
+
+    return -1;
+}
+
+/*
+ *  Pin the calling thread to the t-th CPU of the
+ *  affinity order.
+ *
+ *  @return - Node the thread now runs on, -1 if not pinned.
+*/
+int _ct_numa_pin(size_t t)
+{
+    cpu_set_t set;
+    int cpu;
+
+    cpu = _ct_numa_cpu(t);
+
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return -1;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        return -1;
+
+    return _ct_numa_node_of(cpu);
+}
+
+/*
+ *  Pin the calling thread to all CPUs of the k-th (out
+ *  of n) share of nodes, for coarse-grained workers (e.g.
+ *  pipeline stages).
+ *
+ *  @return - Node the thread now runs on, -1 if not pinned.
+*/
+int _ct_numa_pin_share(size_t k, size_t n)
+{
+    cpu_set_t set;
+    size_t i;
+    int node;
+
+    if (_ct_numa_affinity() == CT_AFFINITY_NONE || n == 0)
+        return -1;
+
+    node = (int)(k * _ct_numa.nnodes / n);
+
+    CPU_ZERO(&set);
+
+    for (i = _ct_numa.cpu_off[node]; i < _ct_numa.cpu_off[node + 1]; i++) {
+        if (_ct_numa.cpus[i] < CPU_SETSIZE)
+            CPU_SET(_ct_numa.cpus[i], &set);
+    }
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        return -1;
+
+    return _ct_numa.node_id[node];
+}
+
+/*
+ *  Place (and migrate) the pages fully within
+ *  [addr, addr + bytes) on a node.
+ *
+ *  @return - 0 on success, -1 on failure.
+*/
+int _ct_numa_bind(void *addr, size_t bytes, int node)
+{
+    unsigned long mask[CT_NUMA_MAX_NODES / (8 * sizeof(unsigned long)) + 1];
+    uintptr_t lo, hi, page;
+
+    if (node < 0 || node >= CT_NUMA_MAX_NODES)
+        return -1;
+
+    page = (uintptr_t)sysconf(_SC_PAGESIZE);
+
+    // Partial pages at either end may be shared with
+    // other data, leave them alone.
+    lo = ((uintptr_t)addr + page - 1) & ~(page - 1);
+    hi = ((uintptr_t)addr + bytes) & ~(page - 1);
+
+    if (hi <= lo)
+        return 0;
+
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+
+    // Preferred rather than bound, so that a full node
+    // falls back to another instead of failing.
+    if (syscall(SYS_mbind, (void *)lo, hi - lo, MPOL_PREFERRED, mask,
+                (unsigned long)CT_NUMA_MAX_NODES + 1, MPOL_MF_MOVE) != 0)
+        return -1;
+
+    return 0;
+}
+
+/*
+ *  Place a tensor's memory on a NUMA node.
+ *
+ *  @param tensor - Tensor.
+ *  @param node - Node id.
+ *
+ *  @return - 0 on success, -1 on failure.
+*/
+int ctensor_tensor_bind(CTensor_s *tensor, int node)
+{
+    return _ct_numa_bind((void *)tensor->data, tensor->size * sizeof(ctensor_data_t), node);
+}
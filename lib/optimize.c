@@ -19,19 +19,72 @@
 #include <ctensor/ctensor.h>
 
 #include <stdlib.h>
+#include <math.h>
+
+#include "adam8.h"
 
 void _ct_adam(float *grad, size_t grad_size, float *m, float *v, float b1, float b2, float lr, int t);
 void _ct_adam_opt(CTensor_Optimizer_s *layer, CTensor_s *grad, ctensor_data_t learning_rate);
 void _ct_adam_destroy(CTensor_Optimizer_s *layer);
 
+void _ct_adam8(float *grad, size_t grad_size, int8_t *qm, float *m_scale,
+            uint8_t *qv, float *v_scale, float b1, float b2, float lr, int t);
+void _ct_adam8_opt(CTensor_Optimizer_s *layer, CTensor_s *grad, ctensor_data_t learning_rate);
+
+void _ct_lamb(float *grad, float *params, size_t grad_size, float *m, float *v,
+            float b1, float b2, float wd, float lr, int t);
+void _ct_lamb_opt(CTensor_Optimizer_s *layer, CTensor_s *grad, ctensor_data_t learning_rate);
+
+void _ct_lars(float *grad, float *params, size_t grad_size, float *v,
+            float mu, float eta, float wd, float lr);
+void _ct_lars_opt(CTensor_Optimizer_s *layer, CTensor_s *grad, ctensor_data_t learning_rate);
+void _ct_lars_destroy(CTensor_Optimizer_s *layer);
+
+void _ct_sgd(float *grad, size_t grad_size, float lr);
+void _ct_momentum(float *grad, size_t grad_size, float *v, float mu, float lr);
+void _ct_nesterov(float *grad, size_t grad_size, float *v, float mu, float lr);
+void _ct_sgd_opt(CTensor_Optimizer_s *layer, CTensor_s *grad, ctensor_data_t learning_rate);
+void _ct_momentum_opt(CTensor_Optimizer_s *layer, CTensor_s *grad, ctensor_data_t learning_rate);
+void _ct_nesterov_opt(CTensor_Optimizer_s *layer, CTensor_s *grad, ctensor_data_t learning_rate);
+void _ct_sgd_destroy(CTensor_Optimizer_s *layer);
+
+void _ct_adafactor(float *grad, size_t grad_size, size_t rows, size_t cols,
+            float *R, float *C, float *v, float b2, float lr);
+void _ct_adafactor_opt(CTensor_Optimizer_s *layer, CTensor_s *grad, ctensor_data_t learning_rate);
+void _ct_adafactor_destroy(CTensor_Optimizer_s *layer);
+
 typedef struct {
     int             t;
     ctensor_data_t  b1;
     ctensor_data_t  b2;
     CTensor_s       *m;
     CTensor_s       *v;
+    // 8-bit block-quantized moments (ctensor_adam8),
+    // with one scale per block. 'm' and 'v' stay NULL.
+    int8_t          *qm;
+    uint8_t         *qv;
+    ctensor_data_t  *m_scale;
+    ctensor_data_t  *v_scale;
 } _adam_s;
 
+typedef struct {
+    // Velocity, only state kept by the momentum variants.
+    CTensor_s       *v;
+} _sgd_s;
+
+typedef struct {
+    int             t;
+    // Decay rate, b2 = 1 - t^(-decay).
+    ctensor_data_t  decay;
+    // Factored statistics of all layers, one
+    // after the other (R, C and v of each layer).
+    CTensor_s       *state;
+} _adafactor_s;
+
+typedef struct {
+    CTensor_s       *v;
+} _lars_s;
+
 /*
  *  Adam init function.
  *
@@ -53,6 +106,26 @@ void ctensor_adam(CTensor_Optimizer_s *layer)
     data->m = NULL;
     data->v = NULL;
 
+    data->qm = NULL;
+    data->qv = NULL;
+    data->m_scale = NULL;
+    data->v_scale = NULL;
+
+    return;
+}
+
+/*
+ *  Adam init function, with 8-bit block-quantized
+ *  moments.
+ *
+ *  @param layer - Optimizer to init.
+*/
+void ctensor_adam8(CTensor_Optimizer_s *layer)
+{
+    ctensor_adam(layer);
+
+    layer->opt = _ct_adam8_opt;
+
     return;
 }
 
@@ -81,16 +154,425 @@ void _ct_adam_opt(CTensor_Optimizer_s *layer, CTensor_s *grad, ctensor_data_t le
     return;
 }
 
+void _ct_adam8_opt(CTensor_Optimizer_s *layer, CTensor_s *grad, ctensor_data_t learning_rate)
+{
+    size_t blocks;
+    _adam_s *data;
+    int t;
+
+    data = (_adam_s *)layer->internal;
+
+    if (data->qm == NULL) {
+        blocks = (grad->size + CT_ADAM8_BLOCK - 1) / CT_ADAM8_BLOCK;
+
+        // All zeros (with zero scales) decodes to zeros.
+        data->qm = (int8_t *)calloc(grad->size, sizeof(int8_t));
+        data->qv = (uint8_t *)calloc(grad->size, sizeof(uint8_t));
+        data->m_scale = (ctensor_data_t *)calloc(blocks, sizeof(ctensor_data_t));
+        data->v_scale = (ctensor_data_t *)calloc(blocks, sizeof(ctensor_data_t));
+    }
+
+    t = data->t++;
+
+    _ct_adam8(grad->data, grad->size, data->qm, data->m_scale,
+            data->qv, data->v_scale, data->b1, data->b2, learning_rate, t);
+
+    return;
+}
+
 void _ct_adam_destroy(CTensor_Optimizer_s *layer)
 {
     _adam_s *data;
 
     data = (_adam_s *)layer->internal;
 
-    ctensor_destroy_tensor(data->m);
-    ctensor_destroy_tensor(data->v);
+    // Moments are only allocated on the first step.
+    if (data->m != NULL)
+        ctensor_destroy_tensor(data->m);
+
+    if (data->v != NULL)
+        ctensor_destroy_tensor(data->v);
+
+    free(data->qm);
+    free(data->qv);
+    free(data->m_scale);
+    free(data->v_scale);
 
     free(data);
 
     return;
-}
\ No newline at end of file
+}
+
+/*
+ *  Get the i-th layer block of the gradient vector, if the
+ *  optimizer wasn't given a layout, the whole vector is
+ *  treated as a single block.
+ *
+ *  @param layer - Optimizer.
+ *  @param grad - Gradient vector.
+ *  @param i - Block index.
+ *  @param offset - Block offset (output).
+ *  @param size - Block size (output).
+ *
+ *  @return - The block's parameters (NULL if unknown).
+*/
+static ctensor_data_t *_ct_opt_segment(CTensor_Optimizer_s *layer, CTensor_s *grad,
+                            size_t i, size_t *offset, size_t *size)
+{
+    if (layer->segments == NULL) {
+        *offset = 0;
+        *size = grad->size;
+
+        return NULL;
+    }
+
+    *offset = layer->segments[i].offset;
+    *size = layer->segments[i].size;
+
+    if (layer->segments[i].params == NULL)
+        return NULL;
+
+    return &layer->segments[i].params->data[layer->segments[i].first];
+}
+
+/*
+ *  LAMB init function.
+ *
+ *  @param layer - Optimizer to init.
+*/
+void ctensor_lamb(CTensor_Optimizer_s *layer)
+{
+    _adam_s *data;
+
+    // LAMB shares Adam's state.
+    ctensor_adam(layer);
+
+    layer->opt = _ct_lamb_opt;
+
+    data = (_adam_s *)layer->internal;
+
+    data->b1 = 0.9;
+    data->b2 = 0.999;
+
+    layer->weight_decay = 0.01;
+
+    return;
+}
+
+void _ct_lamb_opt(CTensor_Optimizer_s *layer, CTensor_s *grad, ctensor_data_t learning_rate)
+{
+    size_t i, n, offset, size;
+    ctensor_data_t *params;
+    _adam_s *data;
+    int t;
+
+    data = (_adam_s *)layer->internal;
+
+    if (data->m == NULL) {
+        data->m = ctensor_new_tensor(grad->size);
+        ctensor_tensor_zeros(data->m);
+    }
+
+    if (data->v == NULL) {
+        data->v = ctensor_new_tensor(grad->size);
+        ctensor_tensor_zeros(data->v);
+    }
+
+    t = data->t++;
+
+    n = (layer->segments == NULL) ? 1 : layer->nsegments;
+
+    // Each layer gets its own trust ratio.
+    for (i = 0; i < n; i++) {
+        params = _ct_opt_segment(layer, grad, i, &offset, &size);
+
+        _ct_lamb(&grad->data[offset], params, size, &data->m->data[offset],
+                &data->v->data[offset], data->b1, data->b2,
+                layer->weight_decay, learning_rate, t);
+    }
+
+    return;
+}
+
+/*
+ *  LARS init function.
+ *
+ *  @param layer - Optimizer to init.
+*/
+void ctensor_lars(CTensor_Optimizer_s *layer)
+{
+    _lars_s *data;
+
+    layer->opt = _ct_lars_opt;
+    layer->del = (CTensor_Layer_cb)_ct_lars_destroy;
+    layer->internal = malloc(sizeof(_lars_s));
+
+    data = (_lars_s *)layer->internal;
+
+    data->v = NULL;
+
+    layer->momentum = 0.9;
+    layer->weight_decay = 5e-4;
+    layer->eta = 0.001;
+
+    return;
+}
+
+void _ct_lars_opt(CTensor_Optimizer_s *layer, CTensor_s *grad, ctensor_data_t learning_rate)
+{
+    size_t i, n, offset, size;
+    ctensor_data_t *params;
+    _lars_s *data;
+
+    data = (_lars_s *)layer->internal;
+
+    if (data->v == NULL) {
+        data->v = ctensor_new_tensor(grad->size);
+        ctensor_tensor_zeros(data->v);
+    }
+
+    n = (layer->segments == NULL) ? 1 : layer->nsegments;
+
+    for (i = 0; i < n; i++) {
+        params = _ct_opt_segment(layer, grad, i, &offset, &size);
+
+        _ct_lars(&grad->data[offset], params, size, &data->v->data[offset],
+                layer->momentum, layer->eta, layer->weight_decay, learning_rate);
+    }
+
+    return;
+}
+
+void _ct_lars_destroy(CTensor_Optimizer_s *layer)
+{
+    _lars_s *data;
+
+    data = (_lars_s *)layer->internal;
+
+    if (data->v != NULL)
+        ctensor_destroy_tensor(data->v);
+
+    free(data);
+
+    return;
+}
+
+/*
+ *  SGD init function.
+ *
+ *  @param layer - Optimizer to init.
+*/
+void ctensor_sgd(CTensor_Optimizer_s *layer)
+{
+    _sgd_s *data;
+
+    layer->opt = _ct_sgd_opt;
+    layer->del = (CTensor_Layer_cb)_ct_sgd_destroy;
+    layer->internal = malloc(sizeof(_sgd_s));
+
+    data = (_sgd_s *)layer->internal;
+    data->v = NULL;
+
+    return;
+}
+
+/*
+ *  SGD with Momentum init function.
+ *
+ *  @param layer - Optimizer to init.
+*/
+void ctensor_momentum(CTensor_Optimizer_s *layer)
+{
+    ctensor_sgd(layer);
+
+    layer->opt = _ct_momentum_opt;
+    layer->momentum = 0.9;
+
+    return;
+}
+
+/*
+ *  SGD with Nesterov Momentum init function.
+ *
+ *  @param layer - Optimizer to init.
+*/
+void ctensor_nesterov(CTensor_Optimizer_s *layer)
+{
+    ctensor_sgd(layer);
+
+    layer->opt = _ct_nesterov_opt;
+    layer->momentum = 0.9;
+
+    return;
+}
+
+/*
+ *  Get the velocity vector, allocating it on the
+ *  first step.
+ *
+ *  @param layer - Optimizer.
+ *  @param size - Size of the gradient vector.
+*/
+static ctensor_data_t *_ct_sgd_velocity(CTensor_Optimizer_s *layer, size_t size)
+{
+    _sgd_s *data;
+
+    data = (_sgd_s *)layer->internal;
+
+    if (data->v == NULL) {
+        data->v = ctensor_new_tensor(size);
+        ctensor_tensor_zeros(data->v);
+    }
+
+    return data->v->data;
+}
+
+void _ct_sgd_opt(CTensor_Optimizer_s *layer, CTensor_s *grad, ctensor_data_t learning_rate)
+{
+    _ct_sgd(grad->data, grad->size, learning_rate);
+
+    return;
+}
+
+void _ct_momentum_opt(CTensor_Optimizer_s *layer, CTensor_s *grad, ctensor_data_t learning_rate)
+{
+    ctensor_data_t *v;
+
+    v = _ct_sgd_velocity(layer, grad->size);
+
+    _ct_momentum(grad->data, grad->size, v, layer->momentum, learning_rate);
+
+    return;
+}
+
+void _ct_nesterov_opt(CTensor_Optimizer_s *layer, CTensor_s *grad, ctensor_data_t learning_rate)
+{
+    ctensor_data_t *v;
+
+    v = _ct_sgd_velocity(layer, grad->size);
+
+    _ct_nesterov(grad->data, grad->size, v, layer->momentum, learning_rate);
+
+    return;
+}
+
+void _ct_sgd_destroy(CTensor_Optimizer_s *layer)
+{
+    _sgd_s *data;
+
+    data = (_sgd_s *)layer->internal;
+
+    if (data->v != NULL)
+        ctensor_destroy_tensor(data->v);
+
+    free(data);
+
+    return;
+}
+
+/*
+ *  Adafactor init function.
+ *
+ *  @param layer - Optimizer to init.
+*/
+void ctensor_adafactor(CTensor_Optimizer_s *layer)
+{
+    _adafactor_s *data;
+
+    layer->opt = _ct_adafactor_opt;
+    layer->del = (CTensor_Layer_cb)_ct_adafactor_destroy;
+    layer->internal = malloc(sizeof(_adafactor_s));
+
+    data = (_adafactor_s *)layer->internal;
+
+    data->t = 1;
+    data->decay = 0.8;
+    data->state = NULL;
+
+    return;
+}
+
+/*
+ *  Get the kernel shape of the i-th block, blocks without
+ *  a (fitting) kernel aren't factored.
+ *
+ *  @param layer - Optimizer.
+ *  @param i - Block index.
+ *  @param size - Block size.
+ *  @param rows - Kernel rows (output).
+ *  @param cols - Kernel columns (output).
+*/
+static void _ct_adafactor_shape(CTensor_Optimizer_s *layer, size_t i, size_t size,
+                        size_t *rows, size_t *cols)
+{
+    *rows = 0;
+    *cols = 0;
+
+    if (layer->segments == NULL)
+        return;
+
+    if (layer->segments[i].rows * layer->segments[i].cols > size)
+        return;
+
+    *rows = layer->segments[i].rows;
+    *cols = layer->segments[i].cols;
+
+    return;
+}
+
+void _ct_adafactor_opt(CTensor_Optimizer_s *layer, CTensor_s *grad, ctensor_data_t learning_rate)
+{
+    size_t i, n, offset, size, rows, cols, state_size;
+    ctensor_data_t *R, *C, *v, b2;
+    _adafactor_s *data;
+
+    data = (_adafactor_s *)layer->internal;
+
+    n = (layer->segments == NULL) ? 1 : layer->nsegments;
+
+    if (data->state == NULL) {
+        state_size = 0;
+
+        for (i = 0; i < n; i++) {
+            _ct_opt_segment(layer, grad, i, &offset, &size);
+            _ct_adafactor_shape(layer, i, size, &rows, &cols);
+
+            state_size += rows + cols + (size - rows * cols);
+        }
+
+        data->state = ctensor_new_tensor(state_size);
+        ctensor_tensor_zeros(data->state);
+    }
+
+    b2 = 1.00 - powf((ctensor_data_t)data->t++, -data->decay);
+
+    R = data->state->data;
+
+    for (i = 0; i < n; i++) {
+        _ct_opt_segment(layer, grad, i, &offset, &size);
+        _ct_adafactor_shape(layer, i, size, &rows, &cols);
+
+        C = &R[rows];
+        v = &C[cols];
+
+        _ct_adafactor(&grad->data[offset], size, rows, cols, R, C, v, b2, learning_rate);
+
+        R = &v[size - rows * cols];
+    }
+
+    return;
+}
+
+void _ct_adafactor_destroy(CTensor_Optimizer_s *layer)
+{
+    _adafactor_s *data;
+
+    data = (_adafactor_s *)layer->internal;
+
+    if (data->state != NULL)
+        ctensor_destroy_tensor(data->state);
+
+    free(data);
+
+    return;
+}
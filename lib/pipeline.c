@@ -0,0 +1,623 @@
+/*
+ *  Pipeline-parallel training for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctensor/ctensor.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+int _ct_numa_pin_share(size_t k, size_t n);
+int _ct_numa_bind(void *addr, size_t bytes, int node);
+
+/*
+ *  The layer list is split into stages of consecutive
+ *  layers, each run by its own thread. Examples (micro-batches
+ *  of one) flow forward through bounded queues between
+ *  stages, and their gradients flow back the same way.
+ *
+ *  Stages follow a 1F1B schedule, stage k (out of K) admits
+ *  at most K - k examples in flight, and always prefers a
+ *  backward pass over a forward one. As layers only hold the
+ *  activations of the last example they've seen, each stage
+ *  keeps the input of its in-flight examples, and recomputes
+ *  its forward pass before going backward when needed.
+ *
+ *  Parameters are only updated between batches, so training
+ *  is equivalent to the sequential one.
+*/
+
+struct _ct_pipeline_s;
+
+/*
+ *  Bounded FIFO of examples, 'capacity' slots of 'size'
+ *  elements each.
+*/
+typedef struct {
+    ctensor_data_t  *data;
+    size_t          *sample;
+    size_t          size;
+    size_t          capacity;
+    size_t          head;
+    size_t          count;
+} _ct_queue_s;
+
+typedef struct {
+    struct _ct_pipeline_s   *pipe;
+    size_t                  index;
+    CTensor_Layer_s         *first;
+    CTensor_Layer_s         *last;
+    // Stage boundaries, 'first->in' and 'last->loss_grad'
+    // while a batch is running (NULL 'g' for the last stage).
+    CTensor_s               *x;
+    CTensor_s               *g;
+    CTensor_s               *saved_in;
+    CTensor_s               *saved_loss_grad;
+    // Inputs of the in-flight examples (FIFO, 'limit' slots).
+    ctensor_data_t          *stash;
+    size_t                  *stash_sample;
+    size_t                  stash_head;
+    size_t                  inflight;
+    size_t                  limit;
+    // Example whose activations the layers currently hold.
+    size_t                  current;
+    // Offset of the last layer's block in the gradient vector.
+    size_t                  grad_off;
+    // Activations from the previous, and gradients from
+    // the next stage.
+    _ct_queue_s             fq;
+    _ct_queue_s             bq;
+    int                     stop;
+    pthread_mutex_t         lock;
+    pthread_cond_t          cond;
+    pthread_t               thread;
+} _ct_stage_s;
+
+typedef struct _ct_pipeline_s {
+    CTensor_Model_s         *model;
+    _ct_stage_s             *stages;
+    size_t                  nstages;
+    // Our own copy of the gradient vector's data pointer.
+    ctensor_data_t          *grad;
+    // Batch being processed.
+    CTensor_s               *y_train;
+    ctensor_data_t          loss;
+    // Examples done with their backward pass.
+    size_t                  done;
+    pthread_mutex_t         lock;
+    pthread_cond_t          cond;
+} _ct_pipeline_s;
+
+static int _ct_queue_init(_ct_queue_s *q, size_t size, size_t capacity)
+{
+    q->data = (ctensor_data_t *)malloc(size * capacity * sizeof(ctensor_data_t));
+    q->sample = (size_t *)malloc(capacity * sizeof(size_t));
+    q->size = size;
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+
+    return (q->data == NULL || q->sample == NULL) ? -1 : 0;
+}
+
+/*
+ *  Push an example into one of the stage's queues, waiting
+ *  for a free slot.
+*/
+static void _ct_stage_push(_ct_stage_s *st, _ct_queue_s *q, const ctensor_data_t *src,
+                    size_t sample)
+{
+    size_t slot;
+
+    pthread_mutex_lock(&st->lock);
+
+    while (q->count == q->capacity)
+        pthread_cond_wait(&st->cond, &st->lock);
+
+    slot = (q->head + q->count) % q->capacity;
+
+    memcpy(&q->data[slot * q->size], src, q->size * sizeof(ctensor_data_t));
+    q->sample[slot] = sample;
+    q->count++;
+
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+
+    return;
+}
+
+/*
+ *  Pop the oldest example of a queue (stage lock held).
+*/
+static size_t _ct_queue_pop(_ct_queue_s *q, ctensor_data_t *dst)
+{
+    size_t sample;
+
+    memcpy(dst, &q->data[q->head * q->size], q->size * sizeof(ctensor_data_t));
+    sample = q->sample[q->head];
+
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+
+    return sample;
+}
+
+/*
+ *  Forward pass through the stage's layers, for the
+ *  input in 'x'.
+*/
+static inline void _ct_stage_fwd(_ct_stage_s *st)
+{
+    CTensor_Layer_s *pos;
+
+    for (pos = st->first; ; pos = pos->next) {
+        pos->fwd(pos);
+
+        if (pos == st->last)
+            break;
+    }
+
+    return;
+}
+
+/*
+ *  Backward pass of the oldest in-flight example, its
+ *  gradient w.r.t. the stage's output is already in place.
+*/
+static void _ct_stage_bckp(_ct_stage_s *st)
+{
+    ctensor_data_t *grad;
+    CTensor_Layer_s *pos;
+    size_t slot, sample;
+    _ct_pipeline_s *pipe;
+
+    pipe = st->pipe;
+
+    slot = st->stash_head;
+    sample = st->stash_sample[slot];
+
+    // The layers have moved on to a later example,
+    // recompute this one's activations.
+    if (st->current != sample) {
+        memcpy(st->x->data, &st->stash[slot * st->x->size],
+                st->x->size * sizeof(ctensor_data_t));
+
+        _ct_stage_fwd(st);
+        st->current = sample;
+    }
+
+    grad = &pipe->grad[st->grad_off];
+
+    for (pos = st->last; ; pos = pos->prev) {
+        pos->bckp(pos);
+
+        // Stages own disjoint parts of the gradient vector.
+        if (pos->internal_grad != NULL) {
+            ctensor_vector_sum(pos->internal_grad->data, pos->internal_grad->size,
+                        grad, grad);
+
+            grad += pos->internal_grad->size;
+        }
+
+        if (pos == st->first)
+            break;
+    }
+
+    st->stash_head = (st->stash_head + 1) % st->limit;
+    st->inflight--;
+
+    if (st->index > 0) {
+        _ct_stage_push(&pipe->stages[st->index - 1], &pipe->stages[st->index - 1].bq,
+                    st->first->in_grad->data, sample);
+        return;
+    }
+
+    pthread_mutex_lock(&pipe->lock);
+    pipe->done++;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+
+    return;
+}
+
+/*
+ *  Forward pass of the newest in-flight example.
+*/
+static void _ct_stage_forward(_ct_stage_s *st)
+{
+    CTensor_Model_s *model;
+    size_t slot, sample;
+    _ct_pipeline_s *pipe;
+    CTensor_s y;
+
+    pipe = st->pipe;
+    model = pipe->model;
+
+    slot = (st->stash_head + st->inflight - 1) % st->limit;
+    sample = st->stash_sample[slot];
+
+    memcpy(st->x->data, &st->stash[slot * st->x->size],
+            st->x->size * sizeof(ctensor_data_t));
+
+    _ct_stage_fwd(st);
+    st->current = sample;
+
+    if (st->index + 1 < pipe->nstages) {
+        _ct_stage_push(&pipe->stages[st->index + 1], &pipe->stages[st->index + 1].fq,
+                    st->last->out->data, sample);
+        return;
+    }
+
+    // Last stage, the loss starts the backward pass right away.
+    y.size = model->lastl->out->size;
+    y.data = &pipe->y_train->data[sample * y.size];
+
+    pipe->loss += model->lossl->fwd(model->lossl, &y);
+    model->lossl->bckp(model->lossl, &y);
+
+    _ct_stage_bckp(st);
+
+    return;
+}
+
+/*
+ *  Place the stage's parameters, gradients and activations
+ *  (layer outputs and input gradients, its boundaries,
+ *  stashed inputs, and the queues it reads from) on its
+ *  node.
+*/
+static void _ct_stage_bind(_ct_stage_s *st, int node)
+{
+    CTensor_Layer_s *pos;
+
+    for (pos = st->first; ; pos = pos->next) {
+        if (pos->internal_params != NULL)
+            ctensor_tensor_bind(pos->internal_params, node);
+
+        if (pos->internal_grad != NULL)
+            ctensor_tensor_bind(pos->internal_grad, node);
+
+        ctensor_tensor_bind(pos->out, node);
+        ctensor_tensor_bind(pos->in_grad, node);
+
+        if (pos == st->last)
+            break;
+    }
+
+    ctensor_tensor_bind(st->x, node);
+    _ct_numa_bind(st->stash, st->limit * st->x->size * sizeof(ctensor_data_t), node);
+    _ct_numa_bind(st->fq.data, st->fq.capacity * st->fq.size * sizeof(ctensor_data_t), node);
+
+    // The last stage gets its gradient from the loss.
+    if (st->g != NULL) {
+        ctensor_tensor_bind(st->g, node);
+        _ct_numa_bind(st->bq.data, st->bq.capacity * st->bq.size * sizeof(ctensor_data_t),
+                    node);
+    }
+
+    return;
+}
+
+static void *_ct_stage_worker(void *arg)
+{
+    _ct_stage_s *st;
+    size_t slot;
+    int bwd, node;
+
+    st = (_ct_stage_s *)arg;
+
+    // Spread stages over nodes, keeping each stage's
+    // weights in its node's memory.
+    node = _ct_numa_pin_share(st->index, st->pipe->nstages);
+
+    if (node >= 0)
+        _ct_stage_bind(st, node);
+
+    for (;;) {
+        pthread_mutex_lock(&st->lock);
+
+        while (st->bq.count == 0 && (st->fq.count == 0 || st->inflight == st->limit)
+                    && !st->stop)
+            pthread_cond_wait(&st->cond, &st->lock);
+
+        if (st->bq.count != 0) {
+            _ct_queue_pop(&st->bq, st->g->data);
+            bwd = 1;
+        } else if (st->fq.count != 0 && st->inflight < st->limit) {
+            slot = (st->stash_head + st->inflight) % st->limit;
+            st->stash_sample[slot] = _ct_queue_pop(&st->fq, &st->stash[slot * st->x->size]);
+            st->inflight++;
+            bwd = 0;
+        } else {
+            pthread_mutex_unlock(&st->lock);
+            break;
+        }
+
+        // Free slots for the stages pushing to us.
+        pthread_cond_broadcast(&st->cond);
+        pthread_mutex_unlock(&st->lock);
+
+        if (bwd)
+            _ct_stage_bckp(st);
+        else
+            _ct_stage_forward(st);
+    }
+
+    return NULL;
+}
+
+/*
+ *  Cost of a layer, used to balance stages.
+*/
+static inline size_t _ct_layer_cost(CTensor_Layer_s *layer)
+{
+    if (layer->internal_params != NULL)
+        return layer->internal_params->size;
+
+    return layer->out->size;
+}
+
+/*
+ *  Split the layers into stages of (roughly) the same cost.
+*/
+static void _ct_pipeline_partition(_ct_pipeline_s *pipe)
+{
+    size_t total = 0, acc = 0, left = 0, k = 0;
+    CTensor_Layer_s *pos;
+
+    for (pos = pipe->model->startl->next; pos != NULL; pos = pos->next) {
+        total += _ct_layer_cost(pos);
+        left++;
+    }
+
+    pos = pipe->model->startl->next;
+
+    for (k = 0; k < pipe->nstages; k++) {
+        pipe->stages[k].first = pos;
+
+        for (;;) {
+            acc += _ct_layer_cost(pos);
+            left--;
+
+            // Leave at least one layer for each remaining stage.
+            if (left == pipe->nstages - k - 1)
+                break;
+
+            if (k + 1 < pipe->nstages &&
+                    acc * pipe->nstages >= total * (k + 1))
+                break;
+
+            pos = pos->next;
+        }
+
+        pipe->stages[k].last = pos;
+        pos = pos->next;
+    }
+
+    return;
+}
+
+/*
+ *  Free a pipeline, stopping its threads (if running).
+ *
+ *  @param pipe - Pipeline.
+*/
+void _ct_pipeline_free(_ct_pipeline_s *pipe)
+{
+    _ct_stage_s *st;
+    size_t k;
+
+    for (k = 0; k < pipe->nstages; k++) {
+        st = &pipe->stages[k];
+
+        pthread_mutex_lock(&st->lock);
+        st->stop = 1;
+        pthread_cond_broadcast(&st->cond);
+        pthread_mutex_unlock(&st->lock);
+    }
+
+    for (k = 0; k < pipe->nstages; k++) {
+        st = &pipe->stages[k];
+
+        if (st->thread != 0)
+            pthread_join(st->thread, NULL);
+
+        pthread_cond_destroy(&st->cond);
+        pthread_mutex_destroy(&st->lock);
+
+        if (st->x != NULL)
+            ctensor_destroy_tensor(st->x);
+
+        if (st->g != NULL)
+            ctensor_destroy_tensor(st->g);
+
+        free(st->stash);
+        free(st->stash_sample);
+        free(st->fq.data);
+        free(st->fq.sample);
+        free(st->bq.data);
+        free(st->bq.sample);
+    }
+
+    pthread_cond_destroy(&pipe->cond);
+    pthread_mutex_destroy(&pipe->lock);
+
+    free(pipe->stages);
+    free(pipe);
+
+    return;
+}
+
+/*
+ *  Split the model into stages, and start their threads.
+ *
+ *  @param model - Model (model->stages > 1).
+ *  @param grad - Gradient vector, where gradients are accumulated.
+ *
+ *  @return - Pipeline, NULL on failure.
+*/
+_ct_pipeline_s *_ct_pipeline_new(CTensor_Model_s *model, CTensor_s *grad)
+{
+    size_t k, n = 0, off = 0;
+    CTensor_Layer_s *pos;
+    _ct_pipeline_s *pipe;
+    _ct_stage_s *st;
+    int err = 0;
+
+    for (pos = model->startl->next; pos != NULL; pos = pos->next)
+        n++;
+
+    if (n == 0)
+        return NULL;
+
+    pipe = (_ct_pipeline_s *)malloc(sizeof(_ct_pipeline_s));
+
+    if (pipe == NULL)
+        return NULL;
+
+    pipe->model = model;
+    pipe->nstages = (model->stages < n) ? model->stages : n;
+    pipe->grad = grad->data;
+
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->cond, NULL);
+
+    pipe->stages = (_ct_stage_s *)calloc(pipe->nstages, sizeof(_ct_stage_s));
+
+    if (pipe->stages == NULL) {
+        pthread_cond_destroy(&pipe->cond);
+        pthread_mutex_destroy(&pipe->lock);
+        free(pipe);
+        return NULL;
+    }
+
+    _ct_pipeline_partition(pipe);
+
+    for (k = 0; k < pipe->nstages; k++) {
+        st = &pipe->stages[k];
+
+        st->pipe = pipe;
+        st->index = k;
+        st->limit = pipe->nstages - k;
+        st->current = (size_t)-1;
+
+        pthread_mutex_init(&st->lock, NULL);
+        pthread_cond_init(&st->cond, NULL);
+
+        st->x = ctensor_new_tensor(st->first->in->size);
+        st->stash = (ctensor_data_t *)malloc(st->limit * st->first->in->size *
+                        sizeof(ctensor_data_t));
+        st->stash_sample = (size_t *)malloc(st->limit * sizeof(size_t));
+
+        err |= (st->x == NULL || st->stash == NULL || st->stash_sample == NULL);
+        err |= _ct_queue_init(&st->fq, st->first->in->size, pipe->nstages);
+
+        if (k + 1 < pipe->nstages) {
+            st->g = ctensor_new_tensor(st->last->out->size);
+            err |= (st->g == NULL);
+            err |= _ct_queue_init(&st->bq, st->last->out->size, pipe->nstages);
+        }
+    }
+
+    // Gradient offsets, the vector goes from the last layer
+    // to the first.
+    for (k = pipe->nstages; k-- > 0; ) {
+        st = &pipe->stages[k];
+        st->grad_off = off;
+
+        for (pos = st->last; ; pos = pos->prev) {
+            if (pos->internal_grad != NULL)
+                off += pos->internal_grad->size;
+
+            if (pos == st->first)
+                break;
+        }
+    }
+
+    for (k = 0; k < pipe->nstages && !err; k++) {
+        st = &pipe->stages[k];
+        err |= pthread_create(&st->thread, NULL, _ct_stage_worker, (void *)st) != 0;
+    }
+
+    if (err) {
+        _ct_pipeline_free(pipe);
+        return NULL;
+    }
+
+    return pipe;
+}
+
+/*
+ *  Forward and backward pass over one batch, accumulating
+ *  the gradients into the gradient vector.
+ *
+ *  @param pipe - Pipeline.
+ *  @param x_train - Batch inputs.
+ *  @param y_train - Batch expected outputs.
+ *
+ *  @return - Average loss over the batch.
+*/
+ctensor_data_t _ct_pipeline_batch(_ct_pipeline_s *pipe, CTensor_s *x_train, CTensor_s *y_train)
+{
+    CTensor_Model_s *model;
+    _ct_stage_s *st;
+    size_t k, i, in_s;
+
+    model = pipe->model;
+    in_s = model->startl->out->size;
+
+    // Point each stage's boundary layers to the stage's own
+    // buffers, so that stages never touch each other's tensors.
+    for (k = 0; k < pipe->nstages; k++) {
+        st = &pipe->stages[k];
+
+        st->saved_in = st->first->in;
+        st->first->in = st->x;
+
+        if (st->g != NULL) {
+            st->saved_loss_grad = st->last->loss_grad;
+            st->last->loss_grad = st->g;
+        }
+
+        st->current = (size_t)-1;
+    }
+
+    pipe->y_train = y_train;
+    pipe->loss = 0.00;
+    pipe->done = 0;
+
+    for (i = 0; i < model->batch_size; i++)
+        _ct_stage_push(&pipe->stages[0], &pipe->stages[0].fq, &x_train->data[i * in_s], i);
+
+    pthread_mutex_lock(&pipe->lock);
+
+    while (pipe->done != model->batch_size)
+        pthread_cond_wait(&pipe->cond, &pipe->lock);
+
+    pthread_mutex_unlock(&pipe->lock);
+
+    for (k = 0; k < pipe->nstages; k++) {
+        st = &pipe->stages[k];
+
+        st->first->in = st->saved_in;
+
+        if (st->g != NULL)
+            st->last->loss_grad = st->saved_loss_grad;
+    }
+
+    return pipe->loss / (ctensor_data_t)model->batch_size;
+}
@@ -0,0 +1,249 @@
+/*
+ *  Model replicas for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctensor/ctensor.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ *  Replicas are copies of a model's layer list, with
+ *  activations and gradients of their own, so that several
+ *  threads can train the same model at once. The layers'
+ *  callbacks are shared, layers keeping state of their own
+ *  in 'internal' can't be replicated.
+*/
+
+void _ct_replica_free(CTensor_Model_s *rep, int share_params);
+
+/*
+ *  Set up a new optimizer like the model's one, with
+ *  fresh state.
+*/
+static CTensor_Optimizer_s *_ct_replica_optimizer(CTensor_Optimizer_s *orig)
+{
+    CTensor_Optimizer_s *opt;
+
+    opt = (CTensor_Optimizer_s *)malloc(sizeof(CTensor_Optimizer_s));
+
+    if (opt == NULL)
+        return NULL;
+
+    opt->segments = NULL;
+    opt->nsegments = 0;
+    opt->init = orig->init;
+
+    orig->init((void *)opt);
+
+    // Hyperparameters may have been set after init.
+    opt->momentum = orig->momentum;
+    opt->weight_decay = orig->weight_decay;
+    opt->eta = orig->eta;
+
+    return opt;
+}
+
+/*
+ *  Whether a model's layers can be replicated.
+*/
+int _ct_replica_supported(CTensor_Model_s *model)
+{
+    CTensor_Layer_s *pos;
+
+    // Nor can DAG models, yet.
+    if (model->graph != NULL)
+        return 0;
+
+    // Layer state would be shared among threads.
+    for (pos = model->startl; pos != NULL; pos = pos->next) {
+        if (pos->internal != NULL && !pos->shared_internal)
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ *  Replicate a model, 'rep' gets the same hyperparameters,
+ *  and a copy of its layer list and loss layer.
+ *
+ *  @param model - Model.
+ *  @param rep - Replica to fill.
+ *  @param share_params - Non-zero to share the model's
+ *  parameters, zero for a copy of them (and an optimizer
+ *  of its own).
+ *
+ *  @return - 0 on success, -1 on failure ('rep' is freed).
+*/
+int _ct_replica_new(CTensor_Model_s *model, CTensor_Model_s *rep, int share_params)
+{
+    CTensor_Layer_s *pos, *layer, *prev = NULL;
+    CTensor_Loss_s *loss;
+
+    *rep = *model;
+
+    rep->startl = NULL;
+    rep->lastl = NULL;
+    rep->lossl = NULL;
+    rep->optimizer = NULL;
+    rep->comm = NULL;
+
+    for (pos = model->startl; pos != NULL; pos = pos->next) {
+        layer = (CTensor_Layer_s *)malloc(sizeof(CTensor_Layer_s));
+
+        if (layer == NULL)
+            goto fail;
+
+        *layer = *pos;
+
+        layer->prev = prev;
+        layer->next = NULL;
+        layer->out = NULL;
+        layer->in_grad = NULL;
+        layer->internal_grad = NULL;
+
+        if (!share_params)
+            layer->internal_params = NULL;
+
+        if (prev == NULL)
+            rep->startl = layer;
+        else
+            prev->next = layer;
+
+        rep->lastl = layer;
+
+        // The input layer's output is a view of the batch.
+        if (prev == NULL) {
+            layer->out = (CTensor_s *)malloc(sizeof(CTensor_s));
+
+            if (layer->out != NULL) {
+                layer->out->data = NULL;
+                layer->out->size = pos->out->size;
+            }
+        } else {
+            layer->in = prev->out;
+            layer->out = ctensor_new_tensor(pos->out->size);
+        }
+
+        layer->in_grad = ctensor_new_tensor(pos->in_grad->size);
+
+        if (prev != NULL)
+            prev->loss_grad = layer->in_grad;
+
+        if (layer->out == NULL || layer->in_grad == NULL)
+            goto fail;
+
+        if (pos->internal_grad != NULL) {
+            layer->internal_grad = ctensor_new_tensor(pos->internal_grad->size);
+
+            if (layer->internal_grad == NULL)
+                goto fail;
+        }
+
+        if (pos->internal_params != NULL && !share_params) {
+            layer->internal_params = ctensor_new_tensor(pos->internal_params->size);
+
+            if (layer->internal_params == NULL)
+                goto fail;
+
+            memcpy(layer->internal_params->data, pos->internal_params->data,
+                        pos->internal_params->size * sizeof(ctensor_data_t));
+        }
+
+        prev = layer;
+    }
+
+    loss = (CTensor_Loss_s *)malloc(sizeof(CTensor_Loss_s));
+
+    if (loss == NULL)
+        goto fail;
+
+    *loss = *model->lossl;
+
+    rep->lossl = loss;
+
+    loss->prev = rep->lastl;
+    loss->in = rep->lastl->out;
+    loss->in_grad = ctensor_new_tensor(loss->in->size);
+
+    rep->lastl->loss_grad = loss->in_grad;
+
+    if (loss->in_grad == NULL)
+        goto fail;
+
+    if (!share_params && model->optimizer != NULL && model->optimizer->init != NULL) {
+        rep->optimizer = _ct_replica_optimizer(model->optimizer);
+
+        if (rep->optimizer == NULL)
+            goto fail;
+    }
+
+    return 0;
+
+fail:
+    _ct_replica_free(rep, share_params);
+
+    return -1;
+}
+
+void _ct_replica_free(CTensor_Model_s *rep, int share_params)
+{
+    CTensor_Layer_s *pos, *next;
+    CTensor_Optimizer_s *opt;
+
+    for (pos = rep->startl; pos != NULL; pos = next) {
+        next = pos->next;
+
+        if (pos->in_grad != NULL)
+            ctensor_destroy_tensor(pos->in_grad);
+
+        if (pos->internal_grad != NULL)
+            ctensor_destroy_tensor(pos->internal_grad);
+
+        if (pos->internal_params != NULL && !share_params)
+            ctensor_destroy_tensor(pos->internal_params);
+
+        if (pos->prev == NULL)
+            free(pos->out);
+        else if (pos->out != NULL)
+            ctensor_destroy_tensor(pos->out);
+
+        free(pos);
+    }
+
+    if (rep->lossl != NULL) {
+        if (rep->lossl->in_grad != NULL)
+            ctensor_destroy_tensor(rep->lossl->in_grad);
+
+        free(rep->lossl);
+    }
+
+    opt = rep->optimizer;
+
+    if (opt != NULL) {
+        opt->del((void *)opt);
+        free(opt->segments);
+        free(opt);
+    }
+
+    rep->startl = NULL;
+    rep->lastl = NULL;
+    rep->lossl = NULL;
+    rep->optimizer = NULL;
+
+    return;
+}
@@ -0,0 +1,716 @@
+/*
+ *  TCP ring communicator for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctensor/ctensor.h>
+
+#include <netinet/tcp.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <poll.h>
+
+// How long (in ms) we keep retrying to reach the next worker.
+#define CT_RING_TIMEOUT 30000
+// Largest ring supported by sparse compressors.
+#define CT_RING_MAX_WORLD 1024
+
+static void ctensor_ring_allreduce(CTensor_Comm_s *comm, CTensor_s *tensor);
+static void ctensor_ring_reduce_scatter(CTensor_Comm_s *comm, CTensor_s *tensor);
+static void ctensor_ring_allgather(CTensor_Comm_s *comm, CTensor_s *tensor);
+static void ctensor_ring_del(CTensor_Comm_s *comm);
+
+typedef struct {
+    // Connection to the next, and from the previous worker.
+    int             next_fd;
+    int             prev_fd;
+    // Receive buffer, for a single chunk.
+    char            *staging;
+    size_t          staging_size;
+    // Send buffer, for a single encoded chunk (or every
+    // worker's blob, with sparse compressors).
+    char            *encoded;
+    size_t          encoded_size;
+} _ring_s;
+
+/*
+ *  Where received elements go, they're added to (reduce)
+ *  or copied to 'dst' as soon as they arrive.
+*/
+typedef struct {
+    CTensor_Compressor_s    *comp;
+    ctensor_data_t          *dst;
+    // Bytes per element on the wire.
+    size_t                  elem_size;
+    int                     reduce;
+    // Elements consumed so far.
+    size_t                  done;
+} _ring_sink_s;
+
+/*
+ *  Open the listening socket for this worker.
+ *
+ *  @return - Socket, -1 on failure.
+*/
+static int _ct_ring_listen(uint16_t port)
+{
+    struct sockaddr_in addr;
+    int fd, one = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0)
+        return -1;
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ *  Connect to the next worker, retrying until it's
+ *  listening.
+ *
+ *  @return - Socket, -1 on failure.
+*/
+static int _ct_ring_connect(const char *host, uint16_t port)
+{
+    struct addrinfo hints, *res, *ai;
+    char service[8];
+    int fd, i;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    snprintf(service, sizeof(service), "%u", (unsigned)port);
+
+    if (getaddrinfo(host, service, &hints, &res) != 0)
+        return -1;
+
+    for (i = 0; i < CT_RING_TIMEOUT / 10; i++) {
+        for (ai = res; ai != NULL; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+            if (fd < 0)
+                continue;
+
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                freeaddrinfo(res);
+                return fd;
+            }
+
+            close(fd);
+        }
+
+        usleep(10000);
+    }
+
+    freeaddrinfo(res);
+
+    return -1;
+}
+
+/*
+ *  Tune a connected socket for bulk transfers.
+*/
+static void _ct_ring_setup(int fd)
+{
+    int one = 1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    return;
+}
+
+/*
+ *  Initialize a TCP ring communicator.
+ *
+ *  @param comm - Communicator to init.
+ *  @param hosts - Host of each worker (NULL for loopback).
+ *  @param port - Base port.
+ *  @param rank - This worker's index.
+ *  @param world_size - Number of workers.
+ *
+ *  @return - 0 on success, -1 on failure.
+*/
+int ctensor_tcp_comm(CTensor_Comm_s *comm, const char *const *hosts, uint16_t port,
+                    int rank, int world_size)
+{
+    int lfd, next, ret = -1;
+    const char *host;
+    _ring_s *data;
+
+    if (world_size < 1 || rank < 0 || rank >= world_size)
+        return -1;
+
+    data = (_ring_s *)malloc(sizeof(_ring_s));
+
+    if (data == NULL)
+        return -1;
+
+    data->next_fd = -1;
+    data->prev_fd = -1;
+    data->staging = NULL;
+    data->staging_size = 0;
+    data->encoded = NULL;
+    data->encoded_size = 0;
+
+    comm->allreduce = (CTensor_Comm_cb)ctensor_ring_allreduce;
+    comm->reduce_scatter = (CTensor_Comm_cb)ctensor_ring_reduce_scatter;
+    comm->allgather = (CTensor_Comm_cb)ctensor_ring_allgather;
+    comm->del = (CTensor_Layer_cb)ctensor_ring_del;
+    comm->rank = rank;
+    comm->world_size = world_size;
+    comm->error = 0;
+    comm->compressor = NULL;
+    comm->internal = (void *)data;
+
+    // A single worker, nothing to connect.
+    if (world_size == 1)
+        return 0;
+
+    lfd = _ct_ring_listen(port + rank);
+
+    if (lfd < 0)
+        goto out;
+
+    next = (rank + 1) % world_size;
+    host = (hosts == NULL) ? "127.0.0.1" : hosts[next];
+
+    // Connecting only needs the next worker to be listening,
+    // so everyone can connect first and accept afterwards.
+    data->next_fd = _ct_ring_connect(host, port + next);
+
+    if (data->next_fd < 0)
+        goto out;
+
+    data->prev_fd = accept(lfd, NULL, NULL);
+
+    if (data->prev_fd < 0)
+        goto out;
+
+    _ct_ring_setup(data->next_fd);
+    _ct_ring_setup(data->prev_fd);
+
+    ret = 0;
+
+out:
+    if (lfd >= 0)
+        close(lfd);
+
+    if (ret != 0)
+        ctensor_ring_del(comm);
+
+    return ret;
+}
+
+/*
+ *  Bounds of the k-th of the world_size chunks a
+ *  tensor is split into.
+*/
+static inline void _ct_ring_chunk(size_t n, int world, int k, size_t *lo, size_t *hi)
+{
+    k = ((k % world) + world) % world;
+
+    *lo = n * k / world;
+    *hi = n * (k + 1) / world;
+
+    return;
+}
+
+/*
+ *  Grow a buffer to at least 'need' bytes.
+ *
+ *  @return - 0 on success, -1 on failure.
+*/
+static int _ct_ring_reserve(char **buf, size_t *size, size_t need)
+{
+    if (*size >= need)
+        return 0;
+
+    free(*buf);
+
+    *buf = (char *)malloc(need);
+    *size = (*buf == NULL) ? 0 : need;
+
+    return (*buf == NULL) ? -1 : 0;
+}
+
+/*
+ *  Consume all the complete elements received so far.
+ *
+ *  @return - 0 on success, -1 if they couldn't be decoded.
+*/
+static int _ct_ring_consume(_ring_sink_s *sink, const char *rbuf, size_t recvd)
+{
+    const ctensor_data_t *in;
+    size_t avail, i;
+
+    avail = recvd / sink->elem_size;
+
+    if (avail == sink->done)
+        return 0;
+
+    if (sink->comp != NULL) {
+        if (!sink->reduce) {
+            memset(&sink->dst[sink->done], 0,
+                    (avail - sink->done) * sizeof(ctensor_data_t));
+        }
+
+        if (sink->comp->decode(sink->comp, &rbuf[sink->done * sink->elem_size],
+                    (avail - sink->done) * sink->elem_size, &sink->dst[sink->done],
+                    avail - sink->done) < 0)
+            return -1;
+
+        sink->done = avail;
+
+        return 0;
+    }
+
+    in = (const ctensor_data_t *)rbuf;
+
+    for (i = sink->done; i < avail; i++) {
+        if (sink->reduce)
+            sink->dst[i] += in[i];
+        else
+            sink->dst[i] = in[i];
+    }
+
+    sink->done = avail;
+
+    return 0;
+}
+
+/*
+ *  Send bytes to the next worker, while receiving from the
+ *  previous worker (full-duplex, so that both links of the
+ *  ring are busy at the same time).
+ *
+ *  If given a sink, received elements are consumed as soon
+ *  as they arrive, overlapping the reduction with the
+ *  transfer.
+ *
+ *  @param data - Ring state.
+ *  @param sbuf - Bytes to send.
+ *  @param send_bytes - Number of bytes to send.
+ *  @param rbuf - Receive buffer.
+ *  @param recv_bytes - Number of bytes to receive.
+ *  @param sink - Consumer of the received elements, or NULL.
+ *
+ *  @return - 0 on success, -1 on failure.
+*/
+static int _ct_ring_sendrecv(_ring_s *data, const char *sbuf, size_t send_bytes,
+                    char *rbuf, size_t recv_bytes, _ring_sink_s *sink)
+{
+    size_t sent = 0, recvd = 0;
+    struct pollfd fds[2];
+    ssize_t r;
+
+    while (sent < send_bytes || recvd < recv_bytes) {
+        fds[0].fd = (sent < send_bytes) ? data->next_fd : -1;
+        fds[0].events = POLLOUT;
+        fds[1].fd = (recvd < recv_bytes) ? data->prev_fd : -1;
+        fds[1].events = POLLIN;
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL))
+            return -1;
+
+        if (fds[0].revents & POLLOUT) {
+            r = send(data->next_fd, &sbuf[sent], send_bytes - sent, MSG_NOSIGNAL);
+
+            if (r < 0 && errno != EAGAIN && errno != EINTR)
+                return -1;
+
+            if (r > 0)
+                sent += r;
+        }
+
+        if (fds[1].revents & (POLLIN | POLLERR | POLLHUP)) {
+            r = recv(data->prev_fd, &rbuf[recvd], recv_bytes - recvd, 0);
+
+            if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR))
+                return -1;
+
+            if (r > 0)
+                recvd += r;
+
+            if (sink != NULL && _ct_ring_consume(sink, rbuf, recvd) < 0)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ *  Send chunk [slo, shi) of the tensor while receiving
+ *  chunk [rlo, rhi), encoding it first if compressing.
+ *
+ *  @return - 0 on success, -1 on failure.
+*/
+static int _ct_ring_step(_ring_s *data, CTensor_Compressor_s *comp, ctensor_data_t *x,
+                    size_t slo, size_t shi, size_t rlo, size_t rhi, int reduce)
+{
+    _ring_sink_s sink;
+    const char *sbuf;
+
+    sink.comp = comp;
+    sink.dst = &x[rlo];
+    sink.elem_size = (comp == NULL) ? sizeof(ctensor_data_t) : comp->elem_size;
+    sink.reduce = reduce;
+    sink.done = 0;
+
+    sbuf = (const char *)&x[slo];
+
+    if (comp != NULL) {
+        comp->encode(comp, &x[slo], shi - slo, data->encoded);
+        sbuf = data->encoded;
+    }
+
+    return _ct_ring_sendrecv(data, sbuf, (shi - slo) * sink.elem_size,
+                    data->staging, (rhi - rlo) * sink.elem_size, &sink);
+}
+
+/*
+ *  Elementwise compressor in use, if any (sparse ones
+ *  only apply to full allreduces).
+*/
+static inline CTensor_Compressor_s *_ct_ring_dense_comp(CTensor_Comm_s *comm)
+{
+    if (comm->compressor == NULL || comm->compressor->elem_size == 0)
+        return NULL;
+
+    return comm->compressor;
+}
+
+/*
+ *  Make room for one (encoded) chunk of an n elements tensor.
+ *
+ *  @return - 0 on success, -1 on failure.
+*/
+static int _ct_ring_reserve_chunk(_ring_s *data, CTensor_Compressor_s *comp, size_t n, int w)
+{
+    size_t max, elem_size;
+
+    max = (n + w - 1) / w;
+    elem_size = (comp == NULL) ? sizeof(ctensor_data_t) : comp->elem_size;
+
+    if (_ct_ring_reserve(&data->staging, &data->staging_size, max * elem_size) < 0)
+        return -1;
+
+    if (comp != NULL && _ct_ring_reserve(&data->encoded, &data->encoded_size,
+                    max * elem_size) < 0)
+        return -1;
+
+    return 0;
+}
+
+/*
+ *  Reduce-scatter, at every step each worker sends one
+ *  chunk to the next worker and accumulates the one it
+ *  receives, after world_size - 1 steps worker r holds
+ *  the complete sum of chunk r, which gets averaged.
+ *
+ *  @param data - Ring state.
+ *  @param comm - Communicator.
+ *  @param tensor - Tensor to be reduced, in place.
+ *
+ *  @return - 0 on success, -1 on failure.
+*/
+static int _ct_ring_reduce_scatter(_ring_s *data, CTensor_Comm_s *comm, CTensor_s *tensor)
+{
+    CTensor_Compressor_s *comp;
+    size_t n, slo, shi, rlo, rhi;
+    int r, w, s;
+
+    comp = _ct_ring_dense_comp(comm);
+
+    r = comm->rank;
+    w = comm->world_size;
+    n = tensor->size;
+
+    if (_ct_ring_reserve_chunk(data, comp, n, w) < 0)
+        return -1;
+
+    // Send chunk r - s - 1, receive chunk r - s - 2.
+    for (s = 0; s < w - 1; s++) {
+        _ct_ring_chunk(n, w, r - s - 1, &slo, &shi);
+        _ct_ring_chunk(n, w, r - s - 2, &rlo, &rhi);
+
+        if (_ct_ring_step(data, comp, tensor->data, slo, shi, rlo, rhi, 1) < 0)
+            return -1;
+    }
+
+    // We now own the sum of chunk r, average it.
+    _ct_ring_chunk(n, w, r, &slo, &shi);
+    ctensor_sv_mult(&tensor->data[slo], shi - slo,
+                1.00 / (ctensor_data_t)w, &tensor->data[slo]);
+
+    return 0;
+}
+
+/*
+ *  All-gather, circulates every worker's chunk r around
+ *  the ring.
+ *
+ *  @param data - Ring state.
+ *  @param comm - Communicator.
+ *  @param comp - Elementwise compressor, NULL to send fp32.
+ *  @param tensor - Tensor to be gathered, in place.
+ *
+ *  @return - 0 on success, -1 on failure.
+*/
+static int _ct_ring_allgather(_ring_s *data, CTensor_Comm_s *comm,
+                    CTensor_Compressor_s *comp, CTensor_s *tensor)
+{
+    size_t n, slo, shi, rlo, rhi;
+    int r, w, s;
+
+    r = comm->rank;
+    w = comm->world_size;
+    n = tensor->size;
+
+    if (_ct_ring_reserve_chunk(data, comp, n, w) < 0)
+        return -1;
+
+    // Everyone else gets our chunk through the compressor,
+    // round it the same way to keep replicas identical.
+    if (comp != NULL) {
+        _ct_ring_chunk(n, w, r, &slo, &shi);
+
+        comp->encode(comp, &tensor->data[slo], shi - slo, data->encoded);
+        memset(&tensor->data[slo], 0, (shi - slo) * sizeof(ctensor_data_t));
+        if (comp->decode(comp, data->encoded, (shi - slo) * comp->elem_size,
+                    &tensor->data[slo], shi - slo) < 0)
+            return -1;
+    }
+
+    // Send chunk r - s, receive chunk r - s - 1.
+    for (s = 0; s < w - 1; s++) {
+        _ct_ring_chunk(n, w, r - s, &slo, &shi);
+        _ct_ring_chunk(n, w, r - s - 1, &rlo, &rhi);
+
+        if (_ct_ring_step(data, comp, tensor->data, slo, shi, rlo, rhi, 0) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ *  Average a tensor across all workers, with a sparse
+ *  compressor.
+ *
+ *  Sparse blobs can't be summed on the way (the sum of two
+ *  top-k sets isn't one), so instead every worker's blob is
+ *  circulated around the ring (all-gather), and decoded by
+ *  everyone in rank order, so all replicas add the values
+ *  in the same order and stay identical.
+ *
+ *  @param data - Ring state.
+ *  @param comm - Communicator.
+ *  @param tensor - Tensor to be averaged, in place.
+ *
+ *  @return - 0 on success, -1 on failure.
+*/
+static int _ct_ring_sparse(_ring_s *data, CTensor_Comm_s *comm, CTensor_s *tensor)
+{
+    size_t bound, sizes[CT_RING_MAX_WORLD];
+    CTensor_Compressor_s *comp;
+    int r, w, s, k, ks, kr;
+    char *blobs;
+
+    comp = comm->compressor;
+
+    r = comm->rank;
+    w = comm->world_size;
+
+    if (w > CT_RING_MAX_WORLD)
+        return -1;
+
+    bound = comp->encode(comp, tensor->data, tensor->size, NULL);
+    // Keep every blob aligned.
+    bound = (bound + 7) & ~(size_t)7;
+
+    if (_ct_ring_reserve(&data->encoded, &data->encoded_size, (size_t)w * bound) < 0)
+        return -1;
+
+    blobs = data->encoded;
+
+    sizes[r] = comp->encode(comp, tensor->data, tensor->size, &blobs[(size_t)r * bound]);
+
+    // All-gather, send blob r - s, receive blob r - s - 1.
+    for (s = 0; s < w - 1; s++) {
+        ks = ((r - s) % w + w) % w;
+        kr = ((r - s - 1) % w + w) % w;
+
+        if (_ct_ring_sendrecv(data, (const char *)&sizes[ks], sizeof(size_t),
+                    (char *)&sizes[kr], sizeof(size_t), NULL) < 0)
+            return -1;
+
+        if (sizes[kr] > bound)
+            return -1;
+
+        if (_ct_ring_sendrecv(data, &blobs[(size_t)ks * bound], sizes[ks],
+                    &blobs[(size_t)kr * bound], sizes[kr], NULL) < 0)
+            return -1;
+    }
+
+    ctensor_tensor_zeros(tensor);
+
+    // A peer's blob may not match our tensor (e.g. a
+    // different model), don't trust its indices.
+    for (k = 0; k < w; k++) {
+        if (comp->decode(comp, &blobs[(size_t)k * bound], sizes[k], tensor->data,
+                    tensor->size) < 0)
+            return -1;
+    }
+
+    ctensor_sv_mult(tensor->data, tensor->size,
+                1.00 / (ctensor_data_t)w, tensor->data);
+
+    return 0;
+}
+
+/*
+ *  Average a tensor across all workers, with a
+ *  ring-allreduce.
+ *
+ *  The tensor is split into world_size chunks, reduce-scattered
+ *  and then all-gathered. Every worker sends (and receives)
+ *  2 * (world_size - 1) / world_size of the tensor, independently
+ *  of the number of workers.
+ *
+ *  With an elementwise compressor, every chunk is encoded
+ *  before being sent.
+ *
+ *  @param comm - Communicator.
+ *  @param tensor - Tensor to be averaged, in place.
+*/
+static void ctensor_ring_allreduce(CTensor_Comm_s *comm, CTensor_s *tensor)
+{
+    _ring_s *data;
+    int ret;
+
+    data = (_ring_s *)comm->internal;
+
+    if (comm->world_size == 1 || comm->error)
+        return;
+
+    if (comm->compressor != NULL && comm->compressor->elem_size == 0)
+        ret = _ct_ring_sparse(data, comm, tensor);
+    else if ((ret = _ct_ring_reduce_scatter(data, comm, tensor)) == 0)
+        ret = _ct_ring_allgather(data, comm, _ct_ring_dense_comp(comm), tensor);
+
+    if (ret < 0)
+        comm->error = 1;
+
+    return;
+}
+
+/*
+ *  Average this worker's shard of a tensor across all
+ *  workers.
+ *
+ *  @param comm - Communicator.
+ *  @param tensor - Tensor to be reduced, in place.
+*/
+static void ctensor_ring_reduce_scatter(CTensor_Comm_s *comm, CTensor_s *tensor)
+{
+    if (comm->world_size == 1 || comm->error)
+        return;
+
+    if (_ct_ring_reduce_scatter((_ring_s *)comm->internal, comm, tensor) < 0)
+        comm->error = 1;
+
+    return;
+}
+
+/*
+ *  Gather every worker's shard of a tensor.
+ *
+ *  These are parameter updates (see shard_optimizer), not
+ *  gradients, they're sent uncompressed: rounding them
+ *  would flush small updates to zero.
+ *
+ *  @param comm - Communicator.
+ *  @param tensor - Tensor to be gathered, in place.
+*/
+static void ctensor_ring_allgather(CTensor_Comm_s *comm, CTensor_s *tensor)
+{
+    if (comm->world_size == 1 || comm->error)
+        return;
+
+    if (_ct_ring_allgather((_ring_s *)comm->internal, comm, NULL, tensor) < 0)
+        comm->error = 1;
+
+    return;
+}
+
+static void ctensor_ring_del(CTensor_Comm_s *comm)
+{
+    _ring_s *data;
+
+    data = (_ring_s *)comm->internal;
+
+    if (data == NULL)
+        return;
+
+    if (data->next_fd >= 0)
+        close(data->next_fd);
+
+    if (data->prev_fd >= 0)
+        close(data->prev_fd);
+
+    free(data->staging);
+    free(data->encoded);
+    free(data);
+
+    comm->internal = NULL;
+
+    if (comm->compressor != NULL) {
+        comm->compressor->del((void *)comm->compressor);
+        free(comm->compressor);
+        comm->compressor = NULL;
+    }
+
+    return;
+}
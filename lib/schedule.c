@@ -0,0 +1,201 @@
+/*
+ *  Learning rate schedules for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctensor/ctensor.h>
+
+#include <math.h>
+
+static ctensor_data_t ctensor_lr_warmup_fn(CTensor_Scheduler_s *sched, size_t step,
+                    size_t total, ctensor_data_t lr);
+static ctensor_data_t ctensor_lr_step_fn(CTensor_Scheduler_s *sched, size_t step,
+                    size_t total, ctensor_data_t lr);
+static ctensor_data_t ctensor_lr_cosine_fn(CTensor_Scheduler_s *sched, size_t step,
+                    size_t total, ctensor_data_t lr);
+static ctensor_data_t ctensor_lr_one_cycle_fn(CTensor_Scheduler_s *sched, size_t step,
+                    size_t total, ctensor_data_t lr);
+
+/*
+ *  Fill the scheduler with defaults shared by
+ *  all schedules.
+ *
+ *  @param sched - Scheduler.
+ *  @param cb - Schedule callback.
+*/
+static void _ct_sched_defaults(CTensor_Scheduler_s *sched, CTensor_Schedule_cb cb)
+{
+    sched->lr = cb;
+    sched->warmup_steps = 0;
+    sched->total_steps = 0;
+    sched->step_size = 1000;
+    sched->gamma = 0.1;
+    sched->min_lr = 0.00;
+    sched->pct_start = 0.3;
+    sched->div_factor = 25.0;
+
+    return;
+}
+
+/*
+ *  Learning rate to use at the given optimization step.
+ *
+ *  @param model - Model.
+ *  @param step - Number of optimization steps done so far.
+ *  @param total - Steps of this training run, used unless
+ *  the scheduler sets 'total_steps'.
+*/
+ctensor_data_t _ct_sched_lr(CTensor_Model_s *model, size_t step, size_t total)
+{
+    CTensor_Scheduler_s *sched;
+
+    sched = model->scheduler;
+
+    if (sched == NULL)
+        return model->learning_rate;
+
+    if (sched->total_steps != 0)
+        total = sched->total_steps;
+
+    return sched->lr(sched, step, total, model->learning_rate);
+}
+
+/*
+ *  Cosine interpolation from 'hi' (at 0) down to 'lo' (at 'n').
+ *
+ *  @param step - Current step.
+ *  @param n - Number of steps to anneal over.
+ *  @param hi - Initial value.
+ *  @param lo - Final value.
+*/
+static inline ctensor_data_t _ct_cosine(size_t step, size_t n, ctensor_data_t hi, ctensor_data_t lo)
+{
+    ctensor_data_t p;
+
+    if (n == 0 || step >= n)
+        return lo;
+
+    p = (ctensor_data_t)step / (ctensor_data_t)n;
+
+    return lo + 0.5 * (hi - lo) * (1.0 + cosf(M_PI * p));
+}
+
+/*
+ *  Linear warmup, then a constant learning rate.
+ *
+ *  @param sched - Scheduler to init.
+*/
+void ctensor_lr_warmup(CTensor_Scheduler_s *sched)
+{
+    _ct_sched_defaults(sched, ctensor_lr_warmup_fn);
+    sched->warmup_steps = 100;
+
+    return;
+}
+
+/*
+ *  Step decay, multiplies the learning rate by 'gamma'
+ *  every 'step_size' steps.
+ *
+ *  @param sched - Scheduler to init.
+*/
+void ctensor_lr_step_decay(CTensor_Scheduler_s *sched)
+{
+    _ct_sched_defaults(sched, ctensor_lr_step_fn);
+
+    return;
+}
+
+/*
+ *  Cosine annealing down to 'min_lr'.
+ *
+ *  @param sched - Scheduler to init.
+*/
+void ctensor_lr_cosine(CTensor_Scheduler_s *sched)
+{
+    _ct_sched_defaults(sched, ctensor_lr_cosine_fn);
+
+    return;
+}
+
+/*
+ *  One-cycle policy.
+ *
+ *  @param sched - Scheduler to init.
+*/
+void ctensor_lr_one_cycle(CTensor_Scheduler_s *sched)
+{
+    _ct_sched_defaults(sched, ctensor_lr_one_cycle_fn);
+
+    return;
+}
+
+static ctensor_data_t ctensor_lr_warmup_fn(CTensor_Scheduler_s *sched, size_t step,
+                    size_t total, ctensor_data_t lr)
+{
+    if (step < sched->warmup_steps)
+        return lr * (ctensor_data_t)(step + 1) / (ctensor_data_t)sched->warmup_steps;
+
+    return lr;
+}
+
+static ctensor_data_t ctensor_lr_step_fn(CTensor_Scheduler_s *sched, size_t step,
+                    size_t total, ctensor_data_t lr)
+{
+    if (step < sched->warmup_steps)
+        return ctensor_lr_warmup_fn(sched, step, total, lr);
+
+    step -= sched->warmup_steps;
+
+    if (sched->step_size == 0)
+        return lr;
+
+    return lr * powf(sched->gamma, (ctensor_data_t)(step / sched->step_size));
+}
+
+static ctensor_data_t ctensor_lr_cosine_fn(CTensor_Scheduler_s *sched, size_t step,
+                    size_t total, ctensor_data_t lr)
+{
+    size_t n;
+
+    if (step < sched->warmup_steps)
+        return ctensor_lr_warmup_fn(sched, step, total, lr);
+
+    step -= sched->warmup_steps;
+
+    n = 0;
+
+    if (total > sched->warmup_steps)
+        n = total - sched->warmup_steps;
+
+    return _ct_cosine(step, n, lr, sched->min_lr);
+}
+
+static ctensor_data_t ctensor_lr_one_cycle_fn(CTensor_Scheduler_s *sched, size_t step,
+                    size_t total, ctensor_data_t lr)
+{
+    ctensor_data_t start;
+    size_t rise;
+
+    // One-cycle has its own warmup phase, starting from
+    // lr / div_factor instead of 0.
+    start = lr / sched->div_factor;
+    rise = (size_t)(sched->pct_start * (ctensor_data_t)total);
+
+    if (step < rise)
+        return start + (lr - start) * (ctensor_data_t)step / (ctensor_data_t)rise;
+
+    return _ct_cosine(step - rise, total - rise, lr, sched->min_lr);
+}
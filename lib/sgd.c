@@ -0,0 +1,92 @@
+/*
+ *  SGD (with Momentum/Nesterov) Optimization for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctensor/ctensor.h>
+
+/*
+ *  All kernels below are fused into a single pass over
+ *  the gradient (and state) vectors, with no aliasing
+ *  between them, so that the compiler is free to
+ *  vectorize them.
+*/
+
+/*
+ *  Stochastic Gradient Descent.
+ *
+ *  @param grad - evaluated gradient vector.
+ *  @param grad_size - number of elements in gradient vector.
+ *  @param lr - learning rate.
+*/
+void _ct_sgd(float *restrict grad, size_t grad_size, float lr)
+{
+    size_t i;
+
+    for (i = 0; i < grad_size; i++)
+        grad[i] *= -lr;
+
+    return;
+}
+
+/*
+ *  Stochastic Gradient Descent with (heavy-ball) Momentum.
+ *
+ *  @param grad - evaluated gradient vector.
+ *  @param grad_size - number of elements in gradient vector.
+ *  @param v - velocity vector.
+ *  @param mu - momentum.
+ *  @param lr - learning rate.
+*/
+void _ct_momentum(float *restrict grad, size_t grad_size, float *restrict v, float mu, float lr)
+{
+    float vi;
+    size_t i;
+
+    for (i = 0; i < grad_size; i++) {
+        vi = mu * v[i] + grad[i];
+
+        v[i] = vi;
+        grad[i] = -lr * vi;
+    }
+
+    return;
+}
+
+/*
+ *  Stochastic Gradient Descent with Nesterov Momentum.
+ *
+ *  @param grad - evaluated gradient vector.
+ *  @param grad_size - number of elements in gradient vector.
+ *  @param v - velocity vector.
+ *  @param mu - momentum.
+ *  @param lr - learning rate.
+*/
+void _ct_nesterov(float *restrict grad, size_t grad_size, float *restrict v, float mu, float lr)
+{
+    float vi, g;
+    size_t i;
+
+    for (i = 0; i < grad_size; i++) {
+        g = grad[i];
+        vi = mu * v[i] + g;
+
+        v[i] = vi;
+        // Look-ahead step, g + mu * v.
+        grad[i] = -lr * (g + mu * vi);
+    }
+
+    return;
+}
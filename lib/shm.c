@@ -0,0 +1,464 @@
+/*
+ *  Shared-memory communicator for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctensor/ctensor.h>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+
+// Number of elements reduced at once, per worker slot.
+#define CT_SHM_CHUNK    (1 << 20)
+#define CT_SHM_MAGIC    0x43544e53
+// Spins before sleeping on the futex.
+#define CT_SHM_SPINS    4096
+// How long (in ms) workers wait for rank 0 to create the segment.
+#define CT_SHM_TIMEOUT  30000
+
+static void ctensor_shm_allreduce(CTensor_Comm_s *comm, CTensor_s *tensor);
+static void ctensor_shm_reduce_scatter(CTensor_Comm_s *comm, CTensor_s *tensor);
+static void ctensor_shm_allgather(CTensor_Comm_s *comm, CTensor_s *tensor);
+static void ctensor_shm_del(CTensor_Comm_s *comm);
+
+/*
+ *  Header at the start of the shared segment, followed
+ *  by world_size + 1 slots of CT_SHM_CHUNK elements (one
+ *  per worker, and one for the reduced result).
+*/
+typedef struct {
+    _Atomic uint32_t    ready;
+    // Barrier, arrivals and generation (futex word).
+    _Atomic uint32_t    count;
+    _Atomic uint32_t    gen;
+    uint32_t            world_size;
+    // Rank 0's process, segments outliving it are stale.
+    pid_t               owner;
+} _shm_hdr_s;
+
+typedef struct {
+    _shm_hdr_s          *hdr;
+    size_t              map_size;
+    ctensor_data_t      *slots;
+} _shm_s;
+
+/*
+ *  Offset of the first slot, keeps slots cache line aligned.
+*/
+static inline size_t _ct_shm_slots_offset(void)
+{
+    return (sizeof(_shm_hdr_s) + 63) & ~(size_t)63;
+}
+
+static inline long _ct_futex(_Atomic uint32_t *addr, int op, uint32_t val)
+{
+    // Not FUTEX_PRIVATE_FLAG, the word is shared between processes.
+    return syscall(SYS_futex, (uint32_t *)addr, op, val, NULL, NULL, 0);
+}
+
+/*
+ *  Sense-reversing barrier between all workers.
+ *
+ *  @param hdr - Shared header.
+*/
+static void _ct_shm_barrier(_shm_hdr_s *hdr)
+{
+    uint32_t gen;
+    int i;
+
+    gen = atomic_load_explicit(&hdr->gen, memory_order_acquire);
+
+    // Last one in, release everyone.
+    if (atomic_fetch_add(&hdr->count, 1) == hdr->world_size - 1) {
+        atomic_store(&hdr->count, 0);
+        atomic_fetch_add(&hdr->gen, 1);
+
+        _ct_futex(&hdr->gen, FUTEX_WAKE, INT_MAX);
+
+        return;
+    }
+
+    for (i = 0; i < CT_SHM_SPINS; i++) {
+        if (atomic_load_explicit(&hdr->gen, memory_order_acquire) != gen)
+            return;
+    }
+
+    while (atomic_load_explicit(&hdr->gen, memory_order_acquire) == gen)
+        _ct_futex(&hdr->gen, FUTEX_WAIT, gen);
+
+    return;
+}
+
+/*
+ *  Open (rank 0 creates) the shared segment.
+ *
+ *  @return - File descriptor, -1 on failure.
+*/
+static int _ct_shm_open(const char *name, int rank, size_t size)
+{
+    struct stat st;
+    int fd, i;
+
+    if (rank == 0) {
+        // Remove any leftovers of a previous (crashed) job.
+        shm_unlink(name);
+
+        fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+
+        if (fd < 0)
+            return -1;
+
+        if (ftruncate(fd, size) < 0) {
+            close(fd);
+            shm_unlink(name);
+            return -1;
+        }
+
+        return fd;
+    }
+
+    // Wait for rank 0 to create (and size) the segment.
+    for (i = 0; i < CT_SHM_TIMEOUT; i++) {
+        fd = shm_open(name, O_RDWR, 0600);
+
+        if (fd >= 0) {
+            if (fstat(fd, &st) == 0 && (size_t)st.st_size == size)
+                return fd;
+
+            close(fd);
+        } else if (errno != ENOENT) {
+            return -1;
+        }
+
+        usleep(1000);
+    }
+
+    return -1;
+}
+
+/*
+ *  Whether a segment was left behind by a crashed job,
+ *  one whose rank 0 is gone.
+*/
+static int _ct_shm_stale(_shm_hdr_s *hdr)
+{
+    return kill(hdr->owner, 0) < 0 && errno == ESRCH;
+}
+
+/*
+ *  Initialize a shared-memory communicator.
+ *
+ *  @param comm - Communicator to init.
+ *  @param name - Name of the POSIX shared-memory object.
+ *  @param rank - This process' index.
+ *  @param world_size - Number of processes.
+ *
+ *  @return - 0 on success, -1 on failure.
+*/
+int ctensor_shm_comm(CTensor_Comm_s *comm, const char *name, int rank, int world_size)
+{
+    size_t map_size;
+    _shm_hdr_s *hdr;
+    _shm_s *data;
+    void *map;
+    int fd, i = 0;
+
+    if (world_size < 1 || rank < 0 || rank >= world_size)
+        return -1;
+
+    map_size = _ct_shm_slots_offset() +
+            (size_t)(world_size + 1) * CT_SHM_CHUNK * sizeof(ctensor_data_t);
+
+    for (;;) {
+        fd = _ct_shm_open(name, rank, map_size);
+
+        if (fd < 0)
+            return -1;
+
+        map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (map == MAP_FAILED)
+            return -1;
+
+        hdr = (_shm_hdr_s *)map;
+
+        if (rank == 0) {
+            hdr->world_size = world_size;
+            hdr->owner = getpid();
+            atomic_store(&hdr->count, 0);
+            atomic_store(&hdr->gen, 0);
+            atomic_store(&hdr->ready, CT_SHM_MAGIC);
+            break;
+        }
+
+        for (; i < CT_SHM_TIMEOUT; i++) {
+            if (atomic_load(&hdr->ready) == CT_SHM_MAGIC)
+                break;
+
+            usleep(1000);
+        }
+
+        // A leftover segment can be ready already, wait for
+        // rank 0 to replace it.
+        if (i < CT_SHM_TIMEOUT && _ct_shm_stale(hdr)) {
+            munmap(map, map_size);
+            usleep(1000);
+            i++;
+            continue;
+        }
+
+        if (i == CT_SHM_TIMEOUT || hdr->world_size != (uint32_t)world_size) {
+            munmap(map, map_size);
+            return -1;
+        }
+
+        break;
+    }
+
+    data = (_shm_s *)malloc(sizeof(_shm_s));
+
+    if (data == NULL) {
+        munmap(map, map_size);
+        return -1;
+    }
+
+    data->hdr = hdr;
+    data->map_size = map_size;
+    data->slots = (ctensor_data_t *)((char *)map + _ct_shm_slots_offset());
+
+    comm->allreduce = (CTensor_Comm_cb)ctensor_shm_allreduce;
+    comm->reduce_scatter = (CTensor_Comm_cb)ctensor_shm_reduce_scatter;
+    comm->allgather = (CTensor_Comm_cb)ctensor_shm_allgather;
+    comm->del = (CTensor_Layer_cb)ctensor_shm_del;
+    comm->rank = rank;
+    comm->world_size = world_size;
+    comm->error = 0;
+    comm->compressor = NULL;
+    comm->internal = (void *)data;
+
+    // Once everyone has the segment mapped, it no longer
+    // needs a name; it'll go away with the last mapping.
+    _ct_shm_barrier(hdr);
+
+    if (rank == 0)
+        shm_unlink(name);
+
+    return 0;
+}
+
+/*
+ *  Average a tensor across all workers.
+ *
+ *  The tensor is processed in chunks, every worker copies
+ *  its chunk into its slot, then reduces its own share of
+ *  the chunk across all slots into the result slot, which
+ *  everyone copies back.
+ *
+ *  @param comm - Communicator.
+ *  @param tensor - Tensor to be averaged, in place.
+*/
+static void ctensor_shm_allreduce(CTensor_Comm_s *comm, CTensor_s *tensor)
+{
+    ctensor_data_t *slots, *result, sum, inv;
+    size_t off, len, lo, hi, i;
+    _shm_s *data;
+    int w, world;
+
+    data = (_shm_s *)comm->internal;
+
+    world = comm->world_size;
+    slots = data->slots;
+    result = &slots[(size_t)world * CT_SHM_CHUNK];
+
+    inv = 1.00 / (ctensor_data_t)world;
+
+    for (off = 0; off < tensor->size; off += len) {
+        len = tensor->size - off;
+
+        if (len > CT_SHM_CHUNK)
+            len = CT_SHM_CHUNK;
+
+        memcpy(&slots[(size_t)comm->rank * CT_SHM_CHUNK], &tensor->data[off],
+                len * sizeof(ctensor_data_t));
+
+        _ct_shm_barrier(data->hdr);
+
+        // Our share of the chunk.
+        lo = len * comm->rank / world;
+        hi = len * (comm->rank + 1) / world;
+
+        for (i = lo; i < hi; i++) {
+            sum = 0.00;
+
+            for (w = 0; w < world; w++)
+                sum += slots[(size_t)w * CT_SHM_CHUNK + i];
+
+            result[i] = sum * inv;
+        }
+
+        _ct_shm_barrier(data->hdr);
+
+        memcpy(&tensor->data[off], result, len * sizeof(ctensor_data_t));
+    }
+
+    return;
+}
+
+/*
+ *  Part of [off, off + len) within this worker's shard
+ *  of an n elements tensor, relative to 'off'.
+*/
+static inline void _ct_shm_shard(CTensor_Comm_s *comm, size_t n, size_t off, size_t len,
+                    size_t *lo, size_t *hi)
+{
+    size_t slo, shi;
+
+    slo = n * comm->rank / comm->world_size;
+    shi = n * (comm->rank + 1) / comm->world_size;
+
+    // No overlap.
+    if (shi <= off || slo >= off + len) {
+        *lo = 0;
+        *hi = 0;
+        return;
+    }
+
+    *lo = (slo > off) ? slo - off : 0;
+    *hi = (shi < off + len) ? shi - off : len;
+
+    return;
+}
+
+/*
+ *  Average this worker's shard of a tensor across all
+ *  workers.
+ *
+ *  Same as the allreduce, but every worker reduces the part
+ *  of each chunk within its shard straight into its own
+ *  tensor, nothing is copied back.
+ *
+ *  @param comm - Communicator.
+ *  @param tensor - Tensor to be reduced, in place.
+*/
+static void ctensor_shm_reduce_scatter(CTensor_Comm_s *comm, CTensor_s *tensor)
+{
+    ctensor_data_t *slots, sum, inv;
+    size_t off, len, lo, hi, i;
+    _shm_s *data;
+    int w, world;
+
+    data = (_shm_s *)comm->internal;
+
+    world = comm->world_size;
+    slots = data->slots;
+
+    inv = 1.00 / (ctensor_data_t)world;
+
+    for (off = 0; off < tensor->size; off += len) {
+        len = tensor->size - off;
+
+        if (len > CT_SHM_CHUNK)
+            len = CT_SHM_CHUNK;
+
+        memcpy(&slots[(size_t)comm->rank * CT_SHM_CHUNK], &tensor->data[off],
+                len * sizeof(ctensor_data_t));
+
+        _ct_shm_barrier(data->hdr);
+
+        _ct_shm_shard(comm, tensor->size, off, len, &lo, &hi);
+
+        for (i = lo; i < hi; i++) {
+            sum = 0.00;
+
+            for (w = 0; w < world; w++)
+                sum += slots[(size_t)w * CT_SHM_CHUNK + i];
+
+            tensor->data[off + i] = sum * inv;
+        }
+
+        // Slots are reused by the next chunk.
+        _ct_shm_barrier(data->hdr);
+    }
+
+    return;
+}
+
+/*
+ *  Gather every worker's shard of a tensor, each worker
+ *  copies its part of every chunk into the result slot.
+ *
+ *  @param comm - Communicator.
+ *  @param tensor - Tensor to be gathered, in place.
+*/
+static void ctensor_shm_allgather(CTensor_Comm_s *comm, CTensor_s *tensor)
+{
+    ctensor_data_t *result;
+    size_t off, len, lo, hi;
+    _shm_s *data;
+
+    data = (_shm_s *)comm->internal;
+
+    result = &data->slots[(size_t)comm->world_size * CT_SHM_CHUNK];
+
+    for (off = 0; off < tensor->size; off += len) {
+        len = tensor->size - off;
+
+        if (len > CT_SHM_CHUNK)
+            len = CT_SHM_CHUNK;
+
+        _ct_shm_shard(comm, tensor->size, off, len, &lo, &hi);
+
+        memcpy(&result[lo], &tensor->data[off + lo], (hi - lo) * sizeof(ctensor_data_t));
+
+        _ct_shm_barrier(data->hdr);
+
+        memcpy(&tensor->data[off], result, len * sizeof(ctensor_data_t));
+
+        _ct_shm_barrier(data->hdr);
+    }
+
+    return;
+}
+
+static void ctensor_shm_del(CTensor_Comm_s *comm)
+{
+    _shm_s *data;
+
+    data = (_shm_s *)comm->internal;
+
+    munmap((void *)data->hdr, data->map_size);
+    free(data);
+
+    comm->internal = NULL;
+
+    if (comm->compressor != NULL) {
+        comm->compressor->del((void *)comm->compressor);
+        free(comm->compressor);
+        comm->compressor = NULL;
+    }
+
+    return;
+}
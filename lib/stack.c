@@ -0,0 +1,527 @@
+/*
+ *  Stacked multi-model training for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctensor/ctensor.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+void ctensor_fcl_fwd(CTensor_Layer_s *layer);
+void ctensor_fcl_bckp(CTensor_Layer_s *layer);
+
+void _ct_set_segments(CTensor_Model_s *model, size_t lo, size_t hi);
+void _ct_fuse(CTensor_Model_s *model, int enable);
+
+ctensor_data_t _ct_sched_lr(CTensor_Model_s *model, size_t step, size_t total);
+
+/*
+ *  M models of the same architecture are trained together,
+ *  on the same batches. Every layer's parameters, gradients
+ *  and outputs of all models are stacked into one buffer per
+ *  layer (model m's part at offset m * size), and the models'
+ *  own tensors are pointed into them while training.
+ *
+ *  Passes go layer by layer over all models, FCLs as a single
+ *  batched matrix-vector product over the model dimension
+ *  (reusing the shared input for the first one), other layers
+ *  through each model's callbacks. Each model then steps with
+ *  its own optimizer, learning rate and schedule.
+*/
+
+typedef struct {
+    // This layer, in each of the models.
+    CTensor_Layer_s     **layers;
+    int                 fcl;
+    size_t              in_size;
+    size_t              out_size;
+    size_t              params_size;
+    // Stacked buffers (M of each).
+    ctensor_data_t      *out;
+    ctensor_data_t      *params;
+    ctensor_data_t      *grad;
+    // Gradients accumulated over the batch.
+    ctensor_data_t      *acc;
+    // The models' own buffers, restored once done.
+    ctensor_data_t      **own_out;
+    ctensor_data_t      **own_params;
+    ctensor_data_t      **own_grad;
+} _ct_stack_layer_s;
+
+typedef struct {
+    CTensor_Model_s     **models;
+    size_t              nmodels;
+    // Layers past the input one, first to last.
+    _ct_stack_layer_s   *layers;
+    size_t              nlayers;
+    // Per-model flat gradient vector, for its optimizer.
+    CTensor_s           *flat;
+} _ct_stack_s;
+
+/*
+ *  Whether all models share the same architecture and
+ *  training setup.
+*/
+static int _ct_stack_check(CTensor_Model_s **models, size_t m)
+{
+    CTensor_Layer_s *a, *b;
+    size_t i;
+
+    for (i = 0; i < m; i++) {
+        if (models[i]->lossl == NULL || models[i]->optimizer == NULL ||
+                    models[i]->graph != NULL)
+            return 0;
+
+        if (models[i]->batch_size != models[0]->batch_size ||
+                    models[i]->batches != models[0]->batches ||
+                    models[i]->epochs != models[0]->epochs ||
+                    models[i]->lossl->fwd != models[0]->lossl->fwd)
+            return 0;
+
+        a = models[0]->startl;
+        b = models[i]->startl;
+
+        while (a != NULL && b != NULL) {
+            if (a->out->size != b->out->size || a->fwd != b->fwd ||
+                        (a->internal_params == NULL) != (b->internal_params == NULL) ||
+                        (a->internal_params != NULL &&
+                        a->internal_params->size != b->internal_params->size))
+                return 0;
+
+            a = a->next;
+            b = b->next;
+        }
+
+        if (a != NULL || b != NULL)
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ *  Point the models' tensors into the stacked buffers (or
+ *  back to their own, copying the parameters back).
+*/
+static void _ct_stack_swap(_ct_stack_s *st, int restore)
+{
+    _ct_stack_layer_s *sl;
+    CTensor_Layer_s *layer;
+    size_t l, m;
+
+    for (l = 0; l < st->nlayers; l++) {
+        sl = &st->layers[l];
+
+        for (m = 0; m < st->nmodels; m++) {
+            layer = sl->layers[m];
+
+            if (restore) {
+                layer->out->data = sl->own_out[m];
+
+                if (sl->params_size == 0)
+                    continue;
+
+                memcpy(sl->own_params[m], &sl->params[m * sl->params_size],
+                            sl->params_size * sizeof(ctensor_data_t));
+
+                layer->internal_params->data = sl->own_params[m];
+                layer->internal_grad->data = sl->own_grad[m];
+
+                continue;
+            }
+
+            sl->own_out[m] = layer->out->data;
+            layer->out->data = &sl->out[m * sl->out_size];
+
+            if (sl->params_size == 0)
+                continue;
+
+            sl->own_params[m] = layer->internal_params->data;
+            sl->own_grad[m] = layer->internal_grad->data;
+
+            memcpy(&sl->params[m * sl->params_size], sl->own_params[m],
+                        sl->params_size * sizeof(ctensor_data_t));
+
+            layer->internal_params->data = &sl->params[m * sl->params_size];
+            layer->internal_grad->data = &sl->grad[m * sl->params_size];
+        }
+    }
+
+    return;
+}
+
+static void _ct_stack_free(_ct_stack_s *st)
+{
+    _ct_stack_layer_s *sl;
+    size_t l, m;
+
+    for (l = 0; st->layers != NULL && l < st->nlayers; l++) {
+        sl = &st->layers[l];
+
+        free(sl->layers);
+        free(sl->out);
+        free(sl->params);
+        free(sl->grad);
+        free(sl->acc);
+        free(sl->own_out);
+        free(sl->own_params);
+        free(sl->own_grad);
+    }
+
+    for (m = 0; st->flat != NULL && m < st->nmodels; m++)
+        free(st->flat[m].data);
+
+    free(st->layers);
+    free(st->flat);
+
+    return;
+}
+
+static int _ct_stack_new(_ct_stack_s *st, CTensor_Model_s **models, size_t m)
+{
+    CTensor_Layer_s *pos;
+    _ct_stack_layer_s *sl;
+    size_t l, i, grad_size = 0;
+
+    memset(st, 0, sizeof(_ct_stack_s));
+
+    st->models = models;
+    st->nmodels = m;
+
+    for (pos = models[0]->startl->next; pos != NULL; pos = pos->next)
+        st->nlayers++;
+
+    st->layers = (_ct_stack_layer_s *)calloc(st->nlayers, sizeof(_ct_stack_layer_s));
+    st->flat = (CTensor_s *)calloc(m, sizeof(CTensor_s));
+
+    if (st->layers == NULL || st->flat == NULL)
+        return -1;
+
+    for (l = 0, pos = models[0]->startl->next; pos != NULL; l++, pos = pos->next) {
+        sl = &st->layers[l];
+
+        sl->fcl = (pos->fwd == (CTensor_Layer_cb)ctensor_fcl_fwd);
+        sl->in_size = pos->in->size;
+        sl->out_size = pos->out->size;
+        sl->params_size = (pos->internal_params != NULL) ? pos->internal_params->size : 0;
+
+        grad_size += sl->params_size;
+
+        sl->layers = (CTensor_Layer_s **)malloc(m * sizeof(CTensor_Layer_s *));
+        sl->out = (ctensor_data_t *)malloc(m * sl->out_size * sizeof(ctensor_data_t));
+        sl->own_out = (ctensor_data_t **)malloc(m * sizeof(ctensor_data_t *));
+
+        if (sl->layers == NULL || sl->out == NULL || sl->own_out == NULL)
+            return -1;
+
+        if (sl->params_size != 0) {
+            sl->params = (ctensor_data_t *)malloc(m * sl->params_size * sizeof(ctensor_data_t));
+            sl->grad = (ctensor_data_t *)malloc(m * sl->params_size * sizeof(ctensor_data_t));
+            sl->acc = (ctensor_data_t *)calloc(m * sl->params_size, sizeof(ctensor_data_t));
+            sl->own_params = (ctensor_data_t **)malloc(m * sizeof(ctensor_data_t *));
+            sl->own_grad = (ctensor_data_t **)malloc(m * sizeof(ctensor_data_t *));
+
+            if (sl->params == NULL || sl->grad == NULL || sl->acc == NULL ||
+                        sl->own_params == NULL || sl->own_grad == NULL)
+                return -1;
+        }
+    }
+
+    for (i = 0; i < m; i++) {
+        for (l = 0, pos = models[i]->startl->next; pos != NULL; l++, pos = pos->next)
+            st->layers[l].layers[i] = pos;
+
+        st->flat[i].size = grad_size;
+        st->flat[i].data = (ctensor_data_t *)calloc(grad_size, sizeof(ctensor_data_t));
+
+        if (st->flat[i].data == NULL)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ *  FCL forward pass of every model, O_m = W_m • X_m + B_m.
+*/
+static void _ct_stack_fcl_fwd(_ct_stack_layer_s *sl, size_t m)
+{
+    ctensor_data_t *kernel, *out;
+    size_t i, in_s, out_s;
+
+    in_s = sl->in_size;
+    out_s = sl->out_size;
+
+    for (i = 0; i < m; i++) {
+        kernel = &sl->params[i * sl->params_size];
+        out = &sl->out[i * out_s];
+
+        ctensor_mv_dot_product(kernel, out_s, in_s, sl->layers[i]->in->data, out);
+        ctensor_vector_sum(out, out_s, &kernel[out_s * in_s], out);
+    }
+
+    return;
+}
+
+/*
+ *  FCL backward pass of every model. The gradient with
+ *  respect to the inputs is skipped for the first layer,
+ *  there's nobody to hand it to.
+*/
+static void _ct_stack_fcl_bckp(_ct_stack_layer_s *sl, size_t m, int first)
+{
+    ctensor_data_t *kernel, *kernel_grad, *in, *in_grad, *loss_grad, g;
+    size_t i, j, k, in_s, out_s;
+
+    in_s = sl->in_size;
+    out_s = sl->out_size;
+
+    for (k = 0; k < m; k++) {
+        kernel = &sl->params[k * sl->params_size];
+        kernel_grad = &sl->grad[k * sl->params_size];
+
+        in = sl->layers[k]->in->data;
+        in_grad = sl->layers[k]->in_grad->data;
+        loss_grad = sl->layers[k]->loss_grad->data;
+
+        if (!first) {
+            for (j = 0; j < in_s; j++)
+                in_grad[j] = 0.00;
+
+            for (i = 0; i < out_s; i++) {
+                g = loss_grad[i];
+
+                for (j = 0; j < in_s; j++)
+                    in_grad[j] += kernel[i * in_s + j] * g;
+            }
+        }
+
+        for (i = 0; i < out_s; i++) {
+            g = loss_grad[i];
+
+            for (j = 0; j < in_s; j++)
+                kernel_grad[i * in_s + j] = in[j] * g;
+
+            kernel_grad[out_s * in_s + i] = g;
+        }
+    }
+
+    return;
+}
+
+/*
+ *  Forward and backward pass of one example, through
+ *  every model.
+*/
+static void _ct_stack_sample(_ct_stack_s *st, CTensor_s *x, CTensor_s *y,
+                    ctensor_data_t *losses)
+{
+    _ct_stack_layer_s *sl;
+    CTensor_Loss_s *lossl;
+    size_t l, i, m;
+
+    m = st->nmodels;
+
+    for (i = 0; i < m; i++)
+        st->models[i]->startl->out->data = x->data;
+
+    for (l = 0; l < st->nlayers; l++) {
+        sl = &st->layers[l];
+
+        if (sl->fcl) {
+            _ct_stack_fcl_fwd(sl, m);
+            continue;
+        }
+
+        for (i = 0; i < m; i++)
+            sl->layers[i]->fwd(sl->layers[i]);
+    }
+
+    for (i = 0; i < m; i++) {
+        lossl = st->models[i]->lossl;
+
+        losses[i] += lossl->fwd(lossl, y);
+        lossl->bckp(lossl, y);
+    }
+
+    for (l = st->nlayers; l-- > 0;) {
+        sl = &st->layers[l];
+
+        if (sl->fcl) {
+            _ct_stack_fcl_bckp(sl, m, l == 0);
+        } else {
+            for (i = 0; i < m; i++)
+                sl->layers[i]->bckp(sl->layers[i]);
+        }
+
+        // All models' gradients at once.
+        if (sl->params_size != 0)
+            ctensor_vector_sum(sl->grad, m * sl->params_size, sl->acc, sl->acc);
+    }
+
+    return;
+}
+
+/*
+ *  Optimization step of model i, over its part of the
+ *  accumulated gradients.
+*/
+static void _ct_stack_step(_ct_stack_s *st, size_t i, size_t step, size_t total)
+{
+    ctensor_data_t *flat, lr;
+    CTensor_Model_s *model;
+    _ct_stack_layer_s *sl;
+    size_t l, size;
+
+    model = st->models[i];
+
+    lr = _ct_sched_lr(model, step, total);
+
+    // Same layout as the model's own gradient vector,
+    // last layer first.
+    flat = st->flat[i].data;
+
+    for (l = st->nlayers; l-- > 0;) {
+        sl = &st->layers[l];
+        size = sl->params_size;
+
+        if (size == 0)
+            continue;
+
+        memcpy(flat, &sl->acc[i * size], size * sizeof(ctensor_data_t));
+        memset(&sl->acc[i * size], 0, size * sizeof(ctensor_data_t));
+
+        flat += size;
+    }
+
+    ctensor_sv_mult(st->flat[i].data, st->flat[i].size,
+                1.00 / (ctensor_data_t)model->batch_size, st->flat[i].data);
+
+    model->optimizer->opt((void *)model->optimizer, &st->flat[i], lr);
+
+    flat = st->flat[i].data;
+
+    for (l = st->nlayers; l-- > 0;) {
+        sl = &st->layers[l];
+        size = sl->params_size;
+
+        if (size == 0)
+            continue;
+
+        memcpy(sl->layers[i]->internal_grad->data, flat, size * sizeof(ctensor_data_t));
+        sl->layers[i]->update(sl->layers[i]);
+
+        flat += size;
+    }
+
+    return;
+}
+
+/*
+ *  Train several models of the same architecture (layer
+ *  sizes and kinds, loss, 'epochs', 'batches' and
+ *  'batch_size') together, on the same batches, stacking
+ *  their layers.
+ *
+ *  Each model steps with its own optimizer, learning rate
+ *  and schedule. Validation and early stopping, gradient
+ *  accumulation and parallelism settings aren't used.
+ *
+ *  @param models - Models to train.
+ *  @param m - Number of models.
+ *  @param get_nbatch - Batch loading callback.
+ *  @param losses - If not NULL, set to each model's average
+ *  training loss over the last epoch.
+ *
+ *  @return - 0 on success, -1 on failure.
+*/
+int ctensor_stack_train(CTensor_Model_s **models, size_t m, CTensor_Batch_cb get_nbatch,
+                    ctensor_data_t *losses)
+{
+    size_t epoch, batch, i, k, in_s, out_s, step = 0, total;
+    CTensor_s *x_train, *y_train, x, y;
+    ctensor_data_t *epoch_loss;
+    CTensor_Model_s *model;
+    _ct_stack_s st;
+
+    // FCLs are batched as they were added.
+    for (i = 0; i < m; i++)
+        _ct_fuse(models[i], 0);
+
+    if (m == 0 || !_ct_stack_check(models, m))
+        return -1;
+
+    epoch_loss = (ctensor_data_t *)calloc(m, sizeof(ctensor_data_t));
+
+    if (epoch_loss == NULL)
+        return -1;
+
+    if (_ct_stack_new(&st, models, m) != 0) {
+        _ct_stack_free(&st);
+        free(epoch_loss);
+        return -1;
+    }
+
+    _ct_stack_swap(&st, 0);
+
+    model = models[0];
+
+    for (i = 0; i < m; i++)
+        _ct_set_segments(models[i], 0, st.flat[i].size);
+
+    // One optimization step per batch.
+    total = model->epochs * model->batches;
+
+    in_s = model->startl->out->size;
+    out_s = model->lastl->out->size;
+
+    x.size = in_s;
+    y.size = out_s;
+
+    for (epoch = 0; epoch < model->epochs; epoch++) {
+        memset(epoch_loss, 0, m * sizeof(ctensor_data_t));
+
+        for (batch = 0; batch < model->batches; batch++) {
+            get_nbatch(&x_train, &y_train, batch);
+
+            for (k = 0; k < model->batch_size; k++) {
+                x.data = &x_train->data[k * in_s];
+                y.data = &y_train->data[k * out_s];
+
+                _ct_stack_sample(&st, &x, &y, epoch_loss);
+            }
+
+            for (i = 0; i < m; i++)
+                _ct_stack_step(&st, i, step, total);
+
+            step++;
+        }
+
+        for (i = 0; i < m; i++) {
+            models[i]->stop_epoch = epoch + 1;
+
+            if (losses != NULL)
+                losses[i] = epoch_loss[i] / (ctensor_data_t)(model->batches * model->batch_size);
+        }
+    }
+
+    _ct_stack_swap(&st, 1);
+    _ct_stack_free(&st);
+
+    free(epoch_loss);
+
+    return 0;
+}
@@ -0,0 +1,287 @@
+/*
+ *  Hyperparameter sweeps for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctensor/ctensor.h>
+
+#include <stdatomic.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+void _ct_parallel_for(size_t n, void (*fn)(void *, size_t), void *arg);
+void *_ct_pool_context(void);
+void *_ct_pool_set_context(void *ctx);
+
+/*
+ *  Small models don't have enough work to be split across
+ *  threads, so sweeps run whole models in parallel instead,
+ *  one per pool thread, each grabbing the next run once
+ *  done with the previous one. Models are only touched by
+ *  the thread training them, and share the (read-only)
+ *  datasets.
+*/
+typedef struct {
+    CTensor_Sweep_cb        build;
+    void                    *arg;
+    size_t                  runs;
+    const CTensor_Dataset_s *train;
+    const CTensor_Dataset_s *val;
+    CTensor_Run_s           *results;
+    _Atomic size_t          next;
+} _ct_sweep_s;
+
+/*
+ *  The batch callback has no way to tell runs apart, each
+ *  run is the pool context of its jobs, so that replicas
+ *  (e.g. Hogwild!) get their run's batches whichever
+ *  thread they run on.
+ *
+ *  Batch views are the run's own too, training moves them
+ *  along the batch, while the thread may run other runs'
+ *  jobs. Replicas copy them (under a lock) straight away.
+*/
+typedef struct {
+    const CTensor_Dataset_s *ds;
+    size_t                  bs;
+    CTensor_s               x;
+    CTensor_s               y;
+} _ct_sweep_ctx_s;
+
+static void _ct_sweep_batch(CTensor_s **x_train, CTensor_s **y_train, int batch)
+{
+    _ct_sweep_ctx_s *ctx;
+    size_t first;
+
+    ctx = (_ct_sweep_ctx_s *)_ct_pool_context();
+
+    first = (size_t)batch * ctx->bs;
+
+    ctx->x.size = ctx->bs * ctx->ds->in_size;
+    ctx->x.data = &ctx->ds->x.data[first * ctx->ds->in_size];
+
+    ctx->y.size = ctx->bs * ctx->ds->out_size;
+    ctx->y.data = &ctx->ds->y.data[first * ctx->ds->out_size];
+
+    *x_train = &ctx->x;
+    *y_train = &ctx->y;
+
+    return;
+}
+
+static inline size_t _ct_argmax(const ctensor_data_t *v, size_t n)
+{
+    size_t i, best = 0;
+
+    for (i = 1; i < n; i++) {
+        if (v[i] > v[best])
+            best = i;
+    }
+
+    return best;
+}
+
+/*
+ *  Fraction of examples whose largest output matches
+ *  the largest expected one.
+*/
+static ctensor_data_t _ct_sweep_accuracy(CTensor_Model_s *model, const CTensor_Dataset_s *ds)
+{
+    size_t i, hits = 0;
+    CTensor_s x, *out;
+
+    x.size = ds->in_size;
+
+    for (i = 0; i < ds->samples; i++) {
+        x.data = &ds->x.data[i * ds->in_size];
+
+        out = ctensor_predict(model, &x);
+
+        if (_ct_argmax(out->data, out->size) ==
+                    _ct_argmax(&ds->y.data[i * ds->out_size], ds->out_size))
+            hits++;
+    }
+
+    return (ctensor_data_t)hits / (ctensor_data_t)ds->samples;
+}
+
+static void _ct_sweep_run(_ct_sweep_s *sw, size_t run)
+{
+    struct timespec start, end;
+    CTensor_s *x_val, *y_val;
+    CTensor_Model_s model;
+    _ct_sweep_ctx_s ctx;
+    CTensor_Run_s *res;
+    size_t batches;
+    void *prev;
+
+    res = &sw->results[run];
+
+    res->loss = NAN;
+    res->vloss = NAN;
+    res->accuracy = NAN;
+    res->epochs = 0;
+    res->seconds = 0.00;
+    res->error = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    memset(&model, 0, sizeof(CTensor_Model_s));
+
+    sw->build(&model, run, sw->arg);
+
+    batches = (model.batch_size == 0) ? 0 : sw->train->samples / model.batch_size;
+
+    if (batches == 0 || model.startl == NULL || model.lossl == NULL ||
+                model.startl->out->size != sw->train->in_size ||
+                model.lastl->out->size != sw->train->out_size) {
+        res->error = -1;
+        ctensor_destroy(&model);
+        return;
+    }
+
+    // Default to whole epochs over the training set.
+    if (model.batches == 0 || model.batches > batches)
+        model.batches = batches;
+
+    ctx.ds = sw->train;
+    ctx.bs = model.batch_size;
+
+    x_val = (sw->val != NULL) ? (CTensor_s *)&sw->val->x : NULL;
+    y_val = (sw->val != NULL) ? (CTensor_s *)&sw->val->y : NULL;
+
+    prev = _ct_pool_set_context(&ctx);
+
+    res->loss = ctensor_train(&model, _ct_sweep_batch, x_val, y_val);
+    res->epochs = model.stop_epoch;
+
+    _ct_pool_set_context(prev);
+
+    if (sw->val != NULL) {
+        res->vloss = ctensor_evaluate(&model, x_val, y_val);
+        res->accuracy = _ct_sweep_accuracy(&model, sw->val);
+    }
+
+    ctensor_destroy(&model);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    res->seconds = (double)(end.tv_sec - start.tv_sec) +
+                    (double)(end.tv_nsec - start.tv_nsec) * 1e-9;
+
+    return;
+}
+
+static void _ct_sweep_worker(void *arg, size_t t)
+{
+    _ct_sweep_s *sw;
+    size_t run;
+
+    sw = (_ct_sweep_s *)arg;
+
+    for (;;) {
+        run = atomic_fetch_add(&sw->next, 1);
+
+        if (run >= sw->runs)
+            break;
+
+        _ct_sweep_run(sw, run);
+    }
+
+    return;
+}
+
+/*
+ *  Train 'runs' independent models in parallel, one per
+ *  pool thread (see ctensor_set_threads).
+ *
+ *  @param build - Sets up each run's model.
+ *  @param arg - Argument for 'build'.
+ *  @param runs - Number of runs.
+ *  @param train - Training set.
+ *  @param val - Validation set (may be NULL).
+ *  @param results - Per-run results ('runs' of them).
+ *
+ *  @return - Number of runs that failed.
+*/
+size_t ctensor_sweep(CTensor_Sweep_cb build, void *arg, size_t runs,
+                    const CTensor_Dataset_s *train, const CTensor_Dataset_s *val,
+                    CTensor_Run_s *results)
+{
+    size_t i, threads, failed = 0;
+    _ct_sweep_s sw;
+
+    sw.build = build;
+    sw.arg = arg;
+    sw.runs = runs;
+    sw.train = train;
+    sw.val = val;
+    sw.results = results;
+
+    atomic_init(&sw.next, 0);
+
+    threads = ctensor_get_threads();
+    threads = (threads < runs) ? threads : runs;
+
+    _ct_parallel_for(threads, _ct_sweep_worker, &sw);
+
+    for (i = 0; i < runs; i++) {
+        if (results[i].error != 0)
+            failed++;
+    }
+
+    return failed;
+}
+
+/*
+ *  Print a sweep's per-run results, and its best run
+ *  (by validation loss, or training loss without one).
+ *
+ *  @param results - Per-run results.
+ *  @param runs - Number of runs.
+ *  @param stream - Stream to print to.
+*/
+void ctensor_sweep_report(const CTensor_Run_s *results, size_t runs, FILE *stream)
+{
+    ctensor_data_t score, best_score = INFINITY;
+    size_t i, best = runs;
+
+    fprintf(stream, "%-6s %6s %12s %12s %9s %10s\n", "run", "epochs",
+            "loss", "val_loss", "accuracy", "seconds");
+
+    for (i = 0; i < runs; i++) {
+        if (results[i].error != 0) {
+            fprintf(stream, "%-6zu failed\n", i);
+            continue;
+        }
+
+        fprintf(stream, "%-6zu %6zu %12.6f %12.6f %9.4f %10.3f\n", i,
+                results[i].epochs, results[i].loss, results[i].vloss,
+                results[i].accuracy, results[i].seconds);
+
+        score = isnan(results[i].vloss) ? results[i].loss : results[i].vloss;
+
+        if (score < best_score) {
+            best_score = score;
+            best = i;
+        }
+    }
+
+    if (best != runs)
+        fprintf(stream, "best run %zu\n", best);
+
+    return;
+}
@@ -21,53 +21,6 @@
 #include <stddef.h>
 #include <stdlib.h>
 
-/*
- *  Allocate a new tensor.
- *
- *  @param size - Size of the new tensor.
- *
- *  @return - New allocated tensor pointer.
-*/
-CTensor_s *ctensor_new_tensor(size_t size)
-{
-    CTensor_s *tensor;
-
-    tensor = malloc(sizeof(CTensor_s));
-
-    // Something went wrong with allocating a new
-    // tensor; we'll return NULL to indicate an issue.
-    if (tensor == NULL)
-        return NULL;
-
-    // As of now, treat all tensors as 1-D Tensors.
-    tensor->size = size;
-    tensor->data = malloc(size * sizeof(ctensor_data_t));
-
-    // Something went wrong with allocating data, 
-    // we'll free our tensor struct, and return
-    // NULL to indicate an issue.
-    if (tensor->data == NULL) {
-        free(tensor);
-        return NULL;
-    }
-
-    return tensor;
-}
-
-/*
- *  De-allocate tensor.
- *
- *  @param tensor - Pointer to the tensor struct
- *  to be de-allocated.
-*/
-void ctensor_destroy_tensor(CTensor_s *tensor)
-{
-    free(tensor->data);
-    free(tensor);
-
-    return;
-}
-
 /*
  *  Set the whole tensor to zeros.
  *
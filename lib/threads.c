@@ -0,0 +1,577 @@
+/*
+ *  Thread pool for CTensor.
+ *  Copyright (C) 2023 Diego Roux
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation, version 3 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <ctensor/ctensor.h>
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef void (*_ct_task_cb)(void *, size_t);
+
+int _ct_numa_pin(size_t t);
+int _ct_numa_cpu(size_t t);
+int _ct_numa_node_of(int cpu);
+
+/*
+ *  A single work-stealing pool shared by all parallel
+ *  kernels, its workers are started on first use.
+ *
+ *  Every thread has a deque of tasks. Jobs submitted from
+ *  outside the pool have task i pushed to thread i % threads,
+ *  so that per-thread data (e.g. the shards of a layer) tends
+ *  to stay on the same core, and node; only best-effort, as
+ *  idle threads steal. Jobs submitted from a task
+ *  (e.g. replicas running parallel layers) are pushed to the
+ *  submitting thread's own deque. Threads run their own
+ *  tasks newest first, and steal the oldest ones of others
+ *  once out of work.
+ *
+ *  A thread waiting for its job runs tasks meanwhile, but
+ *  only those nested deeper than the task it's in, so that
+ *  a task is never interleaved with one of its own kind
+ *  (e.g. another sweep run). Threads calling from outside
+ *  the pool share the deque of thread 0.
+ *
+ *  Tasks may run on any thread, so state their callees
+ *  can't be handed (e.g. a sweep run's dataset, for its
+ *  batch callback) goes in the job's context: set by the
+ *  submitting thread, and seen by whichever runs the task.
+*/
+typedef struct {
+    _ct_task_cb         fn;
+    void                *arg;
+    void                *ctx;
+    // Nesting depth, 1 for jobs submitted from outside.
+    size_t              level;
+    atomic_size_t       pending;
+} _ct_job_s;
+
+typedef struct {
+    _ct_job_s           *job;
+    size_t              i;
+} _ct_task_s;
+
+// Live tasks are [head, tail).
+typedef struct {
+    pthread_mutex_t     lock;
+    _ct_task_s          *tasks;
+    size_t              head;
+    size_t              tail;
+    size_t              cap;
+} _ct_deque_s;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    pthread_cond_t  done;
+    pthread_t       *threads;
+    _ct_deque_s     *deques;
+    size_t          ndeques;
+    // Workers started, not counting the caller.
+    size_t          nworkers;
+    // Threads requested (0 = one per online CPU).
+    size_t          requested;
+    int             running;
+    int             stop;
+    // Jobs submitted from outside, in progress.
+    size_t          busy;
+    // Bumped when tasks are pushed, or a job is done.
+    unsigned long   gen;
+} _ct_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+// This thread's deque, and the level of the task it runs
+// (0 when none).
+static __thread size_t _ct_pool_self;
+static __thread size_t _ct_pool_level;
+// Context of the job being run, inherited by nested jobs.
+static __thread void *_ct_pool_ctx;
+
+/*
+ *  Push tasks [lo, n) of a job, every 'stride'-th one, to
+ *  a deque.
+*/
+static int _ct_deque_push(_ct_deque_s *dq, _ct_job_s *job, size_t lo,
+                    size_t n, size_t stride)
+{
+    size_t count, cap;
+    _ct_task_s *tasks;
+
+    count = (lo < n) ? (n - lo + stride - 1) / stride : 0;
+
+    pthread_mutex_lock(&dq->lock);
+
+    if (dq->tail + count > dq->cap && dq->head != 0) {
+        // Reclaim the stolen slots first.
+        memmove(dq->tasks, &dq->tasks[dq->head],
+                    (dq->tail - dq->head) * sizeof(_ct_task_s));
+        dq->tail -= dq->head;
+        dq->head = 0;
+    }
+
+    if (dq->tail + count > dq->cap) {
+        cap = (dq->cap == 0) ? 64 : dq->cap;
+
+        while (cap < dq->tail + count)
+            cap *= 2;
+
+        tasks = (_ct_task_s *)realloc(dq->tasks, cap * sizeof(_ct_task_s));
+
+        if (tasks == NULL) {
+            pthread_mutex_unlock(&dq->lock);
+            return -1;
+        }
+
+        dq->tasks = tasks;
+        dq->cap = cap;
+    }
+
+    // Highest index first, owners pop from the tail.
+    for (; count > 0; count--) {
+        dq->tasks[dq->tail].job = job;
+        dq->tasks[dq->tail].i = lo + (count - 1) * stride;
+        dq->tail++;
+    }
+
+    pthread_mutex_unlock(&dq->lock);
+
+    return 0;
+}
+
+/*
+ *  Take a task nested deeper than 'level', from the tail
+ *  (owner) or the head (thief).
+*/
+static int _ct_deque_take(_ct_deque_s *dq, size_t level, int owner, _ct_task_s *task)
+{
+    size_t k, found;
+
+    pthread_mutex_lock(&dq->lock);
+
+    found = dq->tail;
+
+    for (k = 0; k < dq->tail - dq->head; k++) {
+        found = owner ? dq->tail - 1 - k : dq->head + k;
+
+        if (dq->tasks[found].job->level > level)
+            break;
+
+        found = dq->tail;
+    }
+
+    if (found == dq->tail) {
+        pthread_mutex_unlock(&dq->lock);
+        return 0;
+    }
+
+    *task = dq->tasks[found];
+
+    if (found == dq->head) {
+        dq->head++;
+    } else {
+        memmove(&dq->tasks[found], &dq->tasks[found + 1],
+                    (dq->tail - found - 1) * sizeof(_ct_task_s));
+        dq->tail--;
+    }
+
+    pthread_mutex_unlock(&dq->lock);
+
+    return 1;
+}
+
+/*
+ *  Find a task for this thread, its own deque first.
+*/
+static int _ct_pool_find(_ct_task_s *task)
+{
+    size_t k, t, threads;
+
+    threads = _ct_pool.ndeques;
+
+    for (k = 0; k < threads; k++) {
+        t = (_ct_pool_self + k) % threads;
+
+        if (_ct_deque_take(&_ct_pool.deques[t], _ct_pool_level, k == 0, task))
+            return 1;
+    }
+
+    return 0;
+}
+
+static void _ct_pool_exec(_ct_task_s *task)
+{
+    _ct_job_s *job;
+    size_t level;
+    void *ctx;
+
+    job = task->job;
+    level = _ct_pool_level;
+    ctx = _ct_pool_ctx;
+
+    _ct_pool_level = job->level;
+    _ct_pool_ctx = job->ctx;
+    job->fn(job->arg, task->i);
+    _ct_pool_level = level;
+    _ct_pool_ctx = ctx;
+
+    // The job may be gone once its last task is done.
+    if (atomic_fetch_sub(&job->pending, 1) == 1) {
+        pthread_mutex_lock(&_ct_pool.lock);
+        _ct_pool.gen++;
+        pthread_cond_broadcast(&_ct_pool.cond);
+        pthread_mutex_unlock(&_ct_pool.lock);
+    }
+
+    return;
+}
+
+static void *_ct_pool_worker_fn(void *arg)
+{
+    unsigned long gen;
+    _ct_task_s task;
+
+    _ct_pool_self = (size_t)(uintptr_t)arg;
+    _ct_numa_pin(_ct_pool_self);
+
+    for (;;) {
+        pthread_mutex_lock(&_ct_pool.lock);
+        gen = _ct_pool.gen;
+
+        if (_ct_pool.stop)
+            break;
+
+        pthread_mutex_unlock(&_ct_pool.lock);
+
+        if (_ct_pool_find(&task)) {
+            _ct_pool_exec(&task);
+            continue;
+        }
+
+        pthread_mutex_lock(&_ct_pool.lock);
+
+        while (_ct_pool.gen == gen && !_ct_pool.stop)
+            pthread_cond_wait(&_ct_pool.cond, &_ct_pool.lock);
+
+        pthread_mutex_unlock(&_ct_pool.lock);
+    }
+
+    pthread_mutex_unlock(&_ct_pool.lock);
+
+    return NULL;
+}
+
+/*
+ *  Number of threads the pool shall have (pool lock held).
+*/
+static size_t _ct_pool_size(void)
+{
+    long cpus;
+
+    if (_ct_pool.requested != 0)
+        return _ct_pool.requested;
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (cpus < 1) ? 1 : (size_t)cpus;
+}
+
+/*
+ *  Start the workers (pool lock held).
+*/
+static void _ct_pool_start(void)
+{
+    size_t i, n;
+
+    _ct_pool.running = 1;
+    _ct_pool.stop = 0;
+    _ct_pool.nworkers = 0;
+
+    n = _ct_pool_size() - 1;
+
+    // Thread 0 is whoever calls from outside the pool,
+    // only workers are pinned.
+    if (n == 0)
+        return;
+
+    _ct_pool.threads = (pthread_t *)malloc(n * sizeof(pthread_t));
+    _ct_pool.deques = (_ct_deque_s *)calloc(n + 1, sizeof(_ct_deque_s));
+
+    if (_ct_pool.threads == NULL || _ct_pool.deques == NULL) {
+        free(_ct_pool.threads);
+        free(_ct_pool.deques);
+
+        _ct_pool.threads = NULL;
+        _ct_pool.deques = NULL;
+
+        return;
+    }
+
+    _ct_pool.ndeques = n + 1;
+
+    for (i = 0; i <= n; i++)
+        pthread_mutex_init(&_ct_pool.deques[i].lock, NULL);
+
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&_ct_pool.threads[i], NULL, _ct_pool_worker_fn,
+                    (void *)(uintptr_t)(i + 1)) != 0)
+            break;
+
+        _ct_pool.nworkers++;
+    }
+
+    return;
+}
+
+/*
+ *  Stop the workers (pool lock held, dropped meanwhile).
+*/
+static void _ct_pool_stop(void)
+{
+    size_t i;
+
+    _ct_pool.stop = 1;
+    pthread_cond_broadcast(&_ct_pool.cond);
+    pthread_mutex_unlock(&_ct_pool.lock);
+
+    for (i = 0; i < _ct_pool.nworkers; i++)
+        pthread_join(_ct_pool.threads[i], NULL);
+
+    pthread_mutex_lock(&_ct_pool.lock);
+
+    for (i = 0; i < _ct_pool.ndeques; i++) {
+        pthread_mutex_destroy(&_ct_pool.deques[i].lock);
+        free(_ct_pool.deques[i].tasks);
+    }
+
+    free(_ct_pool.threads);
+    free(_ct_pool.deques);
+
+    _ct_pool.threads = NULL;
+    _ct_pool.deques = NULL;
+    _ct_pool.ndeques = 0;
+    _ct_pool.nworkers = 0;
+    _ct_pool.running = 0;
+
+    pthread_cond_broadcast(&_ct_pool.done);
+
+    return;
+}
+
+/*
+ *  Set the number of threads used by parallel kernels
+ *  (including the calling thread).
+ *
+ *  @param threads - Number of threads, 0 for one per online CPU.
+*/
+void ctensor_set_threads(size_t threads)
+{
+    pthread_mutex_lock(&_ct_pool.lock);
+
+    // Wait for any job in progress, or another stop.
+    while (_ct_pool.busy || (_ct_pool.running && _ct_pool.stop))
+        pthread_cond_wait(&_ct_pool.done, &_ct_pool.lock);
+
+    _ct_pool.requested = threads;
+
+    if (_ct_pool.running)
+        _ct_pool_stop();
+
+    pthread_mutex_unlock(&_ct_pool.lock);
+
+    return;
+}
+
+/*
+ *  Number of threads used by parallel kernels.
+*/
+size_t ctensor_get_threads(void)
+{
+    size_t n;
+
+    pthread_mutex_lock(&_ct_pool.lock);
+    n = _ct_pool_size();
+    pthread_mutex_unlock(&_ct_pool.lock);
+
+    return n;
+}
+
+/*
+ *  NUMA node of the thread task t of a job (submitted
+ *  from outside the pool) is dealt to, -1 if it isn't
+ *  a pinned worker.
+*/
+int _ct_pool_node(size_t t)
+{
+    size_t slot = 0;
+
+    pthread_mutex_lock(&_ct_pool.lock);
+
+    if (_ct_pool.ndeques != 0)
+        slot = t % _ct_pool.ndeques;
+
+    // Deques of workers that couldn't be started have
+    // no owner.
+    if (slot > _ct_pool.nworkers)
+        slot = 0;
+
+    pthread_mutex_unlock(&_ct_pool.lock);
+
+    if (slot == 0)
+        return -1;
+
+    return _ct_numa_node_of(_ct_numa_cpu(slot));
+}
+
+/*
+ *  Context of the calling thread's job (NULL outside any).
+*/
+void *_ct_pool_context(void)
+{
+    return _ct_pool_ctx;
+}
+
+/*
+ *  Set the context of jobs submitted from now on by the
+ *  calling thread, until the task it runs returns.
+ *
+ *  @param ctx - Context.
+ *
+ *  @return - The previous context, to be restored.
+*/
+void *_ct_pool_set_context(void *ctx)
+{
+    void *prev;
+
+    prev = _ct_pool_ctx;
+    _ct_pool_ctx = ctx;
+
+    return prev;
+}
+
+/*
+ *  Run fn(arg, i) for every i in [0, n), spread over
+ *  the pool, returns once all of them are done.
+ *
+ *  Jobs may be submitted from tasks (nested), or from
+ *  several threads at once (e.g. pipeline stages); the
+ *  calling thread runs tasks until its job is done.
+ *
+ *  @param n - Number of tasks.
+ *  @param fn - Task function.
+ *  @param arg - Argument for 'fn'.
+*/
+void _ct_parallel_for(size_t n, _ct_task_cb fn, void *arg)
+{
+    size_t i, t, stride, threads = 1;
+    _ct_task_s task;
+    unsigned long gen;
+    _ct_job_s job;
+
+    if (n > 1) {
+        pthread_mutex_lock(&_ct_pool.lock);
+
+        if (_ct_pool_level == 0) {
+            // Wait for a pool being stopped.
+            while (_ct_pool.running && _ct_pool.stop)
+                pthread_cond_wait(&_ct_pool.done, &_ct_pool.lock);
+
+            if (!_ct_pool.running)
+                _ct_pool_start();
+        }
+
+        threads = _ct_pool.ndeques;
+
+        if (_ct_pool_level == 0 && threads > 1)
+            _ct_pool.busy++;
+
+        pthread_mutex_unlock(&_ct_pool.lock);
+    }
+
+    if (threads <= 1) {
+        for (i = 0; i < n; i++)
+            fn(arg, i);
+
+        return;
+    }
+
+    job.fn = fn;
+    job.arg = arg;
+    job.ctx = _ct_pool_ctx;
+    job.level = _ct_pool_level + 1;
+
+    atomic_init(&job.pending, n);
+
+    if (_ct_pool_level == 0) {
+        stride = threads;
+
+        for (t = 0; t < stride; t++) {
+            if (_ct_deque_push(&_ct_pool.deques[t], &job, t, n, stride) != 0)
+                break;
+        }
+    } else {
+        stride = 1;
+        t = (_ct_deque_push(&_ct_pool.deques[_ct_pool_self], &job, 0, n, 1) == 0);
+    }
+
+    pthread_mutex_lock(&_ct_pool.lock);
+    _ct_pool.gen++;
+    pthread_cond_broadcast(&_ct_pool.cond);
+    pthread_mutex_unlock(&_ct_pool.lock);
+
+    // Tasks that couldn't be queued run here.
+    task.job = &job;
+
+    for (; t < stride; t++) {
+        for (task.i = t; task.i < n; task.i += stride)
+            _ct_pool_exec(&task);
+    }
+
+    while (atomic_load(&job.pending) != 0) {
+        pthread_mutex_lock(&_ct_pool.lock);
+        gen = _ct_pool.gen;
+        pthread_mutex_unlock(&_ct_pool.lock);
+
+        if (_ct_pool_find(&task)) {
+            _ct_pool_exec(&task);
+            continue;
+        }
+
+        pthread_mutex_lock(&_ct_pool.lock);
+
+        while (_ct_pool.gen == gen && atomic_load(&job.pending) != 0)
+            pthread_cond_wait(&_ct_pool.cond, &_ct_pool.lock);
+
+        pthread_mutex_unlock(&_ct_pool.lock);
+    }
+
+    if (_ct_pool_level == 0) {
+        pthread_mutex_lock(&_ct_pool.lock);
+
+        if (--_ct_pool.busy == 0)
+            pthread_cond_broadcast(&_ct_pool.done);
+
+        pthread_mutex_unlock(&_ct_pool.lock);
+    }
+
+    return;
+}